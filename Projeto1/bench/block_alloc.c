@@ -0,0 +1,80 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_ROUNDS 2000
+#define BLOCKS_PER_THREAD 64
+
+static size_t rounds = DEFAULT_ROUNDS;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Allocates a batch of blocks and frees it again, like files being created,
+ * written for the first time and deleted.
+ */
+static void *worker(void *arg) {
+    (void)arg;
+    int blocks[BLOCKS_PER_THREAD];
+    for (size_t r = 0; r < rounds; r++) {
+        for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+            blocks[i] = data_block_alloc();
+            assert(blocks[i] != -1);
+        }
+        for (int i = 0; i < BLOCKS_PER_THREAD; i++) {
+            data_block_free(blocks[i]);
+        }
+    }
+    return NULL;
+}
+
+static void run(size_t threads, size_t groups) {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = threads * BLOCKS_PER_THREAD * 2;
+    params.alloc_groups = groups;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    assert(tids != NULL);
+    double start = now();
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_create(&tids[t], NULL, worker, NULL) == 0);
+    }
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_join(tids[t], NULL) == 0);
+    }
+    double elapsed = now() - start;
+    free(tids);
+
+    double allocs = (double)(threads * rounds * BLOCKS_PER_THREAD);
+    printf("%3zu threads, %3zu groups: %8.2f M alloc+free/s\n", threads,
+           groups, allocs / elapsed / 1e6);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main(int argc, char **argv) {
+    size_t threads = DEFAULT_THREADS;
+    if (argc > 1) {
+        threads = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        rounds = strtoul(argv[2], NULL, 10);
+    }
+
+    // A single group behaves like the old allocator (one lock, one scan)
+    run(threads, 1);
+    run(threads, threads);
+    run(threads, threads * 2);
+
+    return 0;
+}
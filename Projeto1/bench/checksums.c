@@ -0,0 +1,84 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_ROUNDS 20
+#define FILES 64
+#define BLOCK_SIZE (16 * 1024)
+#define APPEND_SIZE 64
+
+static size_t rounds = DEFAULT_ROUNDS;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Fills FILES blocks with small appends, like a message log, then reads them
+ * back whole, with checksum verification on read off and on.
+ */
+static void run(bool verify) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = FILES + 1;
+    params.max_block_count = FILES + 1;
+    params.max_open_files_count = FILES;
+    params.verify_checksums = verify;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+
+    char chunk[APPEND_SIZE];
+    memset(chunk, 'm', sizeof(chunk));
+    char *buffer = malloc(BLOCK_SIZE);
+    assert(buffer != NULL);
+
+    double appending = 0, reading = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        double start = now();
+        for (int f = 0; f < FILES; f++) {
+            char path[MAX_FILE_NAME];
+            sprintf(path, "/log%d", f);
+            int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC | TFS_O_APPEND);
+            assert(fd != -1);
+            for (size_t done = 0; done < BLOCK_SIZE; done += APPEND_SIZE) {
+                assert(tfs_write(fd, chunk, APPEND_SIZE) == APPEND_SIZE);
+            }
+            assert(tfs_close(fd) != -1);
+        }
+        appending += now() - start;
+
+        start = now();
+        for (int f = 0; f < FILES; f++) {
+            char path[MAX_FILE_NAME];
+            sprintf(path, "/log%d", f);
+            int fd = tfs_open(path, 0);
+            assert(fd != -1);
+            assert(tfs_read(fd, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+            assert(tfs_close(fd) != -1);
+        }
+        reading += now() - start;
+    }
+    free(buffer);
+
+    double bytes = (double)(rounds * FILES * BLOCK_SIZE);
+    printf("verify on read %-3s: %8.1f MB/s appends (%d B), %8.1f MB/s reads\n",
+           verify ? "on" : "off", bytes / appending / 1e6, APPEND_SIZE,
+           bytes / reading / 1e6);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        rounds = strtoul(argv[1], NULL, 10);
+    }
+
+    run(false);
+    run(true);
+
+    return 0;
+}
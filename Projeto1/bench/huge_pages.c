@@ -0,0 +1,98 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFAULT_VOLUME_MB 256
+#define DEFAULT_READS (4 * 1024 * 1024)
+#define BLOCK_SIZE 4096
+#define READ_SIZE 64
+
+static char const *backing_name(tfs_backing_t backing) {
+    switch (backing) {
+    case TFS_BACKING_MALLOC:
+        return "malloc";
+    case TFS_BACKING_PAGES:
+        return "regular pages";
+    case TFS_BACKING_THP:
+        return "transparent huge pages";
+    case TFS_BACKING_HUGETLB:
+        return "hugetlb";
+    case TFS_BACKING_FILE:
+        return "volume file";
+    default:
+        return "unknown";
+    }
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Touches the whole data region and then reads READ_SIZE bytes from random
+ * blocks through data_block_get, which is where the TLB misses show up.
+ */
+static void run(bool huge_pages, size_t volume_mb, size_t reads) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = volume_mb * 1024 * 1024 / BLOCK_SIZE;
+    params.access_delay = 0; // measure memory, not the emulated latency
+    params.huge_pages = huge_pages;
+    assert(tfs_init(&params) != -1);
+
+    // Touch every block (no need to go through the allocator for this)
+    size_t blocks = params.max_block_count;
+    for (size_t b = 0; b < blocks; b++) {
+        memset(data_block_get((int)b), (int)b, BLOCK_SIZE);
+    }
+
+    uint64_t state = 88172645463325252ULL; // xorshift64
+    uint64_t checksum = 0;
+    char buffer[READ_SIZE];
+    double start = now();
+    for (size_t i = 0; i < reads; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        size_t block = state % blocks;
+        size_t offset = (state >> 32) % (BLOCK_SIZE - READ_SIZE);
+        memcpy(buffer, (char *)data_block_get((int)block) + offset, READ_SIZE);
+        checksum += (unsigned char)buffer[0];
+    }
+    double elapsed = now() - start;
+
+    printf("%-24s %8.2f Mreads/s %8.1f MB/s (checksum %llu)\n",
+           backing_name(tfs_data_backing()), (double)reads / elapsed / 1e6,
+           (double)reads * READ_SIZE / elapsed / (1024 * 1024),
+           (unsigned long long)checksum);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main(int argc, char **argv) {
+    size_t volume_mb = DEFAULT_VOLUME_MB;
+    size_t reads = DEFAULT_READS;
+    if (argc > 1) {
+        volume_mb = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        reads = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3 || volume_mb == 0 || reads == 0) {
+        fprintf(stderr, "usage: %s [volume_mb] [reads]\n", argv[0]);
+        return 1;
+    }
+
+    printf("random %d byte reads over a %zu MB data region\n", READ_SIZE,
+           volume_mb);
+    run(false, volume_mb, reads);
+    run(true, volume_mb, reads);
+
+    return 0;
+}
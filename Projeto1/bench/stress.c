@@ -0,0 +1,917 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_THREADS 8
+#define DEFAULT_SECONDS 5
+#define DEFAULT_MIX                                                            \
+    "open:2,write:3,read:4,link:1,symlink:1,unlink:1,append:2,scan:2"
+#define MAX_NAMES_PER_THREAD 16
+#define BLOCK_SIZE 4096
+#define MAX_WRITE 256
+#define MAX_REPORTED_VIOLATIONS 10
+#define SHARED_LOGS 2
+#define RECORD_SIZE 64
+#define STAMP_WRITER UINT32_MAX
+
+_Static_assert(BLOCK_SIZE % RECORD_SIZE == 0,
+               "a log block holds a whole number of records");
+
+typedef enum {
+    OP_OPEN,
+    OP_WRITE,
+    OP_READ,
+    OP_LINK,
+    OP_SYMLINK,
+    OP_UNLINK,
+    OP_APPEND,
+    OP_SCAN
+} op_t;
+#define OP_COUNT (OP_SCAN + 1)
+
+static char const *op_names[OP_COUNT] = {"open",   "write",  "read",
+                                         "link",   "symlink", "unlink",
+                                         "append", "scan"};
+
+/*
+ * Shadow model. Every thread works on its own names ("/s<thread>_<k>"), so it
+ * can predict the outcome of each of its operations exactly, while all
+ * threads still share the root directory, the inode table, the allocators
+ * and the open file table.
+ *
+ * Names refer to objects (what an inode is to TécnicoFS): files, with their
+ * contents and link count, and soft links, with the name they point to.
+ *
+ * Threads also share SHARED_LOGS logs ("/log<k>", opened with TFS_O_COMPRESS),
+ * which they append RECORD_SIZE-byte records to through TFS_O_APPEND handles,
+ * each record tagged with its writer and that writer's sequence number, and
+ * which they scan while others append. A scan must find whole, untorn
+ * records, each writer's in sequence. A full log is rotated: copied to its
+ * archive ("/log<k>.old", which dedup then shares the block of), stamped with
+ * the rotation number in place (unsharing it, or moving it back out of the
+ * extent area) and truncated. Appenders hold the log's rotation lock for
+ * reading, so among themselves they append concurrently, and a rotation
+ * knows exactly what each writer got into the log.
+ */
+typedef enum { OBJ_FREE, OBJ_FILE, OBJ_SYMLINK } object_kind_t;
+
+typedef struct {
+    object_kind_t kind;
+    unsigned int links;
+    size_t len;
+    char *data;
+    int target; // name index a soft link points to
+} object_t;
+
+typedef struct {
+    uint32_t writer; // STAMP_WRITER for the stamp of an archive
+    uint32_t seq;    // the rotation number, in a stamp
+    uint8_t payload[RECORD_SIZE - 2 * sizeof(uint32_t)];
+} record_t;
+
+typedef struct {
+    pthread_rwlock_t rotation;
+    unsigned int rotations;
+} shared_log_t;
+
+typedef struct {
+    int id;
+    uint64_t rng;
+    size_t names_count;
+    int names[MAX_NAMES_PER_THREAD]; // object of each name, -1 if absent
+    object_t objects[MAX_NAMES_PER_THREAD];
+    // Next record of this writer to each log, and where its records in the
+    // log start: the first one it appended since rotation log_rotation
+    uint32_t log_next[SHARED_LOGS];
+    uint32_t log_first[SHARED_LOGS];
+    unsigned int log_rotation[SHARED_LOGS];
+    size_t ops[OP_COUNT];
+    size_t violations;
+} worker_t;
+
+static unsigned int mix[OP_COUNT];
+static unsigned int mix_total;
+static atomic_bool stopping;
+static atomic_size_t total_violations;
+static shared_log_t logs[SHARED_LOGS];
+static size_t worker_count;
+
+static uint64_t next_random(worker_t *w) {
+    // xorshift64
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static void violation(worker_t *w, char const *what, int name, long got,
+                      long expected) {
+    w->violations++;
+    if (atomic_fetch_add(&total_violations, 1) < MAX_REPORTED_VIOLATIONS) {
+        fprintf(stderr, "thread %d, /s%d_%d: %s returned %ld, expected %ld\n",
+                w->id, w->id, name, what, got, expected);
+    }
+}
+
+static void log_violation(worker_t *w, int log, char const *what) {
+    w->violations++;
+    if (atomic_fetch_add(&total_violations, 1) < MAX_REPORTED_VIOLATIONS) {
+        fprintf(stderr, "thread %d, /log%d: %s\n", w->id, log, what);
+    }
+}
+
+static void name_path(char *path, int thread, int name) {
+    snprintf(path, MAX_FILE_NAME, "/s%d_%d", thread, name);
+}
+
+static void log_path(char *path, int log, bool archive) {
+    snprintf(path, MAX_FILE_NAME, archive ? "/log%d.old" : "/log%d", log);
+}
+
+static int object_alloc(worker_t *w, object_kind_t kind) {
+    for (int o = 0; o < MAX_NAMES_PER_THREAD; o++) {
+        if (w->objects[o].kind == OBJ_FREE) {
+            w->objects[o].kind = kind;
+            w->objects[o].links = 1;
+            w->objects[o].len = 0;
+            return o;
+        }
+    }
+    // there are never more objects than names
+    fprintf(stderr, "stress: shadow model out of objects\n");
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Resolve a name to the file it leads to, the way tfs_open does: follow soft
+ * links (by name) for at most MAX_SYMLINK_HOPS, failing on dangling links and
+ * on chains leading back to the starting object.
+ *
+ * Returns the file object, or -1 if the name does not lead to one.
+ */
+static int model_resolve(worker_t const *w, int name) {
+    int start = w->names[name];
+    if (start == -1) {
+        return -1;
+    }
+
+    int object = start;
+    for (int hops = 0;; hops++) {
+        if (w->objects[object].kind == OBJ_FILE) {
+            return object;
+        }
+        if (hops == MAX_SYMLINK_HOPS) {
+            return -1;
+        }
+        int target = w->names[w->objects[object].target];
+        if (target == -1 || target == start) {
+            return -1;
+        }
+        object = target;
+    }
+}
+
+static int random_name(worker_t *w) {
+    return (int)(next_random(w) % w->names_count);
+}
+
+/* Picks an absent name, or returns -1 if every name is taken. */
+static int random_absent_name(worker_t *w) {
+    int first = random_name(w);
+    for (size_t i = 0; i < w->names_count; i++) {
+        int name = (int)(((size_t)first + i) % w->names_count);
+        if (w->names[name] == -1) {
+            return name;
+        }
+    }
+    return -1;
+}
+
+static void do_open(worker_t *w, int name, char const *path) {
+    int fd = tfs_open(path, TFS_O_CREAT);
+    int expected = w->names[name] == -1 || model_resolve(w, name) != -1;
+    if ((fd != -1) != expected) {
+        violation(w, "tfs_open(TFS_O_CREAT)", name, fd, expected ? 0 : -1);
+    }
+    if (fd == -1) {
+        return;
+    }
+    if (w->names[name] == -1) {
+        w->names[name] = object_alloc(w, OBJ_FILE);
+    }
+    tfs_close(fd);
+}
+
+static void do_write(worker_t *w, int name, char const *path) {
+    bool append = next_random(w) & 1;
+    int file = model_resolve(w, name);
+
+    int fd = tfs_open(path, append ? TFS_O_APPEND : TFS_O_TRUNC);
+    if ((fd != -1) != (file != -1)) {
+        violation(w, "tfs_open", name, fd, file != -1 ? 0 : -1);
+    }
+    if (fd == -1 || file == -1) {
+        if (fd != -1) {
+            tfs_close(fd);
+        }
+        return;
+    }
+
+    object_t *obj = &w->objects[file];
+    if (!append) {
+        obj->len = 0;
+    }
+
+    char buffer[MAX_WRITE];
+    size_t len = 1 + next_random(w) % MAX_WRITE;
+    for (size_t i = 0; i < len; i++) {
+        buffer[i] = (char)next_random(w);
+    }
+    size_t expected = BLOCK_SIZE - obj->len < len ? BLOCK_SIZE - obj->len : len;
+
+    ssize_t written = tfs_write(fd, buffer, len);
+    if (written != (ssize_t)expected) {
+        violation(w, "tfs_write", name, written, (long)expected);
+    }
+    memcpy(obj->data + obj->len, buffer, expected);
+    obj->len += expected;
+    tfs_close(fd);
+}
+
+static void check_contents(worker_t *w, int name, char const *path,
+                           int file) {
+    static _Thread_local char buffer[BLOCK_SIZE];
+
+    int fd = tfs_open(path, 0);
+    if ((fd != -1) != (file != -1)) {
+        violation(w, "tfs_open", name, fd, file != -1 ? 0 : -1);
+    }
+    if (fd == -1 || file == -1) {
+        if (fd != -1) {
+            tfs_close(fd);
+        }
+        return;
+    }
+
+    object_t const *obj = &w->objects[file];
+    ssize_t r = tfs_read(fd, buffer, BLOCK_SIZE);
+    if (r != (ssize_t)obj->len) {
+        violation(w, "tfs_read", name, r, (long)obj->len);
+    } else if (memcmp(buffer, obj->data, obj->len) != 0) {
+        violation(w, "tfs_read (contents differ)", name, r, (long)obj->len);
+    }
+    tfs_close(fd);
+}
+
+static void do_link(worker_t *w, int name, char const *path, bool soft) {
+    int link = random_absent_name(w);
+    if (link == -1) {
+        return;
+    }
+    char link_path[MAX_FILE_NAME];
+    name_path(link_path, w->id, link);
+
+    int object = w->names[name];
+    bool expected = object != -1 &&
+                    (soft || w->objects[object].kind == OBJ_FILE);
+    int ret = soft ? tfs_sym_link(path, link_path) : tfs_link(path, link_path);
+    if ((ret == 0) != expected) {
+        violation(w, soft ? "tfs_sym_link" : "tfs_link", name, ret,
+                  expected ? 0 : -1);
+    }
+    if (ret != 0 || !expected) {
+        return;
+    }
+
+    if (soft) {
+        int symlink = object_alloc(w, OBJ_SYMLINK);
+        w->objects[symlink].target = name;
+        w->names[link] = symlink;
+    } else {
+        w->objects[object].links++;
+        w->names[link] = object;
+    }
+}
+
+static void do_unlink(worker_t *w, int name, char const *path) {
+    int object = w->names[name];
+    int ret = tfs_unlink(path);
+    if ((ret == 0) != (object != -1)) {
+        violation(w, "tfs_unlink", name, ret, object != -1 ? 0 : -1);
+    }
+    if (ret != 0 || object == -1) {
+        return;
+    }
+
+    w->names[name] = -1;
+    if (--w->objects[object].links == 0) {
+        w->objects[object].kind = OBJ_FREE;
+    }
+}
+
+static void record_fill(record_t *record, uint32_t writer, uint32_t seq) {
+    record->writer = writer;
+    record->seq = seq;
+    for (size_t i = 0; i < sizeof(record->payload); i++) {
+        record->payload[i] = (uint8_t)(writer * 131 + seq * 7 + i);
+    }
+}
+
+/**
+ * Check the contents of a log, or of its archive, as read at once: whole
+ * records, each one intact, each writer's in sequence (an archive starts with
+ * its stamp, unless it was caught between the copy and the stamping). If
+ * first and next are not NULL, they get the sequence number of each writer's
+ * first record and of the one after its last (both 0 if it has none).
+ *
+ * Returns false if the contents could not have been written by the workers.
+ */
+static bool records_valid(char const *data, size_t len, bool archive,
+                          uint32_t *first, uint32_t *next) {
+    if (len % RECORD_SIZE != 0) {
+        return false;
+    }
+    uint32_t last[worker_count];
+    bool seen[worker_count];
+    memset(seen, 0, sizeof(seen));
+    for (size_t at = 0; at < len; at += RECORD_SIZE) {
+        record_t record, expected;
+        memcpy(&record, data + at, RECORD_SIZE);
+        if (archive && at == 0 && record.writer == STAMP_WRITER) {
+            record_fill(&expected, STAMP_WRITER, record.seq);
+            if (memcmp(&record, &expected, RECORD_SIZE) != 0) {
+                return false;
+            }
+            continue;
+        }
+        if (record.writer >= worker_count) {
+            return false;
+        }
+        record_fill(&expected, record.writer, record.seq);
+        if (memcmp(&record, &expected, RECORD_SIZE) != 0) {
+            return false; // torn, or interleaved with another record
+        }
+        if (seen[record.writer] && record.seq != last[record.writer] + 1) {
+            return false; // lost, repeated or out of order
+        }
+        if (!seen[record.writer] && first != NULL) {
+            first[record.writer] = record.seq;
+        }
+        seen[record.writer] = true;
+        last[record.writer] = record.seq;
+    }
+    for (size_t t = 0; next != NULL && t < worker_count; t++) {
+        first[t] = seen[t] ? first[t] : 0;
+        next[t] = seen[t] ? last[t] + 1 : 0;
+    }
+    return true;
+}
+
+/* Reads a whole log (or archive) at once; returns its length, -1 on error. */
+static ssize_t log_read(int log, bool archive, char *buffer) {
+    char path[MAX_FILE_NAME];
+    log_path(path, log, archive);
+    int fd = tfs_open(path, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t r = tfs_read(fd, buffer, BLOCK_SIZE);
+    tfs_close(fd);
+    return r;
+}
+
+/**
+ * Rotate a full log (its rotation lock held for writing): copy it to its
+ * archive, stamp the archive and truncate the log. The copy is a full block
+ * identical to the log's, so dedup shares it; the stamp is then written to a
+ * shared (or, once compressed, an extent) block, which must leave the log
+ * untouched.
+ */
+static void log_rotate(worker_t *w, int log) {
+    static _Thread_local char snapshot[BLOCK_SIZE], after[BLOCK_SIZE];
+
+    ssize_t len = log_read(log, false, snapshot);
+    if (len != BLOCK_SIZE) {
+        if (len == -1) {
+            log_violation(w, log, "open/read for rotation failed");
+        }
+        return; // already rotated
+    }
+    if (!records_valid(snapshot, BLOCK_SIZE, false, NULL, NULL)) {
+        log_violation(w, log, "full log is not a sequence of records");
+    }
+
+    char path[MAX_FILE_NAME];
+    log_path(path, log, true);
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_COMPRESS);
+    if (fd == -1 || tfs_write(fd, snapshot, BLOCK_SIZE) != BLOCK_SIZE) {
+        log_violation(w, log, "copy to the archive failed");
+    }
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+
+    record_t stamp;
+    record_fill(&stamp, STAMP_WRITER, logs[log].rotations);
+    fd = tfs_open(path, 0);
+    if (fd == -1 || tfs_write(fd, &stamp, RECORD_SIZE) != RECORD_SIZE) {
+        log_violation(w, log, "stamping the archive failed");
+    }
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+
+    if (log_read(log, false, after) != BLOCK_SIZE ||
+        memcmp(after, snapshot, BLOCK_SIZE) != 0) {
+        log_violation(w, log, "stamping the archive changed the log");
+    }
+
+    log_path(path, log, false);
+    fd = tfs_open(path, TFS_O_TRUNC);
+    if (fd == -1) {
+        log_violation(w, log, "truncating the log failed");
+        return;
+    }
+    tfs_close(fd);
+    logs[log].rotations++;
+}
+
+static void do_append(worker_t *w, int log) {
+    char path[MAX_FILE_NAME];
+    log_path(path, log, false);
+    record_t record;
+
+    pthread_rwlock_rdlock(&logs[log].rotation);
+    if (w->log_rotation[log] != logs[log].rotations) {
+        // the log was rotated since this writer last appended to it
+        w->log_rotation[log] = logs[log].rotations;
+        w->log_first[log] = w->log_next[log];
+    }
+    record_fill(&record, (uint32_t)w->id, w->log_next[log]);
+    int fd = tfs_open(path, TFS_O_APPEND);
+    ssize_t written = fd == -1 ? -1 : tfs_write(fd, &record, RECORD_SIZE);
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+    pthread_rwlock_unlock(&logs[log].rotation);
+
+    if (written == RECORD_SIZE) {
+        w->log_next[log]++;
+    } else if (written == 0) {
+        pthread_rwlock_wrlock(&logs[log].rotation);
+        log_rotate(w, log);
+        pthread_rwlock_unlock(&logs[log].rotation);
+    } else {
+        log_violation(w, log, "append wrote part of a record, or failed");
+    }
+}
+
+static void do_scan(worker_t *w, int log) {
+    static _Thread_local char buffer[BLOCK_SIZE];
+
+    bool archive = next_random(w) & 1;
+    ssize_t len = log_read(log, archive, buffer);
+    if (len == -1) {
+        log_violation(w, log, archive ? "archive read failed" : "read failed");
+    } else if (!records_valid(buffer, (size_t)len, archive, NULL, NULL)) {
+        log_violation(w, log,
+                      archive ? "archive is not a sequence of records"
+                              : "log is not a sequence of records");
+    }
+}
+
+static op_t random_op(worker_t *w) {
+    unsigned int pick = (unsigned int)(next_random(w) % mix_total);
+    for (op_t op = OP_OPEN; op < OP_COUNT; op++) {
+        if (pick < mix[op]) {
+            return op;
+        }
+        pick -= mix[op];
+    }
+    return OP_READ;
+}
+
+static void *worker_thread(void *arg) {
+    worker_t *w = (worker_t *)arg;
+
+    while (!atomic_load(&stopping)) {
+        int name = random_name(w);
+        char path[MAX_FILE_NAME];
+        name_path(path, w->id, name);
+        int log = (int)(next_random(w) % SHARED_LOGS);
+
+        op_t op = random_op(w);
+        switch (op) {
+        case OP_OPEN:
+            do_open(w, name, path);
+            break;
+        case OP_WRITE:
+            do_write(w, name, path);
+            break;
+        case OP_READ:
+            check_contents(w, name, path, model_resolve(w, name));
+            break;
+        case OP_LINK:
+            do_link(w, name, path, false);
+            break;
+        case OP_SYMLINK:
+            do_link(w, name, path, true);
+            break;
+        case OP_UNLINK:
+            do_unlink(w, name, path);
+            break;
+        case OP_APPEND:
+            do_append(w, log);
+            break;
+        case OP_SCAN:
+            do_scan(w, log);
+            break;
+        default:
+            break;
+        }
+        w->ops[op]++;
+    }
+    return NULL;
+}
+
+/**
+ * Check the whole file system against the shadow models, once every worker
+ * stopped: the directory holds exactly the modeled names, hard links share
+ * inodes and have the right link counts, file contents match, each log holds
+ * exactly the records appended since its last rotation, and no inode, block
+ * or open file entry leaked.
+ *
+ * Returns the number of violations found.
+ */
+static size_t check_invariants(worker_t *workers, size_t threads) {
+    size_t violations = 0;
+    size_t names = 0, objects = 0, nonempty_files = 0;
+
+    // Inode number of each (thread, object), to check identity
+    int inumbers[threads][MAX_NAMES_PER_THREAD];
+    memset(inumbers, -1, sizeof(inumbers));
+
+    for (size_t t = 0; t < threads; t++) {
+        worker_t *w = &workers[t];
+        for (int o = 0; o < MAX_NAMES_PER_THREAD; o++) {
+            if (w->objects[o].kind != OBJ_FREE) {
+                objects++;
+                if (w->objects[o].kind == OBJ_FILE && w->objects[o].len > 0) {
+                    nonempty_files++;
+                }
+            }
+        }
+        for (size_t n = 0; n < w->names_count; n++) {
+            if (w->names[n] != -1) {
+                names++;
+            }
+        }
+    }
+
+    int dh = tfs_opendir("/");
+    assert(dh != -1);
+    size_t listed = 0, logs_listed = 0;
+    tfs_dirent_t entry;
+    while (tfs_readdir(dh, &entry, 1) == 1) {
+        if (strncmp(entry.d_name, "log", 3) == 0) {
+            logs_listed++;
+            continue;
+        }
+        listed++;
+        int t, n;
+        if (sscanf(entry.d_name, "s%d_%d", &t, &n) != 2 || t < 0 ||
+            (size_t)t >= threads || n < 0 ||
+            (size_t)n >= workers[t].names_count) {
+            fprintf(stderr, "unexpected directory entry %s\n", entry.d_name);
+            violations++;
+            continue;
+        }
+
+        worker_t *w = &workers[t];
+        int object = w->names[n];
+        if (object == -1) {
+            fprintf(stderr, "/%s exists but was unlinked\n", entry.d_name);
+            violations++;
+            continue;
+        }
+
+        object_t const *obj = &w->objects[object];
+        tfs_dirent_type_t type =
+            obj->kind == OBJ_FILE ? TFS_DT_FILE : TFS_DT_SOFT_LINK;
+        if (entry.d_type != type ||
+            (type == TFS_DT_FILE && entry.d_size != obj->len)) {
+            fprintf(stderr, "/%s has type %d and size %zu, expected %d, %zu\n",
+                    entry.d_name, entry.d_type, entry.d_size, type, obj->len);
+            violations++;
+        }
+
+        if (inumbers[t][object] == -1) {
+            inumbers[t][object] = entry.d_inumber;
+        } else if (inumbers[t][object] != entry.d_inumber) {
+            fprintf(stderr, "/%s is not the same inode as its hard links\n",
+                    entry.d_name);
+            violations++;
+        }
+
+        int links = inode_get(entry.d_inumber)->hard_links_count;
+        if (links != (int)obj->links) {
+            fprintf(stderr, "/%s has %d links, expected %u\n", entry.d_name,
+                    links, obj->links);
+            violations++;
+        }
+    }
+    assert(tfs_closedir(dh) != -1);
+
+    if (listed != names || logs_listed != 2 * SHARED_LOGS) {
+        fprintf(stderr, "directory lists %zu names and %zu logs, expected %zu "
+                "and %d\n", listed, logs_listed, names, 2 * SHARED_LOGS);
+        violations++;
+    }
+
+    // Contents, read through every name (soft links included)
+    for (size_t t = 0; t < threads; t++) {
+        worker_t *w = &workers[t];
+        size_t before = w->violations;
+        for (size_t n = 0; n < w->names_count; n++) {
+            char path[MAX_FILE_NAME];
+            name_path(path, w->id, (int)n);
+            check_contents(w, (int)n, path, model_resolve(w, (int)n));
+        }
+        violations += w->violations - before;
+    }
+
+    // Logs, and their archives (stamped by the last rotation)
+    static char buffer[BLOCK_SIZE];
+    size_t nonempty_logs = 0;
+    for (int l = 0; l < SHARED_LOGS; l++) {
+        uint32_t first[threads], next[threads];
+        ssize_t len = log_read(l, false, buffer);
+        if (len == -1 ||
+            !records_valid(buffer, (size_t)len, false, first, next)) {
+            fprintf(stderr, "/log%d is not a sequence of records\n", l);
+            violations++;
+            continue;
+        }
+        nonempty_logs += len > 0;
+        for (size_t t = 0; t < threads; t++) {
+            worker_t const *w = &workers[t];
+            bool current = w->log_rotation[l] == logs[l].rotations;
+            uint32_t from = current ? w->log_first[l] : 0;
+            uint32_t to = current ? w->log_next[l] : 0;
+            if (from == to ? first[t] != next[t]
+                           : first[t] != from || next[t] != to) {
+                fprintf(stderr,
+                        "/log%d holds records [%u, %u) of thread %zu, "
+                        "expected [%u, %u)\n",
+                        l, first[t], next[t], t, from, to);
+                violations++;
+            }
+        }
+
+        bool archived = logs[l].rotations > 0;
+        record_t stamp;
+        record_fill(&stamp, STAMP_WRITER, logs[l].rotations - 1);
+        len = log_read(l, true, buffer);
+        if (len != (archived ? BLOCK_SIZE : 0) ||
+            !records_valid(buffer, (size_t)len, true, NULL, NULL) ||
+            (archived && memcmp(buffer, &stamp, RECORD_SIZE) != 0)) {
+            fprintf(stderr, "/log%d.old is not the archive of rotation %u\n",
+                    l, logs[l].rotations);
+            violations++;
+        }
+        nonempty_logs += len > 0;
+    }
+
+    // Leaks (the root directory has a block per MAX_DIR_ENTRIES entries it
+    // ever held, and compressed blocks have no data block)
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    size_t inodes = 1 + objects + 2 * SHARED_LOGS;
+    if (stats.inodes_in_use != inodes) {
+        fprintf(stderr, "%zu inodes in use, expected %zu\n",
+                stats.inodes_in_use, inodes);
+        violations++;
+    }
+    size_t dir_blocks = inode_get(ROOT_DIR_INUM)->i_size / BLOCK_SIZE;
+    size_t blocks = dir_blocks + nonempty_files + nonempty_logs;
+    if (stats.blocks_in_use + stats.compressed_blocks != blocks) {
+        fprintf(stderr, "%zu blocks in use and %zu compressed, expected %zu\n",
+                stats.blocks_in_use, stats.compressed_blocks, blocks);
+        violations++;
+    }
+    if (stats.open_files_in_use != 0) {
+        fprintf(stderr, "%zu open file entries leaked\n",
+                stats.open_files_in_use);
+        violations++;
+    }
+
+    return violations;
+}
+
+static int parse_mix(char const *spec) {
+    memset(mix, 0, sizeof(mix));
+    mix_total = 0;
+
+    char *copy = strdup(spec);
+    assert(copy != NULL);
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL;
+         item = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(item, ':');
+        if (colon == NULL) {
+            free(copy);
+            return -1;
+        }
+        *colon = '\0';
+
+        op_t op = OP_COUNT;
+        for (op_t o = OP_OPEN; o < OP_COUNT; o++) {
+            if (strcmp(item, op_names[o]) == 0) {
+                op = o;
+            }
+        }
+        if (op == OP_COUNT) {
+            free(copy);
+            return -1;
+        }
+        mix[op] = (unsigned int)strtoul(colon + 1, NULL, 10);
+        mix_total += mix[op];
+    }
+
+    free(copy);
+    return mix_total > 0 ? 0 : -1;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void usage(char const *prog) {
+    fprintf(stderr,
+            "usage: %s [-t threads] [-d seconds] [-m mix] [-s seed] "
+            "[-D access_delay]\n"
+            "  mix: comma separated op:weight, ops being open, write, read, "
+            "link, symlink, unlink, append, scan\n"
+            "  (default " DEFAULT_MIX ")\n",
+            prog);
+}
+
+/* Runs a mix of operations on TécnicoFS from several threads for a while,
+ * checking every result against a shadow model, then reports the throughput
+ * of each operation and checks the final state.
+ *
+ * Exits with failure if any operation or invariant did not match the model.
+ */
+int main(int argc, char **argv) {
+    size_t threads = DEFAULT_THREADS;
+    unsigned int seconds = DEFAULT_SECONDS;
+    uint64_t seed = (uint64_t)time(NULL);
+    tfs_params params = tfs_default_params();
+
+    if (parse_mix(DEFAULT_MIX) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:m:s:D:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            seconds = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            if (parse_mix(optarg) != 0) {
+                usage(argv[0]);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'D':
+            params.access_delay = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (threads == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // The root directory grows a block at a time, so everybody's names fit
+    // as long as there are blocks for them: one per file, log and archive,
+    // one for an archive being unshared, plus the directory's
+    size_t names_per_thread = MAX_NAMES_PER_THREAD;
+    size_t entries = threads * names_per_thread + 2 * SHARED_LOGS;
+    size_t entries_per_block = (BLOCK_SIZE - sizeof(int)) / sizeof(dir_entry_t);
+    size_t dir_blocks = (entries + entries_per_block - 1) / entries_per_block;
+
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = entries + 1;
+    params.max_block_count = entries + 1 + dir_blocks;
+    params.max_open_files_count = threads + 1;
+    params.dedup = true;
+    params.compressed_area_size = 2 * SHARED_LOGS * BLOCK_SIZE;
+    params.compress_interval_ms = 1;
+    assert(tfs_init(&params) != -1);
+
+    for (int l = 0; l < SHARED_LOGS; l++) {
+        pthread_rwlock_init(&logs[l].rotation, NULL);
+        for (int archive = 0; archive < 2; archive++) {
+            char path[MAX_FILE_NAME];
+            log_path(path, l, archive);
+            int fd = tfs_open(path, TFS_O_CREAT | TFS_O_COMPRESS);
+            assert(fd != -1);
+            assert(tfs_close(fd) != -1);
+        }
+    }
+    worker_count = threads;
+
+    worker_t *workers = calloc(threads, sizeof(worker_t));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    assert(workers != NULL && tids != NULL);
+    for (size_t t = 0; t < threads; t++) {
+        worker_t *w = &workers[t];
+        w->id = (int)t;
+        w->rng = (seed + 1) * 0x9E3779B97F4A7C15ULL + t + 1;
+        w->names_count = names_per_thread;
+        for (int n = 0; n < MAX_NAMES_PER_THREAD; n++) {
+            w->names[n] = -1;
+            w->objects[n].kind = OBJ_FREE;
+            w->objects[n].data = malloc(BLOCK_SIZE);
+            assert(w->objects[n].data != NULL);
+        }
+    }
+
+    printf("%zu threads, %u s, %zu names per thread, seed %llu\n", threads,
+           seconds, names_per_thread, (unsigned long long)seed);
+
+    double start = now();
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_create(&tids[t], NULL, worker_thread, &workers[t]) ==
+               0);
+    }
+    sleep(seconds);
+    atomic_store(&stopping, true);
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_join(tids[t], NULL) == 0);
+    }
+    double elapsed = now() - start;
+
+    size_t total = 0;
+    for (op_t op = OP_OPEN; op < OP_COUNT; op++) {
+        size_t count = 0;
+        for (size_t t = 0; t < threads; t++) {
+            count += workers[t].ops[op];
+        }
+        total += count;
+        printf("%-8s %10zu ops %12.1f ops/s\n", op_names[op], count,
+               (double)count / elapsed);
+    }
+    printf("%-8s %10zu ops %12.1f ops/s\n", "total", total,
+           (double)total / elapsed);
+    unsigned int rotations = 0;
+    for (int l = 0; l < SHARED_LOGS; l++) {
+        rotations += logs[l].rotations;
+    }
+    printf("%u log rotations\n", rotations);
+
+    size_t violations = atomic_load(&total_violations);
+    violations += check_invariants(workers, threads);
+
+    for (size_t t = 0; t < threads; t++) {
+        for (int n = 0; n < MAX_NAMES_PER_THREAD; n++) {
+            free(workers[t].objects[n].data);
+        }
+    }
+    free(workers);
+    free(tids);
+    for (int l = 0; l < SHARED_LOGS; l++) {
+        pthread_rwlock_destroy(&logs[l].rotation);
+    }
+    assert(tfs_destroy() != -1);
+
+    if (violations > 0) {
+        printf("FAILED: %zu violations\n", violations);
+        return EXIT_FAILURE;
+    }
+    printf("all invariants hold\n");
+    return EXIT_SUCCESS;
+}
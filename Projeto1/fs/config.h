@@ -8,6 +8,24 @@
 
 #define DELAY (5000)
 
+// Maximum number of soft links followed when resolving a path
+#define MAX_SYMLINK_HOPS (8)
+
+// Maximum number of segments the FS tables can grow to
+#define MAX_TABLE_SEGMENTS (64)
+
+// Huge page size used to back the data region (see tfs_params.huge_pages)
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+// Allocation unit of the compressed extent area (in bytes)
+#define EXTENT_GRANULE (64)
+
+// Compression passes a full block must go unmodified before it is compressed
+#define COMPRESS_COLD_PASSES (2)
+
+// Initial sequential read-ahead window (in bytes; see tfs_params.readahead_max)
+#define READAHEAD_MIN ((size_t)16 * 1024)
+
 #endif // CONFIG_H
 
 /* *config.h*
@@ -15,4 +33,10 @@ Define constantes que são usadas para configurar o comportamento do programa.
 
 'ROOT_DIR_INUM' - define o inode number da diretoria root do sistema de ficheiros.
 'MAX_FILE_NAME' - define o comprimento máximo do nome do ficheiro.
-'DELAY' - define um delay value em milissegundos.*/
\ No newline at end of file
+'DELAY' - define um delay value em milissegundos.
+'MAX_SYMLINK_HOPS' - define o número máximo de soft links seguidos ao resolver um caminho.
+'MAX_TABLE_SEGMENTS' - define o número máximo de segmentos para que as tabelas do sistema de ficheiros podem crescer.
+'HUGE_PAGE_SIZE' - define o tamanho das huge pages usadas para a região de dados.
+'EXTENT_GRANULE' - define a unidade de alocação da área de extents comprimidos.
+'COMPRESS_COLD_PASSES' - define quantas passagens de compressão um bloco cheio tem de ficar sem ser modificado antes de ser comprimido.
+'READAHEAD_MIN' - define a janela inicial de read-ahead para leituras sequenciais.*/
\ No newline at end of file
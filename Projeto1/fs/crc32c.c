@@ -0,0 +1,106 @@
+#include "crc32c.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_SSE42_CRC32 1
+#endif
+
+// CRC32C polynomial, bit-reflected
+#define CRC32C_POLY (0x82F63B78u)
+
+static uint32_t crc_table[8][256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Build the slicing-by-8 tables: crc_table[k][b] is the CRC of byte b followed
+ * by k zero bytes.
+ */
+static void crc_table_init(void) {
+    for (uint32_t b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc_table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t prev = crc_table[k - 1][b];
+            crc_table[k][b] = (prev >> 8) ^ crc_table[0][prev & 0xff];
+        }
+    }
+}
+
+uint32_t crc32c_portable(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&crc_table_once, crc_table_init);
+
+    unsigned char const *p = data;
+    crc = ~crc;
+
+    // Eight bytes per step, independent of the host byte order
+    while (len >= 8) {
+        uint32_t lo = (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                      (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+        uint32_t hi = (uint32_t)p[4] | (uint32_t)p[5] << 8 |
+                      (uint32_t)p[6] << 16 | (uint32_t)p[7] << 24;
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xff] ^ crc_table[6][(lo >> 8) & 0xff] ^
+              crc_table[5][(lo >> 16) & 0xff] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xff] ^ crc_table[2][(hi >> 8) & 0xff] ^
+              crc_table[1][(hi >> 16) & 0xff] ^ crc_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0) {
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+#ifdef HAVE_SSE42_CRC32
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, void const *data, size_t len) {
+    unsigned char const *p = data;
+    uint64_t crc64 = ~crc;
+
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+
+    uint32_t crc32 = (uint32_t)crc64;
+    while (len-- > 0) {
+        crc32 = _mm_crc32_u8(crc32, *p++);
+    }
+
+    return ~crc32;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, void const *, size_t);
+static pthread_once_t crc32c_impl_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Pick the fastest implementation available on this CPU.
+ */
+static void crc32c_impl_init(void) {
+    crc32c_impl = crc32c_portable;
+#ifdef HAVE_SSE42_CRC32
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, void const *data, size_t len) {
+    pthread_once(&crc32c_impl_once, crc32c_impl_init);
+    return crc32c_impl(crc, data, len);
+}
@@ -0,0 +1,27 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Compute the CRC32C (Castagnoli) of a buffer.
+ *
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a portable
+ * slicing-by-8 implementation otherwise.
+ *
+ * Input:
+ *   - crc: CRC of the preceding data (0 for the first chunk)
+ *   - data: buffer
+ *   - len: length of the buffer (in bytes)
+ *
+ * Returns the CRC of the preceding data followed by this buffer.
+ */
+uint32_t crc32c(uint32_t crc, void const *data, size_t len);
+
+/**
+ * Same as crc32c, always using the portable slicing-by-8 implementation.
+ */
+uint32_t crc32c_portable(uint32_t crc, void const *data, size_t len);
+
+#endif // CRC32C_H
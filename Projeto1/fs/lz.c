@@ -0,0 +1,206 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Compressed format: a series of sequences, each one
+ *   token (1 byte): literal length (high nibble), match length - LZ_MIN_MATCH
+ *                   (low nibble); 15 means the length continues in extra bytes
+ *   [literal length extra bytes]: 255 each while the length continues, then
+ *                   the remainder
+ *   literals
+ *   match offset (2 bytes, little endian)
+ *   [match length extra bytes]
+ * The last sequence ends right after its literals (it has no match).
+ */
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (12)
+#define LZ_NIBBLE_MAX (15)
+
+static inline uint32_t read32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline size_t hash32(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Append the continuation bytes of a length (its part past the nibble).
+ */
+static bool put_length(uint8_t *out, size_t *op, size_t cap, size_t extra) {
+    while (extra >= 255) {
+        if (*op >= cap) {
+            return false;
+        }
+        out[(*op)++] = 255;
+        extra -= 255;
+    }
+    if (*op >= cap) {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)extra;
+    return true;
+}
+
+/**
+ * Append a sequence: `lit_len` literals, then (if match_len > 0) a match.
+ */
+static bool put_sequence(uint8_t *out, size_t *op, size_t cap,
+                         uint8_t const *literals, size_t lit_len,
+                         size_t offset, size_t match_len) {
+    size_t match_code = match_len > 0 ? match_len - LZ_MIN_MATCH : 0;
+    size_t lit_nibble = lit_len < LZ_NIBBLE_MAX ? lit_len : LZ_NIBBLE_MAX;
+    size_t match_nibble =
+        match_code < LZ_NIBBLE_MAX ? match_code : LZ_NIBBLE_MAX;
+
+    if (*op >= cap) {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)(lit_nibble << 4 | match_nibble);
+    if (lit_nibble == LZ_NIBBLE_MAX &&
+        !put_length(out, op, cap, lit_len - LZ_NIBBLE_MAX)) {
+        return false;
+    }
+
+    if (cap - *op < lit_len) {
+        return false;
+    }
+    memcpy(out + *op, literals, lit_len);
+    *op += lit_len;
+
+    if (match_len == 0) {
+        return true; // last sequence
+    }
+
+    if (cap - *op < 2) {
+        return false;
+    }
+    out[(*op)++] = (uint8_t)(offset & 0xff);
+    out[(*op)++] = (uint8_t)(offset >> 8);
+    if (match_nibble == LZ_NIBBLE_MAX &&
+        !put_length(out, op, cap, match_code - LZ_NIBBLE_MAX)) {
+        return false;
+    }
+    return true;
+}
+
+size_t lz_compress(void const *src, size_t len, void *dst, size_t cap) {
+    uint8_t const *in = src;
+    uint8_t *out = dst;
+
+    // Last position (plus one, 0 meaning none) where each hashed 4-byte
+    // sequence was seen
+    size_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0;
+    size_t anchor = 0; // first byte not yet emitted
+    size_t op = 0;
+
+    while (ip + LZ_MIN_MATCH <= len) {
+        uint32_t seq = read32(in + ip);
+        size_t h = hash32(seq);
+        size_t candidate = table[h];
+        table[h] = ip + 1;
+
+        if (candidate == 0 || ip - (candidate - 1) > LZ_MAX_OFFSET ||
+            read32(in + candidate - 1) != seq) {
+            ip++;
+            continue;
+        }
+        candidate--;
+
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < len &&
+               in[candidate + match_len] == in[ip + match_len]) {
+            match_len++;
+        }
+
+        if (!put_sequence(out, &op, cap, in + anchor, ip - anchor,
+                          ip - candidate, match_len)) {
+            return 0;
+        }
+        ip += match_len;
+        anchor = ip;
+    }
+
+    if (!put_sequence(out, &op, cap, in + anchor, len - anchor, 0, 0)) {
+        return 0;
+    }
+    return op;
+}
+
+/**
+ * Read the continuation bytes of a length, adding them to `length`.
+ */
+static bool get_length(uint8_t const *in, size_t *ip, size_t len,
+                       size_t *length) {
+    uint8_t b;
+    do {
+        if (*ip >= len) {
+            return false;
+        }
+        b = in[(*ip)++];
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+ssize_t lz_decompress(void const *src, size_t len, void *dst, size_t cap) {
+    uint8_t const *in = src;
+    uint8_t *out = dst;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip++];
+
+        size_t lit_len = token >> 4;
+        if (lit_len == LZ_NIBBLE_MAX && !get_length(in, &ip, len, &lit_len)) {
+            return -1;
+        }
+        if (len - ip < lit_len || cap - op < lit_len) {
+            return -1;
+        }
+        memcpy(out + op, in + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == len) {
+            break; // last sequence
+        }
+
+        if (len - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)in[ip] | (size_t)in[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) {
+            return -1;
+        }
+
+        size_t match_len = token & LZ_NIBBLE_MAX;
+        if (match_len == LZ_NIBBLE_MAX &&
+            !get_length(in, &ip, len, &match_len)) {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if (cap - op < match_len) {
+            return -1;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    return (ssize_t)op;
+}
@@ -0,0 +1,35 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Compress a buffer with a byte-oriented LZ77 coder (LZ4-style sequences of
+ * literals followed by a back-reference).
+ *
+ * Input:
+ *   - src: buffer to compress
+ *   - len: length of the buffer (in bytes)
+ *   - dst: destination buffer
+ *   - cap: capacity of the destination buffer
+ *
+ * Returns the compressed length, or 0 if it would not fit in `cap` bytes.
+ */
+size_t lz_compress(void const *src, size_t len, void *dst, size_t cap);
+
+/**
+ * Decompress a buffer produced by lz_compress.
+ *
+ * Input:
+ *   - src: compressed buffer
+ *   - len: compressed length (in bytes)
+ *   - dst: destination buffer
+ *   - cap: capacity of the destination buffer
+ *
+ * Returns the decompressed length, or -1 if the input is malformed or does not
+ * fit in `cap` bytes.
+ */
+ssize_t lz_decompress(void const *src, size_t len, void *dst, size_t cap);
+
+#endif // LZ_H
@@ -12,16 +12,29 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <dirent.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <pthread.h>
 
-
 tfs_params tfs_default_params() {
     tfs_params params = {
         .max_inode_count = 64,
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .max_table_segments = 16,
+        .access_delay = DELAY,
+        .huge_pages = false,
+        .verify_checksums = false,
+        .compressed_area_size = 256 * 1024,
+        .compress_interval_ms = 100,
+        .dedup = false,
+        .alloc_groups = 8,
+        .volume_path = NULL,
+        .durability = TFS_DURABILITY_NONE,
+        .flush_interval_ms = 100,
+        .readahead_max = 256 * 1024,
     };
     return params;
 }
@@ -39,9 +52,17 @@ int tfs_init(tfs_params const *params_ptr) {
         return -1;
     }
 
-    // create root inode
+    if (state_volume_mounted()) {
+        return 0; // the root inode came with the volume
+    }
+
+    // create root inode (under the root mutex, as a background flush may be
+    // writing the inode table back already)
+    pthread_mutex_lock(state_root_mutex());
     int root = inode_create(T_DIRECTORY);
+    pthread_mutex_unlock(state_root_mutex());
     if (root != ROOT_DIR_INUM) {
+        state_destroy();
         return -1;
     }
     return 0;
@@ -55,6 +76,46 @@ int tfs_destroy() {
     return 0;
 }
 
+tfs_backing_t tfs_data_backing(void) { return state_data_backing(); }
+
+ssize_t tfs_scrub(size_t threads) { return state_scrub(threads); }
+
+ssize_t tfs_compress_cold(void) { return state_compress_cold(); }
+
+int tfs_fsync(int fhandle) {
+    open_file_entry_t *file = get_open_file_entry(fhandle);
+    if (file == NULL) {
+        return -1;
+    }
+
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_fsync: inode of open file deleted");
+    if (inode->i_node_type != T_FILE) {
+        return -1; // handle was opened with tfs_opendir
+    }
+
+    int ret = 0;
+    pthread_rwlock_rdlock(&inode->i_data_lock);
+    if (inode->i_data_block != -1) {
+        ret = data_block_flush(inode->i_data_block);
+    }
+    pthread_rwlock_unlock(&inode->i_data_lock);
+    if (inode_flush(file->of_inumber) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int tfs_syncfs(void) { return state_syncfs(); }
+
+int tfs_stats(tfs_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    state_stats(stats);
+    return 0;
+}
+
 static bool valid_pathname(char const *name) { 
     return name != NULL && strlen(name) > 1 && name[0] == '/';
 }
@@ -92,6 +153,52 @@ static int tfs_lookup(char const *name, inode_t const *root_inode) {
     return inum;
 }
 
+/**
+ * Follows a chain of soft links to the inode it ultimately refers to.
+ *
+ * Each hop uses the link's cached target while that target still has the
+ * cached generation (it was neither deleted, recreated nor unlinked from that
+ * name since), and otherwise looks i_target up again and refreshes the cache.
+ * Must be called with the root directory mutex held.
+ *
+ * Input:
+ *   - inum: inumber of the inode to resolve
+ *   - root_inode: the root directory inode
+ * Returns the inumber of the first inode in the chain that is not a soft link,
+ * -1 if a target does not exist, the chain has more than MAX_SYMLINK_HOPS
+ * links or it loops.
+ */
+static int resolve_soft_links(int inum, inode_t const *root_inode) {
+    int start = inum;
+
+    for (int hops = 0;; hops++) {
+        inode_t *inode = inode_get(inum);
+        if (inode->i_node_type != T_SOFT_LINK) {
+            return inum;
+        }
+        if (hops == MAX_SYMLINK_HOPS) {
+            return -1; // chain too long
+        }
+
+        int target = inode->i_target_inumber;
+        if (target == -1 ||
+            !inode_generation_matches(target, inode->i_target_generation)) {
+            target = tfs_lookup(inode->i_target, root_inode);
+            if (target == -1) {
+                inode->i_target_inumber = -1;
+                return -1; // dangling link
+            }
+            inode->i_target_inumber = target;
+            inode->i_target_generation = inode_get(target)->i_generation;
+        }
+
+        if (target == start) {
+            return -1; // loop
+        }
+        inum = target;
+    }
+}
+
 /**
  * Opens a file.
  *
@@ -104,12 +211,14 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     if (!valid_pathname(name)) {
         return -1;
     }
-    
-    pthread_mutex_t root_inode_mutex = PTHREAD_MUTEX_INITIALIZER;
+    // The first file to ask for compression sets it up
+    if ((mode & TFS_O_COMPRESS) && state_compression_start() != 0) {
+        return -1;
+    }
     
     inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
     
-    pthread_mutex_lock(&root_inode_mutex);
+    pthread_mutex_lock(state_root_mutex());
     
     ALWAYS_ASSERT(root_dir_inode != NULL,
                   "tfs_open: root dir inode must exist");
@@ -117,26 +226,25 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
     size_t offset;
 
     if (inum >= 0) {
-        // The file already exists
+        // The file already exists; follow soft links to the actual file
+        inum = resolve_soft_links(inum, root_dir_inode);
+        if (inum == -1) {
+            // dangling, too long or looping chain of links
+            pthread_mutex_unlock(state_root_mutex());
+            return -1;
+        }
         inode_t *inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
 
         // Truncate (if requested) file to zero length
-
-        if (inode->i_node_type == T_SOFT_LINK) { 
-            inum = tfs_lookup(inode->i_target, root_dir_inode);
-            if (inum == -1) {
-            // tfs_lookup failed, return -1 to indicate an error
-                pthread_mutex_unlock(&root_inode_mutex);
-                return -1;
-            }
-        }
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            inode_write_lock(inode);
+            inode_release_data(inode);
+            inode_write_unlock(inode);
+        }
+        if (mode & TFS_O_COMPRESS) {
+            inode->i_compress = true;
         }
         // Determine initial offset (position to start r/w)
         // Append set offset to the end of the file
@@ -150,27 +258,30 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         // Create inode
         inum = inode_create(T_FILE);
         if (inum == -1) {
-            pthread_mutex_unlock(&root_inode_mutex);
+            pthread_mutex_unlock(state_root_mutex());
             return -1; // no space in inode table
         }
 
         // Add entry in the root directory
         if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
             inode_delete(inum);
-            pthread_mutex_unlock(&root_inode_mutex);
+            pthread_mutex_unlock(state_root_mutex());
             return -1; // no space in directory
         }
+        if (mode & TFS_O_COMPRESS) {
+            inode_get(inum)->i_compress = true;
+        }
 
         offset = 0;
     } else {
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
 
     // Finally, add entry to the open file table and return the corresponding
     // handle
-    pthread_mutex_unlock(&root_inode_mutex);
-    return add_to_open_file_table(inum, offset);
+    pthread_mutex_unlock(state_root_mutex());
+    return add_to_open_file_table(inum, offset, (mode & TFS_O_APPEND) != 0);
 
     // Note: for simplification, if file was created with TFS_O_CREAT and there
     // is an error adding an entry to the open file table, the file is not
@@ -185,17 +296,14 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
  *   - link_name: name of the hard link to be created
  */
 int tfs_sym_link(char const *target_file, char const *link_name) {
-    // Declare and initialize a mutex
-    pthread_mutex_t root_inode_mutex = PTHREAD_MUTEX_INITIALIZER;
-
     inode_t *root_inode = inode_get(ROOT_DIR_INUM);
     // Acquire the mutex before accessing the root directory inode
-    pthread_mutex_lock(&root_inode_mutex);
+    pthread_mutex_lock(state_root_mutex());
     // Find the inode number of the target file
     int target_file_inumber = tfs_lookup(target_file, root_inode);
     if (target_file_inumber == -1) {
         // tfs_lookup failed, release the mutex and return -1 to indicate an error
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
     // Creates inode for the soft link
@@ -203,7 +311,7 @@ int tfs_sym_link(char const *target_file, char const *link_name) {
 
     if (link_inode_inumber == -1) {
         // inode_create failed, release the mutex and return -1 to indicate an error
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
     inode_t *link_inode = inode_get(link_inode_inumber);
@@ -218,10 +326,10 @@ int tfs_sym_link(char const *target_file, char const *link_name) {
     if (add_dir_entry(root_inode, link_name + 1, link_inode_inumber) == -1) {
         // add_dir_entry failed, delete the inode and return -1 to indicate an error
         inode_delete(link_inode_inumber);
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
-    pthread_mutex_unlock(&root_inode_mutex);
+    pthread_mutex_unlock(state_root_mutex());
     return 0;    
 }
 
@@ -234,19 +342,16 @@ int tfs_sym_link(char const *target_file, char const *link_name) {
  *   - link_name: name of the hard link to be created
  */
 int tfs_link(const char *target_file, const char *link_name) {
-  // Initialize the mutex
-    pthread_mutex_t root_inode_mutex = PTHREAD_MUTEX_INITIALIZER;
-    
     inode_t *root_inode = inode_get(ROOT_DIR_INUM);
     
     // Lock the mutex before accessing the critical section
-    pthread_mutex_lock(&root_inode_mutex);
+    pthread_mutex_lock(state_root_mutex());
     
     // Find the inode number of the target file
     int target_file_inumber = tfs_lookup(target_file, root_inode);
     if (target_file_inumber == -1) {
     // tfs_lookup failed, return -1 to indicate an error
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
 
@@ -254,14 +359,14 @@ int tfs_link(const char *target_file, const char *link_name) {
     inode_t *target_inode = inode_get(target_file_inumber);
     if (target_inode->i_node_type == T_SOFT_LINK) {
         // Can't create hard links for soft links
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
 
     // Add an entry to the directory inode to create the link
     if (add_dir_entry(root_inode, link_name + 1, target_file_inumber) == -1) {
         // add_dir_entry failed, return -1 to indicate an error
-        pthread_mutex_unlock(&root_inode_mutex);
+        pthread_mutex_unlock(state_root_mutex());
         return -1;
     }
 
@@ -269,7 +374,7 @@ int tfs_link(const char *target_file, const char *link_name) {
     target_inode->hard_links_count++;
 
     // Unlock the mutex after finishing the critical section
-    pthread_mutex_unlock(&root_inode_mutex);
+    pthread_mutex_unlock(state_root_mutex());
 
     // Return 0 to indicate success
     return 0;
@@ -281,25 +386,119 @@ int tfs_close(int fhandle) {
         return -1; // invalid fd
     }
 
+    int ret = 0;
+    if (state_durability() == TFS_DURABILITY_ON_CLOSE) {
+        ret = tfs_fsync(fhandle);
+    }
+
     remove_from_open_file_table(fhandle);
 
-    return 0;
+    return ret;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
-   // Initialize the mutex
-    pthread_mutex_t open_file_table_mutex = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * Appends to a file through a TFS_O_APPEND handle.
+ *
+ * Appenders share the inode's i_data_lock (for reading): each one reserves its
+ * range of the block by advancing i_reserved with a compare-and-swap, copies
+ * its bytes alongside the others, and then commits in reservation order by
+ * advancing i_size, so readers only ever see whole appends.
+ *
+ * Input:
+ *   - file: open file entry (its lock held by the caller)
+ *   - inode: the file's inode
+ *   - buffer: buffer containing the contents to write
+ *   - len: length of the buffer contents (in bytes)
+ */
+static ssize_t tfs_append(open_file_entry_t *file, inode_t *inode,
+                          void const *buffer, size_t len) {
+    size_t block_size = state_block_size();
+
+    pthread_rwlock_rdlock(&inode->i_data_lock);
+    while (inode->i_data_block == -1 && inode->i_extent == -1) {
+        // Empty file: its block has to be allocated exclusively
+        pthread_rwlock_unlock(&inode->i_data_lock);
+        inode_write_lock(inode);
+        if (inode->i_data_block == -1 && inode->i_extent == -1) {
+            int bnum = data_block_alloc();
+            if (bnum == -1) {
+                inode_write_unlock(inode);
+                return -1; // no space
+            }
+            inode->i_data_block = bnum;
+        }
+        inode_write_unlock(inode);
+        pthread_rwlock_rdlock(&inode->i_data_lock);
+    }
+
+    // Reserve [start, start + to_write); a full (possibly compressed or
+    // shared) block has nothing left to reserve
+    size_t start = atomic_load(&inode->i_reserved);
+    size_t to_write;
+    do {
+        to_write = start < block_size ? block_size - start : 0;
+        if (to_write > len) {
+            to_write = len;
+        }
+    } while (to_write > 0 &&
+             !atomic_compare_exchange_weak(&inode->i_reserved, &start,
+                                           start + to_write));
+
+    if (to_write == 0) {
+        pthread_rwlock_unlock(&inode->i_data_lock);
+        return 0;
+    }
+
+    char *block = data_block_get(inode->i_data_block);
+    ALWAYS_ASSERT(block != NULL, "tfs_append: data block deleted mid-write");
+    memcpy(block + start, buffer, to_write);
+
+    // Commit after the appends reserved before this one
+    while (atomic_load_explicit(&inode->i_size, memory_order_acquire) !=
+           start) {
+        sched_yield();
+    }
+    data_block_written(inode->i_data_block, start, to_write);
+    inode->i_cold_passes = 0;
+    atomic_store_explicit(&inode->i_size, start + to_write,
+                          memory_order_release);
+    file->of_offset = start + to_write;
+    pthread_rwlock_unlock(&inode->i_data_lock);
+
+    if (start + to_write == block_size) {
+        // Full now: share it with identical blocks, like regular writes do
+        inode_write_lock(inode);
+        if (inode->i_size == block_size && inode->i_extent == -1) {
+            inode->i_data_block = data_block_dedup(inode->i_data_block);
+        }
+        inode_write_unlock(inode);
+    }
+    return (ssize_t)to_write;
+}
 
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     
     if (file == NULL) {
-        pthread_mutex_unlock(&open_file_table_mutex);
         return -1;
     }
 
+    // Serialize operations on this handle (its offset)
+    pthread_mutex_lock(&file->lock);
+
     //  From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    if (inode->i_node_type != T_FILE) {
+        pthread_mutex_unlock(&file->lock);
+        return -1; // handle was opened with tfs_opendir
+    }
+
+    if (file->of_append) {
+        ssize_t written = tfs_append(file, inode, buffer, to_write);
+        pthread_mutex_unlock(&file->lock);
+        return written;
+    }
 
     // Determine how many bytes to write
     size_t block_size = state_block_size();
@@ -308,14 +507,31 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     }
 
     if (to_write > 0) {
-        if (inode->i_size == 0) {
+        inode_write_lock(inode);
+
+        if (inode->i_data_block == -1 && inode->i_extent == -1) {
             // If empty file, allocate new block
             int bnum = data_block_alloc();
             if (bnum == -1) {
-                pthread_mutex_unlock(&open_file_table_mutex);
+                inode_write_unlock(inode);
+                pthread_mutex_unlock(&file->lock);
                 return -1; // no space
             }
 
+            inode->i_data_block = bnum;
+        } else if (inode_inflate(inode) == -1) {
+            // Compressed: it has to be moved back into a data block first
+            inode_write_unlock(inode);
+            pthread_mutex_unlock(&file->lock);
+            return -1;
+        } else {
+            // Shared with other files by dedup: copy it first
+            int bnum = data_block_unshare(inode->i_data_block);
+            if (bnum == -1) {
+                inode_write_unlock(inode);
+                pthread_mutex_unlock(&file->lock);
+                return -1; // no space
+            }
             inode->i_data_block = bnum;
         }
 
@@ -324,53 +540,203 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
 
         // Perform the actual write
         memcpy(block + file->of_offset, buffer, to_write);
+        data_block_written(inode->i_data_block, file->of_offset, to_write);
+        inode->i_cold_passes = 0;
 
         // The offset associated with the file handle is incremented accordingly
         file->of_offset += to_write;
         if (file->of_offset > inode->i_size) {
             inode->i_size = file->of_offset;
+            inode->i_reserved = file->of_offset;
+        }
+        if (inode->i_size == block_size) {
+            inode->i_data_block = data_block_dedup(inode->i_data_block);
         }
+
+        inode_write_unlock(inode);
     }
-    pthread_mutex_unlock(&open_file_table_mutex);
+    pthread_mutex_unlock(&file->lock);
     return (ssize_t)to_write;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    
-    pthread_mutex_t open_file_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-    
-    // Lock the mutex before accessing the open file table
-    pthread_mutex_lock(&open_file_table_mutex);
+/**
+ * Checks a file's data block against its checksum.
+ *
+ * Appends in flight (see tfs_append) modify the block past i_size before its
+ * checksum catches up, so a mismatch only means corruption if no append was in
+ * flight while checking; otherwise the check is repeated once they commit.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - block: its data block, as read by the caller
+ */
+static bool block_intact(inode_t *inode, int block) {
+    for (;;) {
+        size_t size = atomic_load(&inode->i_size);
+        size_t reserved = atomic_load(&inode->i_reserved);
+        if (data_block_verify(block)) {
+            return true;
+        }
+        if (size == reserved && atomic_load(&inode->i_reserved) == reserved) {
+            return false;
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * Sequential read-ahead for a read of [file->of_offset, end) from the file's
+ * data block.
+ *
+ * A read starting where the handle's previous read ended is sequential: the
+ * bytes after it are prefetched, in a window that starts at READAHEAD_MIN and
+ * doubles each time it is refilled (up to tfs_params.readahead_max). The next
+ * window is issued once a read gets within half a window of the prefetched
+ * end, so the prefetch stays ahead of the reader. Any other read resets the
+ * window.
+ */
+static void read_ahead(open_file_entry_t *file, int block, size_t size,
+                       size_t end) {
+    size_t max_window = state_readahead_max();
+    if (max_window == 0) {
+        return;
+    }
+
+    if (file->of_offset != file->of_ra_next) {
+        file->of_ra_window = 0;
+        file->of_ra_end = file->of_offset;
+    }
+    file->of_ra_next = end;
+
+    if (end + file->of_ra_window / 2 < file->of_ra_end) {
+        return; // well within the current window
+    }
+
+    if (file->of_ra_window == 0) {
+        file->of_ra_window =
+            READAHEAD_MIN < max_window ? READAHEAD_MIN : max_window;
+    } else if (file->of_ra_window < max_window / 2) {
+        file->of_ra_window *= 2;
+    } else {
+        file->of_ra_window = max_window;
+    }
 
+    size_t from = file->of_ra_end > end ? file->of_ra_end : end;
+    size_t to = from + file->of_ra_window;
+    if (to > size) {
+        to = size;
+    }
+    if (to > from) {
+        data_block_prefetch(block, from, to - from);
+        file->of_ra_end = to;
+    }
+}
+
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        // Unlock the mutex after accessing the open file table
-        pthread_mutex_unlock(&open_file_table_mutex);
         return -1;
     }
 
+    // Serialize operations on this handle (its offset)
+    pthread_mutex_lock(&file->lock);
+
     // From the open file table entry, we get the inode
-    inode_t const *inode = inode_get(file->of_inumber);
+    inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
+    if (inode->i_node_type != T_FILE) {
+        pthread_mutex_unlock(&file->lock);
+        return -1; // handle was opened with tfs_opendir
+    }
+
+    /*
+     * Plain data blocks are read without taking the inode's lock: snapshot
+     * the size and block, copy, and start over if a writer changed them
+     * meanwhile (appends never do: they only publish bytes past i_size).
+     * Block numbers stay valid even if the block is freed, so a stale one
+     * only yields bytes the retry throws away.
+     */
+    for (;;) {
+        unsigned int seq = inode_read_begin(inode);
+        if (inode->i_extent != -1) {
+            break; // compressed: decompressed under the lock below
+        }
+
+        // Determine how many bytes to read
+        size_t size =
+            atomic_load_explicit(&inode->i_size, memory_order_acquire);
+        int bnum = inode->i_data_block;
+        size_t to_read = size > file->of_offset ? size - file->of_offset : 0;
+        if (to_read > len) {
+            to_read = len;
+        }
+        if (to_read > 0 && bnum == -1) {
+            continue; // caught a writer mid-update
+        }
+
+        bool intact = true;
+        if (to_read > 0) {
+            intact = !state_verify_on_read() || block_intact(inode, bnum);
+
+            // Perform the actual read
+            char *block = data_block_get(bnum);
+            memcpy(buffer, block + file->of_offset, to_read);
+        }
+        if (inode_read_retry(inode, seq)) {
+            continue;
+        }
+        if (!intact) {
+            pthread_mutex_unlock(&file->lock);
+            return -1; // block contents do not match their checksum
+        }
+
+        if (to_read > 0) {
+            read_ahead(file, bnum, size, file->of_offset + to_read);
+        }
+        // The offset associated with the file handle is incremented accordingly
+        file->of_offset += to_read;
+        pthread_mutex_unlock(&file->lock);
+        return (ssize_t)to_read;
+    }
+
+    pthread_rwlock_rdlock(&inode->i_data_lock);
 
     // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    size_t to_read = inode->i_size > file->of_offset
+                         ? inode->i_size - file->of_offset
+                         : 0;
     if (to_read > len) {
         to_read = len;
     }
 
     if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
-
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
+        if (inode->i_extent != -1) {
+            // Compressed file: decompress the block and copy the part wanted
+            if (extent_read(inode, file->of_offset, buffer, to_read) == -1) {
+                pthread_rwlock_unlock(&inode->i_data_lock);
+                pthread_mutex_unlock(&file->lock);
+                return -1;
+            }
+        } else {
+            // Inflated meanwhile (reads are rare enough to just copy it here)
+            void *block = data_block_get(inode->i_data_block);
+            ALWAYS_ASSERT(block != NULL,
+                          "tfs_read: data block deleted mid-read");
+
+            if (state_verify_on_read() &&
+                !block_intact(inode, inode->i_data_block)) {
+                pthread_rwlock_unlock(&inode->i_data_lock);
+                pthread_mutex_unlock(&file->lock);
+                return -1; // block contents do not match their checksum
+            }
+            memcpy(buffer, block + file->of_offset, to_read);
+        }
         // The offset associated with the file handle is incremented accordingly
         file->of_offset += to_read;
     }
 
-    // Unlock the mutex after accessing the open file table
-    pthread_mutex_unlock(&open_file_table_mutex);
+    pthread_rwlock_unlock(&inode->i_data_lock);
+    pthread_mutex_unlock(&file->lock);
 
     return (ssize_t)to_read;
 }
@@ -385,36 +751,32 @@ int tfs_unlink(char const *target_file) {
     if(target_file == NULL){
         return -1;
     }
-    pthread_mutex_t root_inode_mutex = PTHREAD_MUTEX_INITIALIZER;
 
     inode_t *root_inode = inode_get(ROOT_DIR_INUM);
     // Find the inode number of the target file
     
     // Lock the mutex
-    pthread_mutex_lock(&root_inode_mutex);
+    pthread_mutex_lock(state_root_mutex());
     int target_file_inumber = tfs_lookup(target_file, root_inode);
     if (target_file_inumber == -1) {
     // tfs_lookup failed, return -1 to indicate an error
-        pthread_mutex_unlock(&root_inode_mutex); // unlock the mutex
+        pthread_mutex_unlock(state_root_mutex()); // unlock the mutex
         return -1;
     }
     inode_t *target_inode = inode_get(target_file_inumber);
     // Remove the file entry from the root directory
     if (clear_dir_entry(root_inode, target_file + 1) == -1) {
-        pthread_mutex_unlock(&root_inode_mutex); // unlock the mutex
+        pthread_mutex_unlock(state_root_mutex()); // unlock the mutex
         return -1;
     }
-    // Delete a soft link
-    if (target_inode->i_node_type == T_SOFT_LINK) {
-        inode_delete(target_file_inumber);
-    }
+    // Soft links have a single name, so this also deletes them
     target_inode->hard_links_count--;
     if (target_inode->hard_links_count == 0) {
         // delete inode
         inode_delete(target_file_inumber);
     }
     // Unlock the mutex
-    pthread_mutex_unlock(&root_inode_mutex);
+    pthread_mutex_unlock(state_root_mutex());
     return 0;
 }
 
@@ -468,5 +830,197 @@ int tfs_copy_from_external_fs(const char *source_path, const char *dest_path) {
 }
 
 
+int tfs_opendir(char const *name) {
+    // Only the root directory exists (plain directory space)
+    if (name == NULL || strcmp(name, "/") != 0) {
+        return -1;
+    }
+
+    // The open file entry offset is used as the directory cursor
+    return add_to_open_file_table(ROOT_DIR_INUM, 0, false);
+}
+
+ssize_t tfs_readdir(int dhandle, tfs_dirent_t *entries, size_t max_entries) {
+    if (entries == NULL) {
+        return -1;
+    }
+
+    open_file_entry_t *dir = get_open_file_entry(dhandle);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    inode_t const *dir_inode = inode_get(dir->of_inumber);
+    if (dir_inode->i_node_type != T_DIRECTORY) {
+        return -1; // handle was opened with tfs_open on a regular file
+    }
+
+    // The root mutex keeps entries from being added or cleared (and blocks
+    // from being chained) while the batch is read
+    pthread_mutex_lock(&dir->lock);
+    pthread_mutex_lock(state_root_mutex());
+    size_t count =
+        read_dir_entries(dir_inode, &dir->of_offset, entries, max_entries);
+    pthread_mutex_unlock(state_root_mutex());
+    pthread_mutex_unlock(&dir->lock);
+
+    return (ssize_t)count;
+}
+
+int tfs_closedir(int dhandle) { return tfs_close(dhandle); }
+
+/*
+ * Context variants: each runs the call above with `fs` as the calling thread's
+ * current instance, restoring the previous one afterwards.
+ */
+
+tfs_t *tfs_init_ctx(tfs_params const *params) {
+    tfs_t *fs = state_new();
+    if (fs == NULL) {
+        return NULL;
+    }
+
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_init(params); // unwinds itself on failure
+    state_switch(caller);
+
+    if (ret != 0) {
+        state_free(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+int tfs_destroy_ctx(tfs_t *fs) {
+    if (fs == NULL) {
+        return tfs_destroy();
+    }
+
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_destroy();
+    state_switch(caller);
+
+    state_free(fs);
+    return ret;
+}
+
+tfs_backing_t tfs_data_backing_ctx(tfs_t *fs) {
+    tfs_t *caller = state_switch(fs);
+    tfs_backing_t ret = tfs_data_backing();
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_open_ctx(tfs_t *fs, char const *name, tfs_file_mode_t mode) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_open(name, mode);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_sym_link_ctx(tfs_t *fs, char const *target, char const *link_name) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_sym_link(target, link_name);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_link_ctx(tfs_t *fs, char const *target_file, char const *link_name) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_link(target_file, link_name);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_close_ctx(tfs_t *fs, int fhandle) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_close(fhandle);
+    state_switch(caller);
+    return ret;
+}
+
+ssize_t tfs_write_ctx(tfs_t *fs, int fhandle, void const *buffer, size_t len) {
+    tfs_t *caller = state_switch(fs);
+    ssize_t ret = tfs_write(fhandle, buffer, len);
+    state_switch(caller);
+    return ret;
+}
+
+ssize_t tfs_read_ctx(tfs_t *fs, int fhandle, void *buffer, size_t len) {
+    tfs_t *caller = state_switch(fs);
+    ssize_t ret = tfs_read(fhandle, buffer, len);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_unlink_ctx(tfs_t *fs, char const *target) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_unlink(target);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_copy_from_external_fs_ctx(tfs_t *fs, char const *source_path,
+                                  char const *dest_path) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_copy_from_external_fs(source_path, dest_path);
+    state_switch(caller);
+    return ret;
+}
+
+ssize_t tfs_scrub_ctx(tfs_t *fs, size_t threads) {
+    tfs_t *caller = state_switch(fs);
+    ssize_t ret = tfs_scrub(threads);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_fsync_ctx(tfs_t *fs, int fhandle) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_fsync(fhandle);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_syncfs_ctx(tfs_t *fs) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_syncfs();
+    state_switch(caller);
+    return ret;
+}
+
+ssize_t tfs_compress_cold_ctx(tfs_t *fs) {
+    tfs_t *caller = state_switch(fs);
+    ssize_t ret = tfs_compress_cold();
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_stats_ctx(tfs_t *fs, tfs_stats_t *stats) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_stats(stats);
+    state_switch(caller);
+    return ret;
+}
 
+int tfs_opendir_ctx(tfs_t *fs, char const *name) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_opendir(name);
+    state_switch(caller);
+    return ret;
+}
 
+ssize_t tfs_readdir_ctx(tfs_t *fs, int dhandle, tfs_dirent_t *entries,
+                        size_t max_entries) {
+    tfs_t *caller = state_switch(fs);
+    ssize_t ret = tfs_readdir(dhandle, entries, max_entries);
+    state_switch(caller);
+    return ret;
+}
+
+int tfs_closedir_ctx(tfs_t *fs, int dhandle) {
+    tfs_t *caller = state_switch(fs);
+    int ret = tfs_closedir(dhandle);
+    state_switch(caller);
+    return ret;
+}
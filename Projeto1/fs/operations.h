@@ -2,8 +2,19 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
 #include <sys/types.h>
 
+/**
+ * When modified blocks of a file-backed volume are written back to the file
+ * (tfs_fsync, tfs_syncfs and tfs_destroy write them back in every mode).
+ */
+typedef enum {
+    TFS_DURABILITY_NONE,     // only on tfs_fsync/tfs_syncfs
+    TFS_DURABILITY_PERIODIC, // also every flush_interval_ms, in the background
+    TFS_DURABILITY_ON_CLOSE, // also when a handle to the file is closed
+} tfs_durability_t;
+
 /**
  * TécnicoFS parameters.
  */
@@ -13,8 +24,71 @@ typedef struct {
     size_t max_open_files_count;
 
     size_t block_size;
+
+    // The inode table, data region and open file table start with the counts
+    // above and grow on demand, one segment of that size at a time, up to this
+    // many segments (16 by default; 1 keeps them fixed; capped at
+    // MAX_TABLE_SEGMENTS)
+    size_t max_table_segments;
+
+    // Busy-loop iterations emulating each storage access (DELAY by default;
+    // 0 disables the emulation, e.g. for benchmarks)
+    size_t access_delay;
+
+    // Back the data region with 2 MB huge pages (MAP_HUGETLB, falling back to
+    // madvise(MADV_HUGEPAGE)); see tfs_data_backing for what was obtained
+    bool huge_pages;
+
+    // Check each data block against its CRC32C on tfs_read (off by default;
+    // checksums are always maintained, and tfs_scrub verifies them regardless)
+    bool verify_checksums;
+
+    // Size (in bytes) of the area holding compressed blocks of files opened
+    // with TFS_O_COMPRESS (0 disables compression); the area, and the thread
+    // below, are only set up on the first such open
+    size_t compressed_area_size;
+
+    // Period of the background thread compressing cold blocks (0 disables
+    // the thread; tfs_compress_cold can still be called directly)
+    size_t compress_interval_ms;
+
+    // Share identical full file blocks between files (copied on write)
+    bool dedup;
+
+    // Number of allocation groups the data region is split into (per
+    // segment); each thread allocates from its own group while it has room
+    size_t alloc_groups;
+
+    // Keep the file system in this file instead of memory (NULL keeps it in
+    // memory). The file is created if needed; if it already holds a file
+    // system, tfs_init mounts it, as of its last tfs_syncfs or tfs_destroy,
+    // and fails if it was made with another block_size, max_inode_count,
+    // max_block_count or max_table_segments. Compression is disabled on
+    // file-backed volumes
+    char const *volume_path;
+
+    // When modified blocks are written back to the volume file
+    tfs_durability_t durability;
+
+    // Period of the background flush (TFS_DURABILITY_PERIODIC)
+    size_t flush_interval_ms;
+
+    // Largest read-ahead window (in bytes) for handles reading a file
+    // sequentially from a file-backed volume (0 disables read-ahead)
+    size_t readahead_max;
 } tfs_params;
 
+/**
+ * Memory backing the data region.
+ */
+typedef enum {
+    TFS_BACKING_MALLOC,     // plain heap allocation (huge_pages not requested)
+    TFS_BACKING_PAGES,      // anonymous mapping of regular pages
+    TFS_BACKING_THP,        // transparent huge pages (madvise(MADV_HUGEPAGE))
+    TFS_BACKING_HUGETLB,    // explicit huge pages (MAP_HUGETLB)
+    TFS_BACKING_FILE,       // shared mapping of the volume file
+} tfs_backing_t;
+
 /**
  * Return a sane default set of parameters for tecnicofs.
  */
@@ -27,11 +101,19 @@ tfs_params tfs_default_params();
 int tfs_init(tfs_params const *params);
 
 /**
- * Destroy tecnicofs.
+ * Destroy tecnicofs (a file-backed volume is written back first, see
+ * tfs_syncfs).
  * Returns 0 if successful, -1 otherwise.
  */
 int tfs_destroy();
 
+/**
+ * Report the weakest backing obtained for the data region (e.g. if some
+ * segments only got regular pages while others got huge pages, reports
+ * TFS_BACKING_PAGES).
+ */
+tfs_backing_t tfs_data_backing(void);
+
 /**
  * TécnicoFS file opening modes.
  */
@@ -39,6 +121,7 @@ typedef enum {
     TFS_O_CREAT = 0b001,
     TFS_O_TRUNC = 0b010,
     TFS_O_APPEND = 0b100,
+    TFS_O_COMPRESS = 0b1000,
 } tfs_file_mode_t;
 
 /**
@@ -50,6 +133,8 @@ typedef enum {
  *     - append mode (TFS_O_APPEND)
  *     - truncate file contents (TFS_O_TRUNC)
  *     - create file if it does not exist (TFS_O_CREAT)
+ *     - let the file's data be compressed once it is full and cold
+ *       (TFS_O_COMPRESS; sticks to the file after it is closed)
  *
  * Returns file handle of the opened file if successful, -1 otherwise.
  */
@@ -137,4 +222,167 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Verify the checksum of every allocated data block of the volume.
+ *
+ * Input:
+ *   - threads: number of threads sharing the work
+ *
+ * Returns the number of corrupted blocks found, or -1 in case of error.
+ */
+ssize_t tfs_scrub(size_t threads);
+
+/**
+ * Write the modified blocks of an open file, and its inode, back to the
+ * volume file (no-op if the volume is not file-backed). A new name for the
+ * file is only kept once tfs_syncfs writes the directory back.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_fsync(int fhandle);
+
+/**
+ * Write every modified block back to the volume file, coalescing runs of
+ * adjacent blocks into one flush, and then the inode table (no-op if the
+ * volume is not file-backed). The next tfs_init mounts the volume as of then.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_syncfs(void);
+
+/**
+ * Run one compression pass: every full block of a file opened with
+ * TFS_O_COMPRESS that went unmodified for COMPRESS_COLD_PASSES passes is
+ * compressed into the extent area and its data block is freed. Compressed
+ * files are decompressed on tfs_read, and back into a data block on tfs_write.
+ *
+ * Called periodically by the background compression thread (see
+ * tfs_params.compress_interval_ms).
+ *
+ * Returns the number of blocks compressed, or -1 in case of error.
+ */
+ssize_t tfs_compress_cold(void);
+
+/**
+ * File system usage statistics.
+ */
+typedef struct {
+    size_t compressed_blocks; // blocks stored in the extent area
+    size_t compressed_bytes;  // extent area bytes used by them
+    size_t blocks_in_use;     // allocated data blocks
+    size_t block_references;  // uses of them (blocks shared by dedup count
+                              // once per file)
+    double dedup_ratio;       // block_references / blocks_in_use
+    size_t inodes_in_use;     // allocated inodes (root directory included)
+    size_t open_files_in_use; // open file and directory handles
+    size_t flushed_blocks;    // blocks written back to the volume file
+    size_t readahead_bytes;   // bytes prefetched from the volume file
+} tfs_stats_t;
+
+/**
+ * Fill `stats` with the current usage statistics.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stats(tfs_stats_t *stats);
+
+/**
+ * Type of a directory entry, as returned by tfs_readdir.
+ */
+typedef enum {
+    TFS_DT_FILE,
+    TFS_DT_DIRECTORY,
+    TFS_DT_SOFT_LINK,
+} tfs_dirent_type_t;
+
+/**
+ * Directory entry, as returned by tfs_readdir.
+ */
+typedef struct {
+    char d_name[MAX_FILE_NAME];
+    int d_inumber;
+    tfs_dirent_type_t d_type;
+    size_t d_size;
+} tfs_dirent_t;
+
+/**
+ * Open a directory for listing.
+ *
+ * Input:
+ *   - name: absolute path name of the directory (only "/" is supported)
+ *
+ * Returns a directory handle (to be used with tfs_readdir and tfs_closedir)
+ * if successful, -1 otherwise.
+ */
+int tfs_opendir(char const *name);
+
+/**
+ * Read the next batch of entries of an open directory.
+ *
+ * Entries are read straight from the directory block, in directory order,
+ * each one with its inode's type and size.
+ *
+ * Input:
+ *   - dhandle: directory handle (obtained from a previous call to tfs_opendir)
+ *   - entries: destination array
+ *   - max_entries: capacity of the destination array
+ *
+ * Returns the number of entries copied (0 once the whole directory has been
+ * read), or -1 in case of error.
+ */
+ssize_t tfs_readdir(int dhandle, tfs_dirent_t *entries, size_t max_entries);
+
+/**
+ * Close a directory handle.
+ *
+ * Input:
+ *   - dhandle: directory handle (obtained from a previous call to tfs_opendir)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_closedir(int dhandle);
+
+/**
+ * Independent TécnicoFS instance (its own tables, data region, locks and
+ * background threads). The functions above work on a default instance; the
+ * _ctx variants below do the same on a given one (NULL selects the default
+ * instance). File handles are only valid in the instance that returned them.
+ */
+typedef struct tfs tfs_t;
+
+/**
+ * Create and initialize a new instance (see tfs_init).
+ * Returns the instance if successful, NULL otherwise.
+ */
+tfs_t *tfs_init_ctx(tfs_params const *params);
+
+/**
+ * Destroy an instance created with tfs_init_ctx (see tfs_destroy).
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_destroy_ctx(tfs_t *fs);
+
+tfs_backing_t tfs_data_backing_ctx(tfs_t *fs);
+int tfs_open_ctx(tfs_t *fs, char const *name, tfs_file_mode_t mode);
+int tfs_sym_link_ctx(tfs_t *fs, char const *target, char const *link_name);
+int tfs_link_ctx(tfs_t *fs, char const *target_file, char const *link_name);
+int tfs_close_ctx(tfs_t *fs, int fhandle);
+ssize_t tfs_write_ctx(tfs_t *fs, int fhandle, void const *buffer, size_t len);
+ssize_t tfs_read_ctx(tfs_t *fs, int fhandle, void *buffer, size_t len);
+int tfs_unlink_ctx(tfs_t *fs, char const *target);
+int tfs_copy_from_external_fs_ctx(tfs_t *fs, char const *source_path,
+                                  char const *dest_path);
+ssize_t tfs_scrub_ctx(tfs_t *fs, size_t threads);
+int tfs_fsync_ctx(tfs_t *fs, int fhandle);
+int tfs_syncfs_ctx(tfs_t *fs);
+ssize_t tfs_compress_cold_ctx(tfs_t *fs);
+int tfs_stats_ctx(tfs_t *fs, tfs_stats_t *stats);
+int tfs_opendir_ctx(tfs_t *fs, char const *name);
+ssize_t tfs_readdir_ctx(tfs_t *fs, int dhandle, tfs_dirent_t *entries,
+                        size_t max_entries);
+int tfs_closedir_ctx(tfs_t *fs, int dhandle);
+
 #endif // OPERATIONS_H
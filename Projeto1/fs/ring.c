@@ -0,0 +1,205 @@
+#include "ring.h"
+#include "betterassert.h"
+#include "state.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Run one submitted operation through the synchronous API.
+ */
+static ssize_t ring_execute(tfs_sqe_t const *sqe) {
+    switch (sqe->op) {
+    case TFS_OP_OPEN:
+        return tfs_open(sqe->name, sqe->mode);
+    case TFS_OP_CLOSE:
+        return tfs_close(sqe->fhandle);
+    case TFS_OP_READ:
+        return tfs_read(sqe->fhandle, sqe->buffer, sqe->len);
+    case TFS_OP_WRITE:
+        return tfs_write(sqe->fhandle, sqe->buffer, sqe->len);
+    case TFS_OP_UNLINK:
+        return tfs_unlink(sqe->name);
+    default:
+        return -1; // unknown operation
+    }
+}
+
+/**
+ * Worker thread: takes operations from the submission ring, runs them and
+ * posts their results to the completion ring.
+ */
+static void *ring_worker(void *arg) {
+    tfs_ring_t *ring = (tfs_ring_t *)arg;
+    state_switch(ring->fs);
+
+    for (;;) {
+        pthread_mutex_lock(&ring->sq_lock);
+        while (ring->sq_count == 0 && !ring->stopping) {
+            pthread_cond_wait(&ring->sq_nonempty, &ring->sq_lock);
+        }
+        if (ring->sq_count == 0) { // stopping, and nothing left to do
+            pthread_mutex_unlock(&ring->sq_lock);
+            return NULL;
+        }
+
+        tfs_sqe_t sqe = ring->sq[ring->sq_head];
+        ring->sq_head = (ring->sq_head + 1) % ring->entries;
+        ring->sq_count--;
+        pthread_mutex_unlock(&ring->sq_lock);
+
+        tfs_cqe_t cqe = {
+            .result = ring_execute(&sqe),
+            .user_data = sqe.user_data,
+        };
+
+        // in_flight <= entries, so the completion ring always has room
+        pthread_mutex_lock(&ring->cq_lock);
+        ALWAYS_ASSERT(ring->cq_count < ring->entries,
+                      "ring_worker: completion ring overflow");
+        ring->cq[(ring->cq_head + ring->cq_count) % ring->entries] = cqe;
+        ring->cq_count++;
+        pthread_cond_broadcast(&ring->cq_nonempty);
+        pthread_mutex_unlock(&ring->cq_lock);
+    }
+}
+
+int tfs_ring_init(tfs_ring_t *ring, size_t entries, size_t workers) {
+    return tfs_ring_init_ctx(ring, NULL, entries, workers);
+}
+
+int tfs_ring_init_ctx(tfs_ring_t *ring, tfs_t *fs, size_t entries,
+                      size_t workers) {
+    if (ring == NULL || entries == 0 || workers == 0) {
+        return -1;
+    }
+
+    memset(ring, 0, sizeof(*ring));
+    ring->entries = entries;
+    ring->fs = fs;
+    ring->sq = malloc(entries * sizeof(tfs_sqe_t));
+    ring->cq = malloc(entries * sizeof(tfs_cqe_t));
+    ring->workers = malloc(workers * sizeof(pthread_t));
+    if (!ring->sq || !ring->cq || !ring->workers) {
+        free(ring->sq);
+        free(ring->cq);
+        free(ring->workers);
+        return -1;
+    }
+
+    pthread_mutex_init(&ring->sq_lock, NULL);
+    pthread_cond_init(&ring->sq_nonempty, NULL);
+    pthread_mutex_init(&ring->cq_lock, NULL);
+    pthread_cond_init(&ring->cq_nonempty, NULL);
+
+    for (size_t i = 0; i < workers; i++) {
+        if (pthread_create(&ring->workers[i], NULL, ring_worker, ring) != 0) {
+            ring->worker_count = i;
+            tfs_ring_destroy(ring);
+            return -1;
+        }
+    }
+    ring->worker_count = workers;
+
+    return 0;
+}
+
+int tfs_ring_destroy(tfs_ring_t *ring) {
+    if (ring == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring->sq_lock);
+    ring->stopping = true;
+    pthread_cond_broadcast(&ring->sq_nonempty);
+    pthread_mutex_unlock(&ring->sq_lock);
+
+    int ret = 0;
+    for (size_t i = 0; i < ring->worker_count; i++) {
+        if (pthread_join(ring->workers[i], NULL) != 0) {
+            ret = -1;
+        }
+    }
+
+    pthread_mutex_destroy(&ring->sq_lock);
+    pthread_cond_destroy(&ring->sq_nonempty);
+    pthread_mutex_destroy(&ring->cq_lock);
+    pthread_cond_destroy(&ring->cq_nonempty);
+
+    free(ring->sq);
+    free(ring->cq);
+    free(ring->workers);
+    ring->sq = NULL;
+    ring->cq = NULL;
+    ring->workers = NULL;
+
+    return ret;
+}
+
+ssize_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count) {
+    if (ring == NULL || (sqes == NULL && count > 0)) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&ring->sq_lock);
+    if (ring->stopping) {
+        pthread_mutex_unlock(&ring->sq_lock);
+        return -1;
+    }
+
+    // Queue as much of the batch as the free slots allow, then wake the
+    // workers once for all of it
+    size_t submitted = 0;
+    while (submitted < count && ring->in_flight < ring->entries) {
+        ring->sq[(ring->sq_head + ring->sq_count) % ring->entries] =
+            sqes[submitted++];
+        ring->sq_count++;
+        ring->in_flight++;
+    }
+    if (submitted > 0) {
+        pthread_cond_broadcast(&ring->sq_nonempty);
+    }
+    pthread_mutex_unlock(&ring->sq_lock);
+
+    return (ssize_t)submitted;
+}
+
+ssize_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max,
+                      size_t wait_for) {
+    if (ring == NULL || (cqes == NULL && max > 0)) {
+        return -1;
+    }
+    if (wait_for > max) {
+        wait_for = max;
+    }
+
+    pthread_mutex_lock(&ring->sq_lock);
+    bool can_wait = wait_for <= ring->in_flight;
+    pthread_mutex_unlock(&ring->sq_lock);
+    if (!can_wait) {
+        return -1; // would wait forever
+    }
+
+    pthread_mutex_lock(&ring->cq_lock);
+    while (ring->cq_count < wait_for) {
+        pthread_cond_wait(&ring->cq_nonempty, &ring->cq_lock);
+    }
+
+    size_t reaped = 0;
+    while (reaped < max && ring->cq_count > 0) {
+        cqes[reaped++] = ring->cq[ring->cq_head];
+        ring->cq_head = (ring->cq_head + 1) % ring->entries;
+        ring->cq_count--;
+    }
+    pthread_mutex_unlock(&ring->cq_lock);
+
+    if (reaped > 0) {
+        pthread_mutex_lock(&ring->sq_lock);
+        ring->in_flight -= reaped;
+        pthread_mutex_unlock(&ring->sq_lock);
+    }
+
+    return (ssize_t)reaped;
+}
@@ -0,0 +1,151 @@
+#ifndef RING_H
+#define RING_H
+
+#include "operations.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Operations that can be submitted to a TécnicoFS ring.
+ */
+typedef enum {
+    TFS_OP_OPEN,
+    TFS_OP_CLOSE,
+    TFS_OP_READ,
+    TFS_OP_WRITE,
+    TFS_OP_UNLINK,
+} tfs_ring_op_t;
+
+/**
+ * Submission queue entry.
+ *
+ * Only the fields used by the operation need to be filled:
+ *   - TFS_OP_OPEN: name, mode
+ *   - TFS_OP_CLOSE: fhandle
+ *   - TFS_OP_READ: fhandle, buffer, len
+ *   - TFS_OP_WRITE: fhandle, buffer, len
+ *   - TFS_OP_UNLINK: name
+ *
+ * name and buffer must stay valid until the matching completion is reaped.
+ */
+typedef struct {
+    tfs_ring_op_t op;
+    int fhandle;
+    char const *name;
+    tfs_file_mode_t mode;
+    void *buffer;
+    size_t len;
+    void *user_data; // copied as-is to the completion
+} tfs_sqe_t;
+
+/**
+ * Completion queue entry.
+ *
+ * result is what the synchronous call would have returned (file handle for
+ * open, byte count for read/write, 0/-1 for close/unlink).
+ */
+typedef struct {
+    ssize_t result;
+    void *user_data;
+} tfs_cqe_t;
+
+/**
+ * Submission/completion ring served by a pool of FS worker threads.
+ *
+ * At most `entries` operations can be in flight (submitted and not yet
+ * reaped), which also bounds the completion ring, so workers never block on
+ * a full completion ring. The workers run every operation on instance fs
+ * (NULL for the default one).
+ */
+typedef struct {
+    size_t entries;
+    tfs_t *fs;
+
+    pthread_mutex_t sq_lock;
+    pthread_cond_t sq_nonempty; // workers wait here for submissions
+    tfs_sqe_t *sq;
+    size_t sq_head;
+    size_t sq_count;
+    size_t in_flight;
+    bool stopping;
+
+    pthread_mutex_t cq_lock;
+    pthread_cond_t cq_nonempty; // reapers wait here for completions
+    tfs_cqe_t *cq;
+    size_t cq_head;
+    size_t cq_count;
+
+    pthread_t *workers;
+    size_t worker_count;
+} tfs_ring_t;
+
+/**
+ * Create a ring and start its worker threads.
+ *
+ * Memory: the ring pointer must be previously allocated (either on the stack
+ * or the heap).
+ *
+ * Input:
+ *   - ring: ring to initialize
+ *   - entries: maximum number of operations in flight
+ *   - workers: number of FS worker threads
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ring_init(tfs_ring_t *ring, size_t entries, size_t workers);
+
+/**
+ * Like tfs_ring_init, but the ring's operations run on instance fs (see
+ * tfs_init_ctx), whose file handles they take and return.
+ */
+int tfs_ring_init_ctx(tfs_ring_t *ring, tfs_t *fs, size_t entries,
+                      size_t workers);
+
+/**
+ * Stop the worker threads (after they finish the submitted operations) and
+ * release the resources of the ring. Completions not yet reaped are dropped.
+ *
+ * Memory: does not free the ring pointer itself.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_ring_destroy(tfs_ring_t *ring);
+
+/**
+ * Submit a batch of operations.
+ *
+ * Never sleeps: only as many operations as there are free in-flight slots are
+ * submitted (possibly none), and the caller reaps completions before
+ * submitting the rest.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - sqes: operations to submit
+ *   - count: number of operations in sqes
+ *
+ * Returns the number of operations submitted (from the start of sqes), or -1 in
+ * case of error.
+ */
+ssize_t tfs_ring_submit(tfs_ring_t *ring, tfs_sqe_t const *sqes, size_t count);
+
+/**
+ * Reap completed operations.
+ *
+ * Sleeps until at least `wait_for` completions are available (pass 0 to only
+ * collect what has already completed), then copies up to `max` of them.
+ *
+ * Input:
+ *   - ring: the ring
+ *   - cqes: destination array
+ *   - max: capacity of cqes
+ *   - wait_for: minimum number of completions to return (capped at max)
+ *
+ * Returns the number of completions copied, or -1 in case of error (e.g.
+ * waiting for more completions than there are operations in flight).
+ */
+ssize_t tfs_ring_reap(tfs_ring_t *ring, tfs_cqe_t *cqes, size_t max,
+                      size_t wait_for);
+
+#endif // RING_H
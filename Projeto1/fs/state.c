@@ -1,5 +1,8 @@
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB, madvise
 #include "state.h"
 #include "betterassert.h"
+#include "crc32c.h"
+#include "lz.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -7,36 +10,290 @@
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /*
- * Persistent FS state
- * (in reality, it should be maintained in secondary memory;
- * for simplicity, this project maintains it in primary memory).
- * Persistent data structures, include inode table, data blocks and an open file table.
+ * Block allocation groups: every data region segment is split into
+ * groups_per_segment groups of contiguous blocks, each with its own lock and
+ * free count. A thread allocates from its home group first (in every segment)
+ * and only steals from the other groups when those are full, so concurrent
+ * writers neither contend on the same lock nor interleave their blocks.
  */
-static tfs_params fs_params;  // structure that holds the file system's parameters
+typedef struct {
+    pthread_mutex_t lock;
+    _Atomic size_t free_count;
+    size_t hint; // block (within the segment) the next search starts from
+} alloc_group_t;
 
-// Inode table
-static inode_t *inode_table; 
-static allocation_state_t *freeinode_ts; // used and available  
+// Home group tickets, handed out to threads in turn (shared by all instances)
+static _Atomic size_t next_alloc_home;
+static _Thread_local size_t alloc_home = SIZE_MAX;
 
-// Data blocks
-static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks; // used and available
+/*
+ * Background task, run every interval_ms by its own thread until stopped
+ * (compression passes and periodic flushes).
+ */
+typedef struct {
+    pthread_t thread;
+    bool running;
+    bool stopping;
+    size_t interval_ms;
+    void (*run)(void);
+    tfs_t *fs; // instance the task runs on
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} periodic_task_t;
+
+/*
+ * A TécnicoFS instance: everything below used to be file-scope state, so
+ * several independent volumes can live in one process. State functions work
+ * on the calling thread's current instance (fs; see state_switch).
+ */
+struct tfs {
+    /*
+     * Persistent FS state
+     * (in reality, it should be maintained in secondary memory;
+     * for simplicity, this project maintains it in primary memory).
+     * Persistent data structures, include inode table, data blocks and an
+     * open file table.
+     */
+    tfs_params params;  // structure that holds the file system's parameters
+
+    /*
+     * Every table below is split into segments of a fixed length (the initial
+     * size requested in tfs_params). Growing a table only allocates and
+     * publishes a new segment; existing segments never move, so inumbers,
+     * block numbers, file handles and pointers obtained from them stay valid
+     * while the table grows.
+     */
+
+    // Inode table
+    inode_t *inode_table[MAX_TABLE_SEGMENTS];
+    allocation_state_t *freeinode_ts[MAX_TABLE_SEGMENTS]; // used and available
+
+    // Data blocks
+    char *data[MAX_TABLE_SEGMENTS]; // # blocks * block size (per segment)
+    tfs_backing_t data_backing[MAX_TABLE_SEGMENTS];
+    allocation_state_t *free_blocks[MAX_TABLE_SEGMENTS]; // used and available
+    // CRC32C of the written prefix of each block, with the prefix's length in
+    // the upper 32 bits (see data_block_written)
+    _Atomic uint64_t *block_crcs[MAX_TABLE_SEGMENTS];
+    unsigned int *block_refs[MAX_TABLE_SEGMENTS]; // inodes using each block
+    int *block_dedup_next[MAX_TABLE_SEGMENTS]; // dedup index chain links
+
+    /*
+     * Volatile FS state
+     * Volatile data structures, include an allocation state table for the
+     * inode table, data blocks and open file table.
+     */
+    open_file_entry_t *open_file_table[MAX_TABLE_SEGMENTS];
+    // used and available
+    allocation_state_t *free_open_file_entries[MAX_TABLE_SEGMENTS];
+    pthread_mutex_t open_file_allocation_table_mutex;
+
+    // Number of published segments of each table (readers never take a lock)
+    _Atomic size_t inode_segments;
+    _Atomic size_t block_segments;
+    _Atomic size_t open_file_segments;
+
+    // Serializes growers; readers are never blocked by it
+    pthread_mutex_t grow_mutex;
+
+    // Protects the root directory: lookups, entry creation/removal and link
+    // counts (taken by operations.c, see state_root_mutex)
+    pthread_mutex_t root_inode_mutex;
+
+    // Block allocation groups (see alloc_group_t)
+    alloc_group_t *alloc_groups[MAX_TABLE_SEGMENTS];
+    size_t groups_per_segment;
+
+    /*
+     * Dedup index: full file blocks, chained by the CRC32C they already carry
+     * as checksum (identical contents are confirmed with memcmp). Indexed
+     * blocks are never modified in place: writers first take a private copy
+     * (see data_block_unshare). dedup_mutex protects the index and block_refs.
+     */
+    int *dedup_buckets;
+    size_t dedup_bucket_count; // a power of two
+    pthread_mutex_t dedup_mutex;
+
+    /*
+     * Compressed extent area: blocks of files opened with TFS_O_COMPRESS, once
+     * compressed, live here as runs of EXTENT_GRANULE-byte granules. The area
+     * and the compressor are only set up on the first such open
+     * (compression_ready is then set, under extent_mutex).
+     */
+    _Atomic bool compression_ready;
+    char *extent_area;
+    allocation_state_t *extent_map; // used and available granules
+    size_t extent_granules;
+    size_t compressed_blocks; // blocks currently stored compressed
+    size_t compressed_granules;
+    pthread_mutex_t extent_mutex;
+
+    /*
+     * File-backed volume: the file starts with the metadata area (see
+     * volume_super_t), volume_meta_size bytes long, followed by the data
+     * region, a shared mapping of the file, one segment after the other (each
+     * rounded up to whole pages). Blocks modified since they were last
+     * flushed are marked in dirty_bits. volume_mutex serializes metadata
+     * write-backs; volume_ready is set once they may happen (the tables are
+     * set up) and volume_mounted if state_init found a file system there.
+     */
+    int volume_fd;
+    size_t volume_meta_size;
+    bool volume_ready;
+    bool volume_mounted;
+    pthread_mutex_t volume_mutex;
+    _Atomic uint64_t *dirty_bits[MAX_TABLE_SEGMENTS];
+    _Atomic size_t flushed_blocks;
+    _Atomic size_t readahead_bytes;
+
+    // Background compression passes and periodic flushes
+    periodic_task_t compressor;
+    periodic_task_t flusher;
+};
+
+#define DEDUP_UNINDEXED (-2) // block_dedup_next of blocks not in the index
+
+#define VOLUME_MAGIC UINT64_C(0x3130564f4c534654) // "TFSLOV01"
 
 /*
- * Volatile FS state
- * Volatile data structures, include an allocation state table for the inode table, data blocks and open file table.
- */
-static open_file_entry_t *open_file_table; 
-static allocation_state_t *free_open_file_entries; // used and available
-pthread_mutex_t open_file_allocation_table_mutex = PTHREAD_MUTEX_INITIALIZER;
-// Convenience macros 
-#define INODE_TABLE_SIZE (fs_params.max_inode_count)
-#define DATA_BLOCKS (fs_params.max_block_count)
-#define MAX_OPEN_FILES (fs_params.max_open_files_count)
-#define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t)) // max directory entries in a single block
+ * Superblock, at the start of the volume file, followed by a volume_inode_t
+ * per inode the inode table can grow to. The geometry must match the
+ * parameters a volume is mounted with. It stays zeroed until the metadata is
+ * first written back, so such a volume holds no file system yet.
+ */
+typedef struct {
+    uint64_t magic;
+    uint64_t block_size;
+    uint64_t inode_segment_len;
+    uint64_t block_segment_len;
+    uint64_t max_table_segments;
+    uint64_t inode_segments; // segments in use when it was written
+    uint64_t block_segments;
+} volume_super_t;
+
+// What the volume file keeps of an inode; the rest (link counts, block
+// allocation, reference counts and checksums) is rebuilt when mounting
+typedef struct {
+    uint32_t taken;
+    int32_t type;
+    int32_t data_block;
+    uint32_t size;
+    char target[MAX_FILE_NAME];
+} volume_inode_t;
+
+// The instance behind the original (context-free) API
+static tfs_t default_fs = {
+    .open_file_allocation_table_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .grow_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .root_inode_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .dedup_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .extent_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .volume_fd = -1,
+    .volume_mutex = PTHREAD_MUTEX_INITIALIZER,
+    .compressor = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                   .cond = PTHREAD_COND_INITIALIZER},
+    .flusher = {.mutex = PTHREAD_MUTEX_INITIALIZER,
+                .cond = PTHREAD_COND_INITIALIZER},
+};
+
+// Instance the calling thread is working on
+static _Thread_local tfs_t *fs = &default_fs;
+
+static int periodic_task_start(periodic_task_t *task, size_t interval_ms,
+                               void (*run)(void));
+static void periodic_task_stop(periodic_task_t *task);
+static void compress_pass(void);
+static void flush_pass(void);
+static int dir_block_next(dir_entry_t const *dir_entry);
+
+// Convenience macros
+#define INODE_SEGMENT_LEN (fs->params.max_inode_count)
+#define BLOCK_SEGMENT_LEN (fs->params.max_block_count)
+#define OPEN_FILE_SEGMENT_LEN (fs->params.max_open_files_count)
+#define INODE_TABLE_SIZE (INODE_SEGMENT_LEN * published_segments(&fs->inode_segments))
+#define DATA_BLOCKS (BLOCK_SEGMENT_LEN * published_segments(&fs->block_segments))
+#define MAX_OPEN_FILES (OPEN_FILE_SEGMENT_LEN * published_segments(&fs->open_file_segments))
+#define BLOCK_SIZE (fs->params.block_size)
+// Directory entries held by each block of a directory; the blocks of a
+// directory are chained, the last sizeof(int) bytes of each one holding the
+// number of the next block (-1 in the last one)
+#define MAX_DIR_ENTRIES ((BLOCK_SIZE - sizeof(int)) / sizeof(dir_entry_t))
+
+static inline size_t published_segments(_Atomic size_t *segments) {
+    return atomic_load_explicit(segments, memory_order_acquire);
+}
+
+static inline inode_t *inode_at(size_t inumber) {
+    return &fs->inode_table[inumber / INODE_SEGMENT_LEN]
+                           [inumber % INODE_SEGMENT_LEN];
+}
+
+static inline allocation_state_t *freeinode_at(size_t inumber) {
+    return &fs->freeinode_ts[inumber / INODE_SEGMENT_LEN]
+                            [inumber % INODE_SEGMENT_LEN];
+}
+
+static inline char *block_at(size_t block_number) {
+    return &fs->data[block_number / BLOCK_SEGMENT_LEN]
+                   [(block_number % BLOCK_SEGMENT_LEN) * BLOCK_SIZE];
+}
+
+static inline allocation_state_t *free_block_at(size_t block_number) {
+    return &fs->free_blocks[block_number / BLOCK_SEGMENT_LEN]
+                       [block_number % BLOCK_SEGMENT_LEN];
+}
+
+static inline _Atomic uint64_t *block_crc_at(size_t block_number) {
+    return &fs->block_crcs[block_number / BLOCK_SEGMENT_LEN]
+                      [block_number % BLOCK_SEGMENT_LEN];
+}
+
+static inline uint32_t block_crc(size_t block_number) {
+    return (uint32_t)atomic_load(block_crc_at(block_number));
+}
+
+static inline unsigned int *block_ref_at(size_t block_number) {
+    return &fs->block_refs[block_number / BLOCK_SEGMENT_LEN]
+                      [block_number % BLOCK_SEGMENT_LEN];
+}
+
+static inline int *block_dedup_next_at(size_t block_number) {
+    return &fs->block_dedup_next[block_number / BLOCK_SEGMENT_LEN]
+                            [block_number % BLOCK_SEGMENT_LEN];
+}
+
+// First block (within a segment) of allocation group g
+static inline size_t group_first(size_t g) {
+    return g * BLOCK_SEGMENT_LEN / fs->groups_per_segment;
+}
+
+static inline alloc_group_t *group_of(size_t block_number) {
+    size_t in_segment = block_number % BLOCK_SEGMENT_LEN;
+    size_t g = (in_segment + 1) * fs->groups_per_segment / BLOCK_SEGMENT_LEN;
+    while (group_first(g) > in_segment) {
+        g--;
+    }
+    return &fs->alloc_groups[block_number / BLOCK_SEGMENT_LEN][g];
+}
+
+static inline open_file_entry_t *open_file_at(size_t fhandle) {
+    return &fs->open_file_table[fhandle / OPEN_FILE_SEGMENT_LEN]
+                           [fhandle % OPEN_FILE_SEGMENT_LEN];
+}
+
+static inline allocation_state_t *free_open_file_at(size_t fhandle) {
+    return &fs->free_open_file_entries[fhandle / OPEN_FILE_SEGMENT_LEN]
+                                  [fhandle % OPEN_FILE_SEGMENT_LEN];
+}
 
 static inline bool valid_inumber(int inumber) { 
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -50,8 +307,84 @@ static inline bool valid_file_handle(int file_handle) {
     return file_handle >= 0 && file_handle < MAX_OPEN_FILES;
 }
 
+/**
+ * Create an uninitialized instance (to be set up with state_init, once it is
+ * the current instance).
+ *
+ * Returns the instance, or NULL if out of memory.
+ */
+tfs_t *state_new(void) {
+    tfs_t *instance = calloc(1, sizeof(tfs_t));
+    if (instance == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_init(&instance->open_file_allocation_table_mutex, NULL);
+    pthread_mutex_init(&instance->grow_mutex, NULL);
+    pthread_mutex_init(&instance->root_inode_mutex, NULL);
+    pthread_mutex_init(&instance->dedup_mutex, NULL);
+    pthread_mutex_init(&instance->extent_mutex, NULL);
+    pthread_mutex_init(&instance->volume_mutex, NULL);
+    pthread_mutex_init(&instance->compressor.mutex, NULL);
+    pthread_cond_init(&instance->compressor.cond, NULL);
+    pthread_mutex_init(&instance->flusher.mutex, NULL);
+    pthread_cond_init(&instance->flusher.cond, NULL);
+    instance->volume_fd = -1;
+    return instance;
+}
+
+/**
+ * Free an instance created with state_new (after state_destroy).
+ */
+void state_free(tfs_t *instance) {
+    pthread_mutex_destroy(&instance->open_file_allocation_table_mutex);
+    pthread_mutex_destroy(&instance->grow_mutex);
+    pthread_mutex_destroy(&instance->root_inode_mutex);
+    pthread_mutex_destroy(&instance->dedup_mutex);
+    pthread_mutex_destroy(&instance->extent_mutex);
+    pthread_mutex_destroy(&instance->volume_mutex);
+    pthread_mutex_destroy(&instance->compressor.mutex);
+    pthread_cond_destroy(&instance->compressor.cond);
+    pthread_mutex_destroy(&instance->flusher.mutex);
+    pthread_cond_destroy(&instance->flusher.cond);
+    free(instance);
+}
+
+/**
+ * Make `instance` the calling thread's current instance (NULL selects the
+ * default one).
+ *
+ * Returns the previous current instance, to be restored afterwards.
+ */
+tfs_t *state_switch(tfs_t *instance) {
+    tfs_t *previous = fs;
+    fs = instance != NULL ? instance : &default_fs;
+    return previous;
+}
+
+pthread_mutex_t *state_root_mutex(void) { return &fs->root_inode_mutex; }
+
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+bool state_verify_on_read(void) { return fs->params.verify_checksums; }
+
+tfs_durability_t state_durability(void) { return fs->params.durability; }
+
+bool state_volume_mounted(void) { return fs->volume_mounted; }
+
+size_t state_readahead_max(void) { return fs->params.readahead_max; }
+
+tfs_backing_t state_data_backing(void) {
+    tfs_backing_t weakest = fs->data_backing[0];
+    size_t segments = published_segments(&fs->block_segments);
+    for (size_t seg = 1; seg < segments; seg++) {
+        if (fs->data_backing[seg] < weakest) {
+            weakest = fs->data_backing[seg];
+        }
+    }
+    return weakest;
+}
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -78,396 +411,2322 @@ static void touch_all_memory(void) { __asm volatile("" : : : "memory"); }
  * latencies as if such data structures were really stored in secondary memory.
  */
 static void insert_delay(void) {
-    for (int i = 0; i < DELAY; i++) {
+    for (size_t i = 0; i < fs->params.access_delay; i++) {
         touch_all_memory();
     }
 }
 
 /**
- * Initialize FS state.
+ * Size of a region allocated with region_alloc (mappings are whole huge pages).
+ */
+static size_t region_size(size_t size, tfs_backing_t backing) {
+    if (backing == TFS_BACKING_MALLOC) {
+        return size;
+    }
+    if (backing == TFS_BACKING_FILE) {
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        return (size + page - 1) / page * page;
+    }
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+/**
+ * Allocate a memory region for the data region, backed by huge pages if
+ * requested in fs_params and available.
+ *
+ * Explicit huge pages (MAP_HUGETLB) need pages reserved by the administrator
+ * (vm.nr_hugepages). Without them, a huge page aligned anonymous mapping is
+ * marked with madvise(MADV_HUGEPAGE) so the kernel backs it with transparent
+ * huge pages when it can.
+ *
+ * Input:
+ *   - size: size of the region in bytes
+ *   - backing: set to the backing that was obtained
+ *
+ * Returns a pointer to the region, or NULL in case of error.
+ */
+static char *region_alloc(size_t size, tfs_backing_t *backing) {
+    if (fs->volume_fd != -1) {
+        return NULL; // file-backed segments are mapped with volume_map
+    }
+    if (!fs->params.huge_pages) {
+        *backing = TFS_BACKING_MALLOC;
+        return malloc(size);
+    }
+
+    size_t mapped = region_size(size, TFS_BACKING_PAGES);
+    void *region;
+#ifdef MAP_HUGETLB
+    region = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (region != MAP_FAILED) {
+        *backing = TFS_BACKING_HUGETLB;
+        return region;
+    }
+#endif
+
+    // Over-map by a huge page and trim, so the region is huge page aligned
+    size_t padded = mapped + HUGE_PAGE_SIZE;
+    char *raw = mmap(NULL, padded, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)raw % HUGE_PAGE_SIZE) %
+                  HUGE_PAGE_SIZE;
+    if (head > 0) {
+        munmap(raw, head);
+    }
+    munmap(raw + head + mapped, padded - head - mapped);
+    region = raw + head;
+
+    *backing = TFS_BACKING_PAGES;
+#ifdef MADV_HUGEPAGE
+    if (madvise(region, mapped, MADV_HUGEPAGE) == 0) {
+        *backing = TFS_BACKING_THP;
+    }
+#endif
+    return region;
+}
+
+/**
+ * Offset of segment `seg` of the data region in the volume file.
+ */
+static off_t volume_segment_offset(size_t seg) {
+    size_t stride = region_size(BLOCK_SEGMENT_LEN * BLOCK_SIZE,
+                                TFS_BACKING_FILE);
+    return (off_t)(fs->volume_meta_size + seg * stride);
+}
+
+/**
+ * Map segment `seg` of the data region from the volume file, growing the file
+ * to hold it (a mounted volume may already hold it).
+ *
+ * Returns a pointer to the segment, or NULL in case of error.
+ */
+static char *volume_map(size_t seg) {
+    size_t stride = region_size(BLOCK_SEGMENT_LEN * BLOCK_SIZE,
+                                TFS_BACKING_FILE);
+    off_t offset = volume_segment_offset(seg);
+    struct stat st;
+    if (fstat(fs->volume_fd, &st) != 0) {
+        return NULL;
+    }
+    if (st.st_size < offset + (off_t)stride &&
+        ftruncate(fs->volume_fd, offset + (off_t)stride) != 0) {
+        return NULL;
+    }
+
+    char *region = mmap(NULL, stride, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fs->volume_fd, offset);
+    return region == MAP_FAILED ? NULL : region;
+}
+
+/**
+ * Release a region allocated with region_alloc or volume_map.
+ */
+static void region_free(char *region, size_t size, tfs_backing_t backing) {
+    if (region == NULL) {
+        return;
+    }
+    if (backing == TFS_BACKING_MALLOC) {
+        free(region);
+    } else {
+        munmap(region, region_size(size, backing));
+    }
+}
+
+/**
+ * Allocate segment `seg` of the inode table, with every inode free.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int inode_segment_alloc(size_t seg) {
+    fs->inode_table[seg] = malloc(INODE_SEGMENT_LEN * sizeof(inode_t));
+    fs->freeinode_ts[seg] =
+        malloc(INODE_SEGMENT_LEN * sizeof(allocation_state_t));
+    if (!fs->inode_table[seg] || !fs->freeinode_ts[seg]) {
+        free(fs->inode_table[seg]);
+        free(fs->freeinode_ts[seg]);
+        fs->inode_table[seg] = NULL;
+        fs->freeinode_ts[seg] = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < INODE_SEGMENT_LEN; i++) {
+        fs->freeinode_ts[seg][i] = FREE;
+        fs->inode_table[seg][i].i_generation = 0;
+        fs->inode_table[seg][i].i_compress = false;
+        fs->inode_table[seg][i].i_extent = -1;
+        pthread_rwlock_init(&fs->inode_table[seg][i].i_data_lock, NULL);
+        atomic_init(&fs->inode_table[seg][i].i_seq, 0);
+    }
+    return 0;
+}
+
+/**
+ * Allocate segment `seg` of the data region, with every block free.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int block_segment_alloc(size_t seg) {
+    if (fs->volume_fd != -1) {
+        fs->data[seg] = volume_map(seg);
+        fs->data_backing[seg] = TFS_BACKING_FILE;
+    } else {
+        fs->data[seg] = region_alloc(BLOCK_SEGMENT_LEN * BLOCK_SIZE,
+                                    &fs->data_backing[seg]);
+    }
+    fs->dirty_bits[seg] =
+        calloc((BLOCK_SEGMENT_LEN + 63) / 64, sizeof(uint64_t));
+    fs->free_blocks[seg] =
+        malloc(BLOCK_SEGMENT_LEN * sizeof(allocation_state_t));
+    fs->block_crcs[seg] = malloc(BLOCK_SEGMENT_LEN * sizeof(uint64_t));
+    fs->block_refs[seg] = malloc(BLOCK_SEGMENT_LEN * sizeof(unsigned int));
+    fs->block_dedup_next[seg] = malloc(BLOCK_SEGMENT_LEN * sizeof(int));
+    fs->alloc_groups[seg] =
+        malloc(fs->groups_per_segment * sizeof(alloc_group_t));
+    if (!fs->data[seg] || !fs->free_blocks[seg] || !fs->block_crcs[seg] ||
+        !fs->block_refs[seg] || !fs->block_dedup_next[seg] ||
+        !fs->alloc_groups[seg] || !fs->dirty_bits[seg]) {
+        region_free(fs->data[seg], BLOCK_SEGMENT_LEN * BLOCK_SIZE,
+                    fs->data_backing[seg]);
+        free(fs->free_blocks[seg]);
+        free((void *)fs->block_crcs[seg]);
+        free(fs->block_refs[seg]);
+        free(fs->block_dedup_next[seg]);
+        free(fs->alloc_groups[seg]);
+        free((void *)fs->dirty_bits[seg]);
+        fs->data[seg] = NULL;
+        fs->free_blocks[seg] = NULL;
+        fs->block_crcs[seg] = NULL;
+        fs->block_refs[seg] = NULL;
+        fs->block_dedup_next[seg] = NULL;
+        fs->alloc_groups[seg] = NULL;
+        fs->dirty_bits[seg] = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < BLOCK_SEGMENT_LEN; i++) {
+        fs->free_blocks[seg][i] = FREE;
+        fs->block_refs[seg][i] = 0;
+        fs->block_dedup_next[seg][i] = DEDUP_UNINDEXED;
+    }
+    for (size_t g = 0; g < fs->groups_per_segment; g++) {
+        pthread_mutex_init(&fs->alloc_groups[seg][g].lock, NULL);
+        fs->alloc_groups[seg][g].free_count =
+            group_first(g + 1) - group_first(g);
+        fs->alloc_groups[seg][g].hint = group_first(g);
+    }
+    return 0;
+}
+
+/**
+ * Allocate segment `seg` of the open file table, with every entry free.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int open_file_segment_alloc(size_t seg) {
+    fs->open_file_table[seg] =
+        malloc(OPEN_FILE_SEGMENT_LEN * sizeof(open_file_entry_t));
+    fs->free_open_file_entries[seg] =
+        malloc(OPEN_FILE_SEGMENT_LEN * sizeof(allocation_state_t));
+    if (!fs->open_file_table[seg] || !fs->free_open_file_entries[seg]) {
+        free(fs->open_file_table[seg]);
+        free(fs->free_open_file_entries[seg]);
+        fs->open_file_table[seg] = NULL;
+        fs->free_open_file_entries[seg] = NULL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < OPEN_FILE_SEGMENT_LEN; i++) {
+        fs->free_open_file_entries[seg][i] = FREE;
+        pthread_mutex_init(&fs->open_file_table[seg][i].lock, NULL);
+    }
+    return 0;
+}
+
+/**
+ * Grow a table by one segment.
+ *
+ * The new segment is fully initialized before the segment count is published,
+ * so concurrent readers either see the old size or a usable new segment; they
+ * never wait for the grower.
+ *
+ * Input:
+ *   - segments: published segment count of the table
+ *   - seen: segment count the caller found exhausted
+ *   - segment_alloc: allocator for a segment of this table
+ *
+ * Returns 0 if the table has more than `seen` segments (grown by this call or
+ * by a concurrent one), -1 otherwise.
+ *
+ * Possible errors:
+ *   - Table already at fs_params.max_table_segments.
+ *   - malloc failure when allocating the segment.
+ */
+static int table_grow(_Atomic size_t *segments, size_t seen,
+                      int (*segment_alloc)(size_t)) {
+    int ret = 0;
+
+    pthread_mutex_lock(&fs->grow_mutex);
+    size_t current = atomic_load_explicit(segments, memory_order_relaxed);
+    if (current == seen) {
+        if (current >= fs->params.max_table_segments ||
+            segment_alloc(current) != 0) {
+            ret = -1;
+        } else {
+            atomic_store_explicit(segments, current + 1, memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&fs->grow_mutex);
+
+    return ret;
+}
+
+/**
+ * Read or write `len` bytes at `offset` of the volume file, whole.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int volume_read(void *buffer, size_t len, off_t offset) {
+    char *bytes = buffer;
+    while (len > 0) {
+        ssize_t done = pread(fs->volume_fd, bytes, len, offset);
+        if (done <= 0) {
+            return -1; // error, or the file ends early
+        }
+        bytes += done;
+        len -= (size_t)done;
+        offset += done;
+    }
+    return 0;
+}
+
+static int volume_write(void const *buffer, size_t len, off_t offset) {
+    char const *bytes = buffer;
+    while (len > 0) {
+        ssize_t done = pwrite(fs->volume_fd, bytes, len, offset);
+        if (done <= 0) {
+            return -1;
+        }
+        bytes += done;
+        len -= (size_t)done;
+        offset += done;
+    }
+    return 0;
+}
+
+static inline off_t volume_inode_offset(size_t inumber) {
+    return (off_t)(sizeof(volume_super_t) + inumber * sizeof(volume_inode_t));
+}
+
+/**
+ * Fill in the superblock describing the current tables.
+ */
+static void volume_super_fill(volume_super_t *super) {
+    *super = (volume_super_t){
+        .magic = VOLUME_MAGIC,
+        .block_size = BLOCK_SIZE,
+        .inode_segment_len = INODE_SEGMENT_LEN,
+        .block_segment_len = BLOCK_SEGMENT_LEN,
+        .max_table_segments = fs->params.max_table_segments,
+        .inode_segments = published_segments(&fs->inode_segments),
+        .block_segments = published_segments(&fs->block_segments),
+    };
+}
+
+/**
+ * Fill in the volume record of an inode.
+ *
+ * The caller must hold the root mutex (which inodes are taken, and the root
+ * directory, only change under it).
+ */
+static void volume_inode_fill(size_t inumber, volume_inode_t *record) {
+    memset(record, 0, sizeof(*record));
+    if (*freeinode_at(inumber) == FREE) {
+        return;
+    }
+
+    inode_t *inode = inode_at(inumber);
+    pthread_rwlock_rdlock(&inode->i_data_lock);
+    record->taken = 1;
+    record->type = (int32_t)inode->i_node_type;
+    record->data_block = inode->i_data_block;
+    record->size = (uint32_t)atomic_load(&inode->i_size);
+    memcpy(record->target, inode->i_target, MAX_FILE_NAME);
+    pthread_rwlock_unlock(&inode->i_data_lock);
+}
+
+/**
+ * Take a block found in use when mounting: a block named by several files
+ * was shared by dedup (it is left out of the dedup index). The checksum covers
+ * the first `covered` bytes.
+ */
+static void volume_block_take(size_t block_number, size_t covered) {
+    if (*free_block_at(block_number) == TAKEN) {
+        (*block_ref_at(block_number))++;
+        return;
+    }
+
+    *free_block_at(block_number) = TAKEN;
+    *block_ref_at(block_number) = 1;
+    group_of(block_number)->free_count--;
+    uint32_t crc = crc32c(0, block_at(block_number), covered);
+    atomic_store(block_crc_at(block_number), (uint64_t)covered << 32 | crc);
+}
+
+/**
+ * Check an inode record read from the volume file.
+ */
+static bool volume_inode_valid(volume_inode_t const *record,
+                               size_t data_blocks) {
+    if (record->data_block < -1 ||
+        (record->data_block != -1 &&
+         (size_t)record->data_block >= data_blocks)) {
+        return false;
+    }
+    switch (record->type) {
+    case T_DIRECTORY:
+        return record->data_block != -1;
+    case T_FILE:
+        return record->size <= BLOCK_SIZE &&
+               (record->data_block != -1 || record->size == 0);
+    case T_SOFT_LINK:
+        return record->data_block == -1 &&
+               memchr(record->target, '\0', MAX_FILE_NAME) != NULL;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Mount the file system held by the volume file: load the inode records and
+ * rebuild the rest from them and from the root directory. Link counts are
+ * recounted from the directory entries: inodes no entry names (a file synced
+ * with tfs_fsync before its name reached the volume) are freed, and entries
+ * naming free inodes are cleared.
+ *
+ * Returns 1 if mounted, 0 if the volume holds no file system yet (it is then
+ * formatted), -1 otherwise.
+ *
+ * Possible errors:
+ *   - Volume file of another kind, or made with another geometry.
+ *   - Inconsistent metadata.
+ *   - malloc failure when allocating TFS structures.
+ */
+static int volume_mount(void) {
+    volume_super_t super, zero = {0};
+    ssize_t got = pread(fs->volume_fd, &super, sizeof(super), 0);
+    if (got == -1) {
+        return -1;
+    }
+    if ((size_t)got < sizeof(super)) {
+        memset((char *)&super + got, 0, sizeof(super) - (size_t)got);
+    }
+    if (memcmp(&super, &zero, sizeof(super)) == 0) {
+        return 0; // never written back
+    }
+    if (super.magic != VOLUME_MAGIC || super.block_size != BLOCK_SIZE ||
+        super.inode_segment_len != INODE_SEGMENT_LEN ||
+        super.block_segment_len != BLOCK_SEGMENT_LEN ||
+        super.max_table_segments != fs->params.max_table_segments ||
+        super.inode_segments == 0 ||
+        super.inode_segments > fs->params.max_table_segments ||
+        super.block_segments == 0 ||
+        super.block_segments > fs->params.max_table_segments) {
+        return -1;
+    }
+
+    size_t inode_count = super.inode_segments * INODE_SEGMENT_LEN;
+    size_t data_blocks = super.block_segments * BLOCK_SEGMENT_LEN;
+    volume_inode_t *records = malloc(inode_count * sizeof(volume_inode_t));
+    if (records == NULL || volume_read(records,
+                                       inode_count * sizeof(volume_inode_t),
+                                       volume_inode_offset(0)) != 0) {
+        free(records);
+        return -1;
+    }
+    int ret = -1;
+    if (!records[ROOT_DIR_INUM].taken) {
+        ret = 0; // synced before tfs_init created the root directory
+        goto done;
+    }
+    if (records[ROOT_DIR_INUM].type != T_DIRECTORY) {
+        goto done;
+    }
+
+    for (size_t seg = 0; seg < super.inode_segments; seg++) {
+        if (inode_segment_alloc(seg) != 0) {
+            goto done;
+        }
+        atomic_store(&fs->inode_segments, seg + 1);
+    }
+    for (size_t seg = 0; seg < super.block_segments; seg++) {
+        if (block_segment_alloc(seg) != 0) {
+            goto done;
+        }
+        atomic_store(&fs->block_segments, seg + 1);
+    }
+
+    for (size_t i = 0; i < inode_count; i++) {
+        volume_inode_t *record = &records[i];
+        if (!record->taken) {
+            continue;
+        }
+        if (!volume_inode_valid(record, data_blocks)) {
+            goto done;
+        }
+
+        inode_t *inode = inode_at(i);
+        *freeinode_at(i) = TAKEN;
+        inode->i_node_type = (inode_type)record->type;
+        inode->hard_links_count = 0; // recounted below
+        inode->i_size = record->size;
+        inode->i_reserved = record->size;
+        inode->i_data_block = record->data_block;
+        memcpy(inode->i_target, record->target, MAX_FILE_NAME);
+        inode->i_target_inumber = -1;
+        inode->i_cold_passes = 0;
+    }
+
+    // The root directory chain, and the entries naming the other inodes
+    inode_t *root = inode_at(ROOT_DIR_INUM);
+    size_t chain = 0;
+    for (int b = root->i_data_block; b != -1;) {
+        if (b < 0 || (size_t)b >= data_blocks ||
+            *free_block_at((size_t)b) == TAKEN) {
+            goto done; // out of range, or a cycle
+        }
+        dir_entry_t *dir_entry = (dir_entry_t *)block_at((size_t)b);
+        bool cleared = false;
+        for (size_t e = 0; e < MAX_DIR_ENTRIES; e++) {
+            int sub = dir_entry[e].d_inumber;
+            if (sub == -1) {
+                continue;
+            }
+            if (sub <= ROOT_DIR_INUM || (size_t)sub >= inode_count ||
+                !records[sub].taken || records[sub].type == T_DIRECTORY) {
+                dir_entry[e].d_inumber = -1;
+                cleared = true;
+                continue;
+            }
+            inode_at((size_t)sub)->hard_links_count++;
+        }
+        volume_block_take((size_t)b, BLOCK_SIZE);
+        if (cleared) {
+            data_block_modified(b);
+        }
+        chain++;
+        b = dir_block_next(dir_entry);
+    }
+    root->hard_links_count = 1;
+    root->i_size = chain * BLOCK_SIZE;
+    root->i_reserved = chain * BLOCK_SIZE;
+
+    for (size_t i = 0; i < inode_count; i++) {
+        inode_t *inode = inode_at(i);
+        if (i == ROOT_DIR_INUM || *freeinode_at(i) == FREE) {
+            continue;
+        }
+        if (inode->hard_links_count == 0 ||
+            inode->i_node_type == T_DIRECTORY) {
+            *freeinode_at(i) = FREE; // no name leads to it
+            continue;
+        }
+        if (inode->i_data_block != -1) {
+            volume_block_take((size_t)inode->i_data_block, inode->i_size);
+        }
+    }
+    ret = 1;
+
+done:
+    free(records);
+    return ret;
+}
+
+/**
+ * Initialize FS state.
+ *
+ * Input:
+ *   - params: TécnicoFS parameters
+ *
+ * With a volume file, the file system it holds is mounted (see volume_mount);
+ * otherwise the tables start empty.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - TFS already initialized.
+ *   - Volume file that cannot be opened or mounted.
+ *   - malloc failure when allocating TFS structures.
+ */
+int state_init(tfs_params params) {
+    if (fs->inode_table[0] != NULL) {
+        return -1; // already initialized
+    }
+
+    fs->params = params;
+    fs->groups_per_segment = fs->params.alloc_groups;
+    if (fs->groups_per_segment == 0) {
+        fs->groups_per_segment = 1;
+    } else if (fs->groups_per_segment > fs->params.max_block_count) {
+        fs->groups_per_segment = fs->params.max_block_count;
+    }
+
+    if (fs->params.max_table_segments == 0) {
+        fs->params.max_table_segments = 1;
+    } else if (fs->params.max_table_segments > MAX_TABLE_SEGMENTS) {
+        fs->params.max_table_segments = MAX_TABLE_SEGMENTS;
+    }
+
+    // From here on, any failure unwinds through state_destroy, which copes
+    // with whatever has been set up so far
+    pthread_mutex_init(&fs->open_file_allocation_table_mutex, NULL);
+
+    int mounted = 0;
+    if (fs->params.volume_path != NULL) {
+        fs->volume_fd = open(fs->params.volume_path, O_RDWR | O_CREAT, 0644);
+        if (fs->volume_fd == -1) {
+            goto fail;
+        }
+        fs->volume_meta_size =
+            region_size(sizeof(volume_super_t) +
+                            fs->params.max_table_segments *
+                                INODE_SEGMENT_LEN * sizeof(volume_inode_t),
+                        TFS_BACKING_FILE);
+
+        mounted = volume_mount();
+        if (mounted == -1) {
+            goto fail;
+        }
+    }
+
+    if (!mounted) {
+        if (inode_segment_alloc(0) != 0 || block_segment_alloc(0) != 0) {
+            goto fail; // allocation failed
+        }
+        atomic_store(&fs->inode_segments, 1);
+        atomic_store(&fs->block_segments, 1);
+    }
+    if (open_file_segment_alloc(0) != 0) {
+        goto fail; // allocation failed
+    }
+    atomic_store(&fs->open_file_segments, 1);
+
+    if (fs->params.dedup) {
+        fs->dedup_bucket_count = 1;
+        while (fs->dedup_bucket_count < BLOCK_SEGMENT_LEN) {
+            fs->dedup_bucket_count <<= 1;
+        }
+        fs->dedup_buckets = malloc(fs->dedup_bucket_count * sizeof(int));
+        if (!fs->dedup_buckets) {
+            goto fail; // allocation failed
+        }
+        for (size_t i = 0; i < fs->dedup_bucket_count; i++) {
+            fs->dedup_buckets[i] = -1;
+        }
+    }
+
+    fs->volume_mounted = mounted == 1;
+    fs->volume_ready = fs->volume_fd != -1;
+    if (fs->volume_fd != -1 &&
+        fs->params.durability == TFS_DURABILITY_PERIODIC &&
+        fs->params.flush_interval_ms > 0 &&
+        periodic_task_start(&fs->flusher, fs->params.flush_interval_ms,
+                            flush_pass) != 0) {
+        goto fail;
+    }
+    return 0;
+
+fail:
+    state_destroy();
+    return -1;
+}
+
+/**
+ * Destroy FS state.
+ *
+ * A file-backed volume is written back whole first (whatever the durability
+ * mode), so the next state_init mounts it as it was left.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+    periodic_task_stop(&fs->compressor);
+    periodic_task_stop(&fs->flusher);
+
+    int ret = 0;
+    if (fs->volume_ready && state_syncfs() != 0) {
+        ret = -1;
+    }
+    fs->volume_ready = false;
+    fs->volume_mounted = false;
+
+    free(fs->dedup_buckets);
+    fs->dedup_buckets = NULL;
+    fs->dedup_bucket_count = 0;
+
+    atomic_store(&fs->compression_ready, false);
+    free(fs->extent_area);
+    free(fs->extent_map);
+    fs->extent_area = NULL;
+    fs->extent_map = NULL;
+    fs->extent_granules = 0;
+    fs->compressed_blocks = 0;
+    fs->compressed_granules = 0;
+
+    for (size_t seg = 0; seg < MAX_TABLE_SEGMENTS; seg++) {
+        if (fs->inode_table[seg] != NULL) {
+            for (size_t i = 0; i < INODE_SEGMENT_LEN; i++) {
+                pthread_rwlock_destroy(&fs->inode_table[seg][i].i_data_lock);
+            }
+        }
+        if (fs->alloc_groups[seg] != NULL) {
+            for (size_t g = 0; g < fs->groups_per_segment; g++) {
+                pthread_mutex_destroy(&fs->alloc_groups[seg][g].lock);
+            }
+        }
+        if (fs->open_file_table[seg] != NULL) {
+            for (size_t i = 0; i < OPEN_FILE_SEGMENT_LEN; i++) {
+                pthread_mutex_destroy(&fs->open_file_table[seg][i].lock);
+            }
+        }
+        free(fs->inode_table[seg]);
+        free(fs->freeinode_ts[seg]);
+        region_free(fs->data[seg], BLOCK_SEGMENT_LEN * BLOCK_SIZE,
+                    fs->data_backing[seg]);
+        free(fs->free_blocks[seg]);
+        free((void *)fs->block_crcs[seg]);
+        free(fs->block_refs[seg]);
+        free(fs->block_dedup_next[seg]);
+        free(fs->alloc_groups[seg]);
+        free((void *)fs->dirty_bits[seg]);
+        free(fs->open_file_table[seg]);
+        free(fs->free_open_file_entries[seg]);
+
+        fs->inode_table[seg] = NULL;
+        fs->freeinode_ts[seg] = NULL;
+        fs->data[seg] = NULL;
+        fs->free_blocks[seg] = NULL;
+        fs->block_crcs[seg] = NULL;
+        fs->block_refs[seg] = NULL;
+        fs->block_dedup_next[seg] = NULL;
+        fs->alloc_groups[seg] = NULL;
+        fs->dirty_bits[seg] = NULL;
+        fs->open_file_table[seg] = NULL;
+        fs->free_open_file_entries[seg] = NULL;
+    }
+    pthread_mutex_destroy(&fs->open_file_allocation_table_mutex);
+
+    atomic_store(&fs->inode_segments, 0);
+    atomic_store(&fs->block_segments, 0);
+    atomic_store(&fs->open_file_segments, 0);
+
+    if (fs->volume_fd != -1) {
+        close(fs->volume_fd);
+        fs->volume_fd = -1;
+    }
+    atomic_store(&fs->flushed_blocks, 0);
+    atomic_store(&fs->readahead_bytes, 0);
+
+    return ret;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(void) {
+    size_t inumber = 0;
+    for (;;) {
+        size_t segments = published_segments(&fs->inode_segments);
+        for (; inumber < INODE_SEGMENT_LEN * segments; inumber++) {
+            if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
+                insert_delay(); // simulate storage access delay (to freeinode_ts)
+            }
+
+            // Finds first free entry in inode table
+            if (*freeinode_at(inumber) == FREE) {
+                //  Found a free entry, so takes it for the new inode
+                *freeinode_at(inumber) = TAKEN;
+
+                return (int)inumber;
+            }
+        }
+
+        // no free inodes: grow the table (if allowed) and keep scanning
+        if (table_grow(&fs->inode_segments, segments, inode_segment_alloc) !=
+            0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Obtain the number of the block following a directory block in its chain.
+ *
+ * Directory chains are only walked and changed with the root mutex held.
+ *
+ * Input:
+ *   - dir_entry: entries of the directory block
+ *
+ * Returns the next block number, or -1 if this is the last block.
+ */
+static int dir_block_next(dir_entry_t const *dir_entry) {
+    int next;
+    memcpy(&next, (char const *)dir_entry + BLOCK_SIZE - sizeof(int),
+           sizeof(int));
+    return next;
+}
+
+/**
+ * Link a block after a directory block, making it visible to lookups.
+ *
+ * Input:
+ *   - block_number: the (last) directory block
+ *   - next: the block to link after it (already initialized)
+ */
+static void dir_block_link(int block_number, int next) {
+    char *block = data_block_get(block_number);
+    ALWAYS_ASSERT(block != NULL, "dir_block_link: invalid block");
+
+    memcpy(block + BLOCK_SIZE - sizeof(int), &next, sizeof(int));
+    data_block_modified(block_number);
+}
+
+/**
+ * Fill a directory block with empty entries (labeled with inumber==-1), ending
+ * the chain there.
+ *
+ * Input:
+ *   - block_number: the block to initialize
+ */
+static void dir_block_init(int block_number) {
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+    ALWAYS_ASSERT(dir_entry != NULL, "dir_block_init: invalid block");
+
+    memset(dir_entry, 0, BLOCK_SIZE);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    int next = -1;
+    memcpy((char *)dir_entry + BLOCK_SIZE - sizeof(int), &next, sizeof(int));
+    data_block_modified(block_number);
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode.
+ * Directories will have their data block allocated and initialized, with i_size
+ * set to BLOCK_SIZE. Regular files will not have their data block allocated
+ * (i_size will be set to 0, i_data_block to -1).
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ */
+int inode_create(inode_type i_type) {
+    int inumber = inode_alloc();
+    if (inumber == -1) {
+        return -1; // no free slots in inode table
+    }
+
+    inode_t *inode = inode_at((size_t)inumber);
+    insert_delay(); // simulate storage access delay (to inode)
+
+    inode->i_node_type = i_type;
+    inode->i_generation++; // invalidates soft links cached to a previous inode
+    inode->i_target_inumber = -1;
+    inode->i_compress = false;
+    inode->i_extent = -1;
+    inode->i_cold_passes = 0;
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (with a single block of empty entries, labeled
+        // with inumber==-1); more blocks are chained as it fills up
+        int b = data_block_alloc();
+        if (b == -1) {
+            // ensure fields are initialized
+            inode->i_size = 0;
+            inode->i_reserved = 0;
+            inode->i_data_block = -1;
+
+            // run regular deletion process
+            inode_delete(inumber);
+            return -1;
+        }
+
+        inode->i_size = BLOCK_SIZE;
+        inode->i_reserved = BLOCK_SIZE;
+        inode->i_data_block = b;
+        inode->hard_links_count = 1;
+        dir_block_init(b);
+    } break;
+    case T_FILE: {
+        // In case of a new file, simply sets its size to 0
+        inode->i_size = 0;
+        inode->i_reserved = 0;
+        inode->i_data_block = -1;
+        inode->hard_links_count = 1;
+        break;
+    }
+    case T_SOFT_LINK: {
+        // In case of a new file, simply sets its size to 0
+        inode->i_size = 0;
+        inode->i_reserved = 0;
+        inode->i_data_block = -1;
+        inode->hard_links_count = 1;
+        } break; 
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+
+    return inumber;
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+    // simulate storage access delay (to inode and freeinode_ts)
+    insert_delay();
+    insert_delay();
+
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+    ALWAYS_ASSERT(*freeinode_at((size_t)inumber) == TAKEN,
+                  "inode_delete: inode already freed");
+
+    inode_t *inode = inode_at((size_t)inumber);
+    inode_write_lock(inode);
+    inode_release_data(inode);
+    inode->i_compress = false; // keeps the compressor away until reused
+    inode_write_unlock(inode);
+
+    *freeinode_at((size_t)inumber) = FREE;
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+    insert_delay(); // simulate storage access delay to inode
+    return inode_at((size_t)inumber);
+}
+
+/**
+ * Take an inode's data lock for writing and start a write section: the
+ * sequence counter turns odd, so optimistic readers wait or retry.
+ *
+ * Input:
+ *   - inode: the inode to modify
+ */
+void inode_write_lock(inode_t *inode) {
+    pthread_rwlock_wrlock(&inode->i_data_lock);
+    atomic_fetch_add_explicit(&inode->i_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // before the modifications
+}
+
+/**
+ * Like inode_write_lock, but fail instead of waiting for the lock.
+ *
+ * Returns true if the lock was taken.
+ */
+bool inode_try_write_lock(inode_t *inode) {
+    if (pthread_rwlock_trywrlock(&inode->i_data_lock) != 0) {
+        return false;
+    }
+    atomic_fetch_add_explicit(&inode->i_seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return true;
+}
+
+/**
+ * End a write section started with inode_write_lock and release the lock.
+ */
+void inode_write_unlock(inode_t *inode) {
+    atomic_fetch_add_explicit(&inode->i_seq, 1, memory_order_release);
+    pthread_rwlock_unlock(&inode->i_data_lock);
+}
+
+/**
+ * Start an optimistic read of an inode (and its data block): waits out a
+ * write section in progress, without taking any lock.
+ *
+ * Returns the sequence number to pass to inode_read_retry.
+ */
+unsigned int inode_read_begin(inode_t const *inode) {
+    for (;;) {
+        unsigned int seq =
+            atomic_load_explicit(&inode->i_seq, memory_order_acquire);
+        if (seq % 2 == 0) {
+            return seq;
+        }
+        sched_yield();
+    }
+}
+
+/**
+ * Check whether an optimistic read raced with a writer, in which case what it
+ * read may be inconsistent and it has to be redone.
+ *
+ * Input:
+ *   - inode: the inode read
+ *   - seq: as returned by inode_read_begin
+ */
+bool inode_read_retry(inode_t const *inode, unsigned int seq) {
+    atomic_thread_fence(memory_order_acquire); // after the reads
+    return atomic_load_explicit(&inode->i_seq, memory_order_relaxed) != seq;
+}
+
+/**
+ * Check whether an inode still is the one a cached (inumber, generation) pair
+ * refers to.
+ *
+ * Input:
+ *   - inumber: cached inode's number
+ *   - generation: cached inode's generation
+ *
+ * Returns true if the inode is allocated and has the same generation.
+ */
+bool inode_generation_matches(int inumber, unsigned int generation) {
+    if (!valid_inumber(inumber) ||
+        *freeinode_at((size_t)inumber) != TAKEN) {
+        return false;
+    }
+
+    return inode_at((size_t)inumber)->i_generation == generation;
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    insert_delay();
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Walks the blocks containing the entries of the directory
+    for (int b = inode->i_data_block; b != -1;) {
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "clear_dir_entry: directory must have a data block");
+
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (!strcmp(dir_entry[i].d_name, sub_name)) { // Compare names to find equal
+                if (valid_inumber(dir_entry[i].d_inumber)) {
+                    // The inode lost a name: soft links cached to it must re-resolve
+                    inode_at((size_t)dir_entry[i].d_inumber)->i_generation++;
+                }
+                dir_entry[i].d_inumber = -1; // -1 to indicate is not associated with any inode
+                memset(dir_entry[i].d_name, 0, MAX_FILE_NAME); // Name field is set to 0
+                data_block_modified(b);
+                return 0;
+            }
+        }
+        b = dir_block_next(dir_entry);
+    }
+    return -1; // sub_name not found
+}
+
+/**
+ * Store the inumber for a sub file in a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - Every block of the directory is full, and no block is left to chain.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+
+    insert_delay(); // simulate storage access delay to inode with inumber
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Finds the first empty entry, walking the blocks of the directory
+    int b = inode->i_data_block;
+    dir_entry_t *dir_entry = NULL;
+    size_t i = MAX_DIR_ENTRIES;
+    for (;;) {
+        dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "add_dir_entry: directory must have a data block");
+
+        for (i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (dir_entry[i].d_inumber == -1) { // Empty entry
+                break;
+            }
+        }
+        int next = dir_block_next(dir_entry);
+        if (i < MAX_DIR_ENTRIES || next == -1) {
+            break;
+        }
+        b = next;
+    }
+
+    if (i == MAX_DIR_ENTRIES) {
+        // Every block is full: chain a new one after the last
+        int last = b;
+        b = data_block_alloc();
+        if (b == -1) {
+            return -1; // no space for entry
+        }
+        dir_block_init(b);
+        dir_block_link(last, b);
+        inode->i_size += BLOCK_SIZE;
+        inode->i_reserved += BLOCK_SIZE;
+
+        dir_entry = (dir_entry_t *)data_block_get(b);
+        i = 0;
+    }
+
+    // Fills the entry (the name first, so that lookups never match a
+    // half-written one)
+    strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    dir_entry[i].d_inumber = sub_inumber;
+    data_block_modified(b);
+
+    return 0;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(inode_t const *inode, char const *sub_name) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    insert_delay(); // simulate storage access delay to inode with inumber
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Iterates over the entries of each block of the directory looking for one
+    // that has the target name
+    for (int b = inode->i_data_block; b != -1;) {
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "find_in_dir: directory inode must have a data block");
+
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++)
+            if ((dir_entry[i].d_inumber != -1) && 
+                (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+
+                int sub_inumber = dir_entry[i].d_inumber;
+                return sub_inumber;
+            }
+        b = dir_block_next(dir_entry);
+    }
+
+    return -1; // entry not found
+}
+
+/**
+ * Read a batch of entries from a directory, starting at a cursor.
+ *
+ * The batch is served with one access per directory block it spans; the type
+ * and size of each entry are taken directly from the inode table. The caller
+ * must hold the root mutex.
+ *
+ * Input:
+ *   - inode: directory inode
+ *   - cursor: index of the next directory slot to examine, counting the slots
+ *     of every block before it in the chain (updated)
+ *   - entries: destination array
+ *   - max_entries: capacity of the destination array
+ *
+ * Returns the number of entries copied to `entries` (0 if the directory has no
+ * more entries, or if inode is not a directory inode).
+ */
+size_t read_dir_entries(inode_t const *inode, size_t *cursor,
+                        tfs_dirent_t *entries, size_t max_entries) {
+    ALWAYS_ASSERT(inode != NULL, "read_dir_entries: inode must be non-NULL");
+    ALWAYS_ASSERT(cursor != NULL, "read_dir_entries: cursor must be non-NULL");
+
+    insert_delay(); // simulate storage access delay to inode
+    if (inode->i_node_type != T_DIRECTORY) {
+        return 0; // not a directory
+    }
+
+    // Skips the blocks before the cursor
+    int b = inode->i_data_block;
+    dir_entry_t *dir_entry = NULL;
+    size_t skipped = 0;
+    for (;;) {
+        dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "read_dir_entries: directory inode must have a data block");
+        if (*cursor - skipped < MAX_DIR_ENTRIES) {
+            break;
+        }
+        b = dir_block_next(dir_entry);
+        if (b == -1) {
+            return 0; // past the last block
+        }
+        skipped += MAX_DIR_ENTRIES;
+    }
+
+    size_t count = 0;
+    size_t i = *cursor - skipped;
+    for (; count < max_entries; i++) {
+        if (i == MAX_DIR_ENTRIES) {
+            b = dir_block_next(dir_entry);
+            if (b == -1) {
+                break; // last block
+            }
+            dir_entry = (dir_entry_t *)data_block_get(b);
+            ALWAYS_ASSERT(dir_entry != NULL,
+                          "read_dir_entries: invalid directory block");
+            skipped += MAX_DIR_ENTRIES;
+            i = 0;
+        }
+
+        int sub_inumber = dir_entry[i].d_inumber;
+        if (sub_inumber == -1 || !valid_inumber(sub_inumber)) {
+            continue; // empty slot
+        }
+
+        inode_t const *sub_inode = inode_at((size_t)sub_inumber);
+        tfs_dirent_t *entry = &entries[count++];
+
+        memcpy(entry->d_name, dir_entry[i].d_name, MAX_FILE_NAME);
+        entry->d_name[MAX_FILE_NAME - 1] = '\0';
+        entry->d_inumber = sub_inumber;
+        entry->d_size = sub_inode->i_size;
+        switch (sub_inode->i_node_type) {
+        case T_DIRECTORY:
+            entry->d_type = TFS_DT_DIRECTORY;
+            break;
+        case T_SOFT_LINK:
+            entry->d_type = TFS_DT_SOFT_LINK;
+            break;
+        case T_FILE:
+        default:
+            entry->d_type = TFS_DT_FILE;
+            break;
+        }
+    }
+    *cursor = skipped + i;
+
+    return count;
+}
+
+/**
+ * Allocate a block from one allocation group.
+ *
+ * Input:
+ *   - seg: data region segment
+ *   - g: group within the segment
+ *
+ * Returns block number/index if successful, -1 if the group is full.
+ */
+static int group_alloc(size_t seg, size_t g) {
+    alloc_group_t *group = &fs->alloc_groups[seg][g];
+    if (atomic_load_explicit(&group->free_count, memory_order_relaxed) == 0) {
+        return -1; // full: skip it without taking its lock
+    }
+
+    pthread_mutex_lock(&group->lock);
+    size_t first = group_first(g);
+    size_t len = group_first(g + 1) - first;
+    for (size_t k = 0; k < len; k++) {
+        if (k * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay to free_blocks
+        }
+
+        size_t b = first + (group->hint - first + k) % len;
+        size_t block_number = seg * BLOCK_SEGMENT_LEN + b;
+        if (*free_block_at(block_number) == FREE) {
+            *free_block_at(block_number) = TAKEN;
+            *block_ref_at(block_number) = 1;
+            group->free_count--;
+            group->hint = b + 1 < first + len ? b + 1 : first;
+
+            pthread_mutex_unlock(&group->lock);
+            return (int)block_number;
+        }
+    }
+    pthread_mutex_unlock(&group->lock);
+    return -1;
+}
+
+/**
+ * Allocate a new data block.
+ *
+ * Looks in the calling thread's home group of each segment first, then steals
+ * from the other groups, and grows the data region (if allowed) when every
+ * group is full.
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc(void) {
+    if (alloc_home == SIZE_MAX) {
+        alloc_home = atomic_fetch_add(&next_alloc_home, 1);
+    }
+    size_t home = alloc_home % fs->groups_per_segment;
+
+    for (;;) {
+        size_t segments = published_segments(&fs->block_segments);
+        for (size_t k = 0; k < fs->groups_per_segment; k++) {
+            size_t g = (home + k) % fs->groups_per_segment;
+            for (size_t seg = 0; seg < segments; seg++) {
+                int block_number = group_alloc(seg, g);
+                if (block_number != -1) {
+                    // nothing written yet: the checksum covers no bytes
+                    atomic_store(block_crc_at((size_t)block_number), 0);
+                    return block_number;
+                }
+            }
+        }
+
+        // no free blocks: grow the data region (if allowed) and keep looking
+        if (table_grow(&fs->block_segments, segments, block_segment_alloc) !=
+            0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * Remove a block from the dedup index (if it is there).
+ *
+ * The caller must hold dedup_mutex.
+ */
+static void dedup_unindex(size_t block_number) {
+    if (*block_dedup_next_at(block_number) == DEDUP_UNINDEXED) {
+        return;
+    }
+
+    int *link = &fs->dedup_buckets[block_crc(block_number) &
+                               (fs->dedup_bucket_count - 1)];
+    while (*link != (int)block_number) {
+        ALWAYS_ASSERT(*link != -1, "dedup_unindex: indexed block not found");
+        link = block_dedup_next_at((size_t)*link);
+    }
+    *link = *block_dedup_next_at(block_number);
+    *block_dedup_next_at(block_number) = DEDUP_UNINDEXED;
+}
+
+/**
+ * Free a data block (drop one reference to it; it is only freed once no file
+ * uses it).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_free(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_free: invalid block number");
+
+    unsigned int *refs = block_ref_at((size_t)block_number);
+    if (fs->params.dedup) {
+        pthread_mutex_lock(&fs->dedup_mutex);
+        ALWAYS_ASSERT(*refs > 0, "data_block_free: block already freed");
+        if (--*refs > 0) {
+            pthread_mutex_unlock(&fs->dedup_mutex);
+            return; // still shared with other files
+        }
+        dedup_unindex((size_t)block_number);
+        pthread_mutex_unlock(&fs->dedup_mutex);
+    } else {
+        // without dedup every block has a single user
+        ALWAYS_ASSERT(*refs == 1, "data_block_free: block already freed");
+        *refs = 0;
+    }
+
+    insert_delay(); // simulate storage access delay to free_blocks
+
+    alloc_group_t *group = group_of((size_t)block_number);
+    pthread_mutex_lock(&group->lock);
+    *free_block_at((size_t)block_number) = FREE;
+    group->free_count++;
+    pthread_mutex_unlock(&group->lock);
+}
+
+/**
+ * Get a block a file can modify in place: the block itself if the file is its
+ * only user (taking it out of the dedup index), otherwise a private copy
+ * (copy-on-write) and the file's reference to the shared block is dropped.
+ *
+ * Input:
+ *   - block_number: block the file currently uses
+ *
+ * Returns the block number to write to, or -1 in case of error.
+ *
+ * Possible errors:
+ *   - No free data blocks (for the copy).
+ */
+int data_block_unshare(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_unshare: invalid block number");
+    if (!fs->params.dedup) {
+        return block_number; // blocks are never shared
+    }
+
+    pthread_mutex_lock(&fs->dedup_mutex);
+    if (*block_ref_at((size_t)block_number) == 1) {
+        dedup_unindex((size_t)block_number);
+        pthread_mutex_unlock(&fs->dedup_mutex);
+        return block_number;
+    }
+    pthread_mutex_unlock(&fs->dedup_mutex);
+
+    // Shared blocks are indexed, so nobody modifies them: copy without the lock
+    int copy = data_block_alloc();
+    if (copy == -1) {
+        return -1;
+    }
+    memcpy(data_block_get(copy), data_block_get(block_number), BLOCK_SIZE);
+    data_block_modified(copy);
+
+    data_block_free(block_number);
+    return copy;
+}
+
+/**
+ * Deduplicate a full file block: if the index has a block with identical
+ * contents, share it (dropping the reference to this one); otherwise index
+ * this block. Does nothing unless tfs_params.dedup is set.
+ *
+ * Input:
+ *   - block_number: full block just written by a file (with its checksum up
+ *     to date)
+ *
+ * Returns the block number the file should use from now on.
+ */
+int data_block_dedup(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_dedup: invalid block number");
+    if (!fs->params.dedup) {
+        return block_number;
+    }
+
+    uint32_t hash = block_crc((size_t)block_number);
+    char const *contents = block_at((size_t)block_number);
+
+    pthread_mutex_lock(&fs->dedup_mutex);
+    if (*block_dedup_next_at((size_t)block_number) != DEDUP_UNINDEXED) {
+        pthread_mutex_unlock(&fs->dedup_mutex);
+        return block_number; // already indexed
+    }
+
+    int *bucket = &fs->dedup_buckets[hash & (fs->dedup_bucket_count - 1)];
+    for (int b = *bucket; b != -1; b = *block_dedup_next_at((size_t)b)) {
+        if (block_crc((size_t)b) == hash &&
+            memcmp(block_at((size_t)b), contents, BLOCK_SIZE) == 0) {
+            insert_delay(); // simulate storage access delay to block
+            (*block_ref_at((size_t)b))++;
+            pthread_mutex_unlock(&fs->dedup_mutex);
+
+            data_block_free(block_number);
+            return b;
+        }
+    }
+
+    *block_dedup_next_at((size_t)block_number) = *bucket;
+    *bucket = block_number;
+    pthread_mutex_unlock(&fs->dedup_mutex);
+    return block_number;
+}
+
+/**
+ * Obtain a pointer to the contents of a given block.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns a pointer to the first byte of the block.
+ */
+void *data_block_get(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_get: invalid block number");
+
+    insert_delay(); // simulate storage access delay to block
+    return block_at((size_t)block_number);
+}
+
+/**
+ * Mark a block dirty for the next flush (on file-backed volumes).
+ */
+static void data_block_dirty(int block_number) {
+    if (fs->volume_fd != -1) {
+        size_t i = (size_t)block_number % BLOCK_SEGMENT_LEN;
+        atomic_fetch_or(
+            &fs->dirty_bits[(size_t)block_number / BLOCK_SEGMENT_LEN][i / 64],
+            (uint64_t)1 << (i % 64));
+    }
+}
+
+/**
+ * Record that the contents of a block were modified: recompute its checksum,
+ * over the whole block, and, on file-backed volumes, mark it dirty for the
+ * next flush.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_modified(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_modified: invalid block number");
+
+    uint32_t crc = crc32c(0, block_at((size_t)block_number), BLOCK_SIZE);
+    atomic_store(block_crc_at((size_t)block_number),
+                 (uint64_t)BLOCK_SIZE << 32 | crc);
+    data_block_dirty(block_number);
+}
+
+/**
+ * Record that bytes [offset, offset + len) of a file's block were written.
+ *
+ * The checksum of a file block only covers the bytes written to it so far (the
+ * rest holds no file data). Writes that extend that prefix, as appends and
+ * sequential writes do, extend the checksum with just the new bytes
+ * (CRC32C(a || b) is CRC32C(b) seeded with CRC32C(a)); any other write
+ * recomputes it over the prefix.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - offset: first byte written
+ *   - len: number of bytes written
+ */
+void data_block_written(int block_number, size_t offset, size_t len) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_written: invalid block number");
+
+    char const *block = block_at((size_t)block_number);
+    uint64_t sum = atomic_load(block_crc_at((size_t)block_number));
+    size_t covered = (size_t)(sum >> 32);
+    uint32_t crc = (uint32_t)sum;
+    if (offset == covered) {
+        crc = crc32c(crc, block + offset, len);
+        covered += len;
+    } else {
+        if (offset + len > covered) {
+            covered = offset + len;
+        }
+        crc = crc32c(0, block, covered);
+    }
+    // a single store, so checks never pair a checksum with another length
+    atomic_store(block_crc_at((size_t)block_number),
+                 (uint64_t)covered << 32 | crc);
+    data_block_dirty(block_number);
+}
+
+/**
+ * Write blocks [first, end) of a segment back to the volume file.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int flush_blocks(size_t seg, size_t first, size_t end) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)(fs->data[seg] + first * BLOCK_SIZE);
+    uintptr_t stop = (uintptr_t)(fs->data[seg] + end * BLOCK_SIZE);
+    start -= start % page;
+
+    atomic_fetch_add(&fs->flushed_blocks, end - first);
+    return msync((void *)start, stop - start, MS_SYNC);
+}
+
+/**
+ * Flush one block to the volume file (no-op on in-memory volumes).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int data_block_flush(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_flush: invalid block number");
+    if (fs->volume_fd == -1) {
+        return 0;
+    }
+
+    size_t seg = (size_t)block_number / BLOCK_SEGMENT_LEN;
+    size_t i = (size_t)block_number % BLOCK_SEGMENT_LEN;
+    uint64_t bit = (uint64_t)1 << (i % 64);
+    if ((atomic_fetch_and(&fs->dirty_bits[seg][i / 64], ~bit) & bit) == 0) {
+        return 0; // clean (a concurrent flush may still be writing it back,
+                  // but then it was flushed before this call)
+    }
+    return flush_blocks(seg, i, i + 1);
+}
+
+/**
+ * Start reading part of a block in from the volume file in the background
+ * (no-op on in-memory volumes, whose blocks are always resident).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *   - offset, len: the part of the block that will be read soon
+ */
+void data_block_prefetch(int block_number, size_t offset, size_t len) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_prefetch: invalid block number");
+    if (fs->volume_fd == -1 || len == 0) {
+        return;
+    }
+
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t)block_at((size_t)block_number) + offset;
+    uintptr_t stop = start + len;
+    start -= start % page;
+
+    if (madvise((void *)start, stop - start, MADV_WILLNEED) == 0) {
+        atomic_fetch_add(&fs->readahead_bytes, len);
+    }
+}
+
+/**
+ * Obtain where a block is stored in the volume file.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns the offset of the block in the volume file.
+ */
+off_t data_block_offset(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_offset: invalid block number");
+
+    size_t seg = (size_t)block_number / BLOCK_SEGMENT_LEN;
+    size_t i = (size_t)block_number % BLOCK_SEGMENT_LEN;
+    return volume_segment_offset(seg) + (off_t)(i * BLOCK_SIZE);
+}
+
+/**
+ * Write the record of an inode back to the volume file, with the superblock
+ * (so the segment it lies in is mounted), and wait for both to reach the disk
+ * (no-op on in-memory volumes). Its name only reaches the volume with the
+ * root directory, on the next state_syncfs.
  *
  * Input:
- *   - params: TécnicoFS parameters
+ *   - inumber: inode's number
  *
  * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - TFS already initialized.
- *   - malloc failure when allocating TFS structures.
  */
-int state_init(tfs_params params) {
-    fs_params = params;
-
-    if (inode_table != NULL) {
-        return -1; // already initialized
+int inode_flush(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_flush: invalid inumber");
+    if (fs->volume_fd == -1) {
+        return 0;
     }
 
-    inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
-    free_open_file_entries = malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
-
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
-        return -1; // allocation failed
+    volume_super_t super;
+    volume_inode_t record;
+    pthread_mutex_lock(&fs->volume_mutex);
+    pthread_mutex_lock(&fs->root_inode_mutex);
+    volume_super_fill(&super);
+    volume_inode_fill((size_t)inumber, &record);
+    pthread_mutex_unlock(&fs->root_inode_mutex);
+
+    int ret = 0;
+    if (volume_write(&record, sizeof(record),
+                     volume_inode_offset((size_t)inumber)) != 0 ||
+        volume_write(&super, sizeof(super), 0) != 0 ||
+        fdatasync(fs->volume_fd) != 0) {
+        ret = -1;
     }
+    pthread_mutex_unlock(&fs->volume_mutex);
+    return ret;
+}
 
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+/**
+ * Flush every dirty block to the volume file.
+ *
+ * Runs of contiguous dirty blocks are written back with a single msync.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int flush_dirty_blocks(void) {
+    int ret = 0;
+    size_t segments = published_segments(&fs->block_segments);
+    for (size_t seg = 0; seg < segments; seg++) {
+        size_t run_start = 0, run_end = 0; // pending run of dirty blocks
+        size_t words = (BLOCK_SEGMENT_LEN + 63) / 64;
+        for (size_t w = 0; w < words; w++) {
+            uint64_t bits = atomic_exchange(&fs->dirty_bits[seg][w], 0);
+            while (bits != 0) {
+                size_t i = w * 64 + (size_t)__builtin_ctzll(bits);
+                bits &= bits - 1;
+
+                if (i == run_end && run_end > run_start) {
+                    run_end++;
+                    continue;
+                }
+                if (run_end > run_start && flush_blocks(seg, run_start,
+                                                        run_end) != 0) {
+                    ret = -1;
+                }
+                run_start = i;
+                run_end = i + 1;
+            }
+        }
+        if (run_end > run_start &&
+            flush_blocks(seg, run_start, run_end) != 0) {
+            ret = -1;
+        }
     }
+    return ret;
+}
 
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+/**
+ * Write the file system back to the volume file (no-op on in-memory volumes):
+ * every dirty block, then the metadata (see volume_super_t).
+ *
+ * The metadata is snapshotted before the blocks are flushed, so every block it
+ * refers to was modified before the flush started, and is flushed by it.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int state_syncfs(void) {
+    if (fs->volume_fd == -1) {
+        return 0;
     }
 
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
-        pthread_mutex_init(&open_file_table[i].lock, NULL);
+    pthread_mutex_lock(&fs->volume_mutex);
+    volume_super_t super;
+    pthread_mutex_lock(&fs->root_inode_mutex);
+    volume_super_fill(&super);
+    size_t inode_count = INODE_TABLE_SIZE;
+    volume_inode_t *records = malloc(inode_count * sizeof(volume_inode_t));
+    if (records != NULL) {
+        for (size_t i = 0; i < inode_count; i++) {
+            volume_inode_fill(i, &records[i]);
+        }
     }
+    pthread_mutex_unlock(&fs->root_inode_mutex);
+
+    int ret = flush_dirty_blocks();
+    if (records == NULL ||
+        volume_write(records, inode_count * sizeof(volume_inode_t),
+                     volume_inode_offset(0)) != 0 ||
+        volume_write(&super, sizeof(super), 0) != 0 ||
+        fdatasync(fs->volume_fd) != 0) {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&fs->volume_mutex);
 
-    pthread_mutex_init(&open_file_allocation_table_mutex, NULL);
-    return 0;
+    free(records);
+    return ret;
 }
 
 /**
- * Destroy FS state.
+ * Check the contents of a block against its stored checksum.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Input:
+ *   - block_number: the block number/index
+ *
+ * Returns true if the block is intact.
  */
-int state_destroy(void) {
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        pthread_mutex_destroy(&open_file_table[i].lock);
-    }
-    pthread_mutex_destroy(&open_file_allocation_table_mutex);
-    free(inode_table);
-    free(freeinode_ts);
-    free(fs_data);
-    free(free_blocks);
-    free(open_file_table);
-    free(free_open_file_entries);
-
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+bool data_block_verify(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_verify: invalid block number");
 
-    return 0;
+    uint64_t sum = atomic_load(block_crc_at((size_t)block_number));
+    return crc32c(0, block_at((size_t)block_number), (size_t)(sum >> 32)) ==
+           (uint32_t)sum;
 }
 
+typedef struct {
+    size_t first; // first block number checked by this thread
+    size_t step;  // distance between blocks checked by this thread
+    size_t end;   // number of blocks in the volume
+    size_t corrupted;
+    tfs_t *fs; // instance being scrubbed
+} scrub_args_t;
+
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
- *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Check whether a block belongs to the chain of a directory.
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * The caller must hold the root mutex.
  */
-static int inode_alloc(void) {
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
+static bool dir_holds_block(inode_t const *inode, int block_number) {
+    for (int b = inode->i_data_block; b != -1;
+         b = dir_block_next((dir_entry_t *)data_block_get(b))) {
+        if (b == block_number) {
+            return true;
         }
+    }
+    return false;
+}
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
+/**
+ * Check again a block whose checksum did not match while scrubbing, this time
+ * with its writers held off: writes and appends in flight modify a block
+ * before its checksum catches up, so a mismatch seen without locks proves
+ * nothing. A file block is checked under the write lock of an inode using it,
+ * the blocks of a directory under the root mutex. A block no inode uses is
+ * being set up or was just freed, and holds no data to lose.
+ *
+ * Returns true if the block is corrupted.
+ */
+static bool scrub_recheck(int block_number) {
+    size_t inodes = INODE_TABLE_SIZE;
+    for (size_t i = 0; i < inodes; i++) {
+        inode_t *inode = inode_at(i);
+        if (*freeinode_at(i) != TAKEN) {
+            continue;
+        }
 
-            return (int)inumber;
+        bool owner, intact;
+        if (inode->i_node_type == T_DIRECTORY) {
+            pthread_mutex_lock(&fs->root_inode_mutex);
+            owner = dir_holds_block(inode, block_number);
+            intact = !owner || data_block_verify(block_number);
+            pthread_mutex_unlock(&fs->root_inode_mutex);
+        } else if (inode->i_data_block != block_number) {
+            continue;
+        } else {
+            inode_write_lock(inode);
+            owner = inode->i_data_block == block_number;
+            intact = !owner || data_block_verify(block_number);
+            inode_write_unlock(inode);
+        }
+        if (owner) {
+            return !intact; // shared blocks are never modified in place
         }
     }
+    return false;
+}
 
-    // no free inodes
-    return -1;
+static void *scrub_worker(void *arg) {
+    scrub_args_t *args = (scrub_args_t *)arg;
+    fs = args->fs;
+
+    for (size_t i = args->first; i < args->end; i += args->step) {
+        if (*free_block_at(i) != TAKEN) {
+            continue;
+        }
+        insert_delay(); // simulate storage access delay to block
+        if (!data_block_verify((int)i) && scrub_recheck((int)i)) {
+            args->corrupted++;
+        }
+    }
+    return NULL;
 }
 
 /**
- * Create a new inode in the inode table.
- *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Verify the checksum of every allocated data block.
  *
  * Input:
- *   - i_type: the type of the node (file or directory)
+ *   - threads: number of threads sharing the work (at least 1)
  *
- * Returns inumber of the new inode, or -1 in the case of error.
- *
- * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
+ * Returns the number of corrupted blocks, or -1 in case of error.
  */
-int inode_create(inode_type i_type) {
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; // no free slots in inode table
+ssize_t state_scrub(size_t threads) {
+    if (threads == 0) {
+        threads = 1;
     }
 
-    inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
-
-    inode->i_node_type = i_type;
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    scrub_args_t *args = malloc(threads * sizeof(scrub_args_t));
+    if (!tids || !args) {
+        free(tids);
+        free(args);
+        return -1;
+    }
 
-            // run regular deletion process
-            inode_delete(inumber);
-            return -1;
+    // Blocks are interleaved between threads, so work stays balanced even if
+    // the allocated blocks are clustered at the start of the volume
+    size_t blocks = DATA_BLOCKS;
+    size_t started = 0;
+    for (; started < threads; started++) {
+        args[started] = (scrub_args_t){.first = started,
+                                       .step = threads,
+                                       .end = blocks,
+                                       .corrupted = 0,
+                                       .fs = fs};
+        if (pthread_create(&tids[started], NULL, scrub_worker,
+                           &args[started]) != 0) {
+            break;
         }
+    }
 
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-        inode_table[inumber].hard_links_count = 1;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
-    } break;
-    case T_FILE: {
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].hard_links_count = 1;
-        break;
+    ssize_t corrupted = 0;
+    for (size_t t = 0; t < started; t++) {
+        pthread_join(tids[t], NULL);
+        corrupted += (ssize_t)args[t].corrupted;
     }
-    case T_SOFT_LINK: {
-        // In case of a new file, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].hard_links_count = 1;
-        } break; 
-    default:
-        PANIC("inode_create: unknown file type");
+    if (started < threads) {
+        corrupted = -1; // some blocks were not checked
     }
 
-    return inumber;
+    free(tids);
+    free(args);
+    return corrupted;
 }
 
 /**
- * Delete an inode.
+ * Allocate a run of granules in the extent area.
  *
  * Input:
- *   - inumber: inode's number
+ *   - granules: number of contiguous granules
+ *
+ * Returns the first granule of the run, or -1 if there is no such free run.
  */
-void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
+static int extent_alloc(size_t granules) {
+    pthread_mutex_lock(&fs->extent_mutex);
+    size_t run = 0;
+    for (size_t g = 0; g < fs->extent_granules; g++) {
+        run = fs->extent_map[g] == FREE ? run + 1 : 0;
+        if (run == granules) {
+            size_t first = g + 1 - granules;
+            for (size_t i = first; i <= g; i++) {
+                fs->extent_map[i] = TAKEN;
+            }
+            fs->compressed_blocks++;
+            fs->compressed_granules += granules;
+            pthread_mutex_unlock(&fs->extent_mutex);
+            return (int)first;
+        }
+    }
+    pthread_mutex_unlock(&fs->extent_mutex);
+    return -1;
+}
 
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+static inline size_t extent_granule_count(size_t len) {
+    return (len + EXTENT_GRANULE - 1) / EXTENT_GRANULE;
+}
 
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
+/**
+ * Free the extent of a compressed inode (it is left with no data).
+ */
+static void extent_free(inode_t *inode) {
+    size_t granules = extent_granule_count(inode->i_extent_len);
 
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+    pthread_mutex_lock(&fs->extent_mutex);
+    for (size_t i = 0; i < granules; i++) {
+        fs->extent_map[(size_t)inode->i_extent + i] = FREE;
     }
+    fs->compressed_blocks--;
+    fs->compressed_granules -= granules;
+    pthread_mutex_unlock(&fs->extent_mutex);
 
-    freeinode_ts[inumber] = FREE;
+    inode->i_extent = -1;
 }
 
 /**
- * Obtain a pointer to an inode from its inumber.
+ * Decompress the extent of a compressed inode.
  *
  * Input:
- *   - inumber: inode's number
+ *   - inode: compressed inode
+ *   - block: destination buffer (BLOCK_SIZE bytes)
  *
- * Returns pointer to inode.
+ * Returns 0 if successful, -1 if the extent is corrupted.
  */
-inode_t *inode_get(int inumber) {
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+static int extent_decompress(inode_t const *inode, char *block) {
+    insert_delay(); // simulate storage access delay to extent
+    ssize_t len =
+        lz_decompress(fs->extent_area +
+                          (size_t)inode->i_extent * EXTENT_GRANULE,
+                      inode->i_extent_len, block, BLOCK_SIZE);
+    if (len != (ssize_t)BLOCK_SIZE) {
+        return -1;
+    }
+    if (fs->params.verify_checksums &&
+        crc32c(0, block, BLOCK_SIZE) != inode->i_extent_crc) {
+        return -1;
+    }
+    return 0;
+}
 
-    insert_delay(); // simulate storage access delay to inode
-    return &inode_table[inumber];
+/**
+ * Free the data of a file, whether stored in a data block or compressed,
+ * leaving it empty.
+ *
+ * The caller must hold the inode's i_data_lock for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ */
+void inode_release_data(inode_t *inode) {
+    if (inode->i_extent != -1) {
+        extent_free(inode);
+    } else if (inode->i_node_type == T_DIRECTORY) {
+        // frees the whole chain of directory blocks
+        for (int b = inode->i_data_block; b != -1;) {
+            int next = dir_block_next((dir_entry_t *)data_block_get(b));
+            data_block_free(b);
+            b = next;
+        }
+    } else if (inode->i_data_block != -1) {
+        data_block_free(inode->i_data_block);
+    }
+    inode->i_size = 0;
+    inode->i_reserved = 0;
+    inode->i_data_block = -1;
+    inode->i_cold_passes = 0;
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Move a compressed file back into a data block, so it can be modified.
+ * Does nothing if the file is not compressed.
+ *
+ * The caller must hold the inode's i_data_lock for writing.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
+ *   - inode: the file's inode
  *
  * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ *   - No free data blocks.
+ *   - Corrupted extent.
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+int inode_inflate(inode_t *inode) {
+    if (inode->i_extent == -1) {
+        return 0;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
-
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) { // Compare names to find equal
-            dir_entry[i].d_inumber = -1; // -1 to indicate is not associated with any inode
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME); // Name field is set to 0
-            return 0;
-        }
+    int b = data_block_alloc();
+    if (b == -1) {
+        return -1;
     }
-    return -1; // sub_name not found
+    if (extent_decompress(inode, block_at((size_t)b)) != 0) {
+        data_block_free(b);
+        return -1;
+    }
+    data_block_modified(b);
+
+    extent_free(inode);
+    inode->i_data_block = b;
+    inode->i_cold_passes = 0;
+    return 0;
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Read part of a compressed file.
+ *
+ * The caller must hold the inode's i_data_lock.
  *
  * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ *   - inode: compressed inode
+ *   - offset: position of the first byte to read
+ *   - buffer: destination buffer
+ *   - len: number of bytes to read (offset + len <= BLOCK_SIZE)
  *
  * Returns 0 if successful, -1 otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - malloc failure when allocating the decompression buffer.
+ *   - Corrupted extent.
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
+int extent_read(inode_t const *inode, size_t offset, void *buffer,
+                size_t len) {
+    char *block = malloc(BLOCK_SIZE);
+    if (block == NULL) {
+        return -1;
     }
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    int ret = extent_decompress(inode, block);
+    if (ret == 0) {
+        memcpy(buffer, block + offset, len);
     }
+    free(block);
+    return ret;
+}
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
-
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) { // Empty entry
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+/**
+ * Compress the (full) data block of a file into the extent area and free the
+ * block.
+ *
+ * The caller must hold the inode's i_data_lock for writing.
+ *
+ * Input:
+ *   - inode: the file's inode
+ *   - scratch: buffer of BLOCK_SIZE bytes
+ *
+ * Returns 0 if successful, -1 if the block does not compress to fewer
+ * granules or the extent area is full.
+ */
+static int inode_compress(inode_t *inode, char *scratch) {
+    // Only worth it if the compressed block saves at least one granule
+    size_t cap = extent_granule_count(BLOCK_SIZE) - 1;
+    size_t len = lz_compress(data_block_get(inode->i_data_block), BLOCK_SIZE,
+                             scratch, cap * EXTENT_GRANULE);
+    if (len == 0) {
+        return -1;
+    }
 
-            return 0;
-        }
+    int extent = extent_alloc(extent_granule_count(len));
+    if (extent == -1) {
+        return -1;
     }
+    memcpy(fs->extent_area + (size_t)extent * EXTENT_GRANULE, scratch, len);
 
-    return -1; // no space for entry
+    inode->i_extent = extent;
+    inode->i_extent_len = len;
+    inode->i_extent_crc = block_crc((size_t)inode->i_data_block);
+    data_block_free(inode->i_data_block);
+    inode->i_data_block = -1;
+    return 0;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
- *
- * Input:
- *   - inode: directory inode
- *   - sub_name: sub file name
+ * Set up compression, on the first open of a file with TFS_O_COMPRESS: the
+ * compressed extent area, and the background compressor. Nothing is set up
+ * for instances that never compress, nor for file-backed volumes (compressed
+ * extents only live in memory, so they would not be durable).
  *
- * Returns inumber linked to the target name, -1 if errors occur.
+ * Returns 0 if successful (including when compression is disabled), -1
+ * otherwise.
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
+ *   - malloc failure when allocating the area.
+ *   - The compressor thread could not be started.
  */
-int find_in_dir(inode_t const *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+int state_compression_start(void) {
+    if (atomic_load_explicit(&fs->compression_ready, memory_order_acquire)) {
+        return 0;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
-
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) && 
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
-
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
+    int ret = 0;
+    pthread_mutex_lock(&fs->extent_mutex);
+    if (!atomic_load(&fs->compression_ready)) {
+        size_t granules = fs->volume_fd == -1
+                          ? fs->params.compressed_area_size / EXTENT_GRANULE
+                          : 0;
+        if (granules > 0) {
+            fs->extent_area = malloc(granules * EXTENT_GRANULE);
+            fs->extent_map = calloc(granules, sizeof(allocation_state_t));
+            if (!fs->extent_area || !fs->extent_map ||
+                (fs->params.compress_interval_ms > 0 &&
+                 periodic_task_start(&fs->compressor,
+                                     fs->params.compress_interval_ms,
+                                     compress_pass) != 0)) {
+                free(fs->extent_area);
+                free(fs->extent_map);
+                fs->extent_area = NULL;
+                fs->extent_map = NULL;
+                ret = -1;
+            } else {
+                fs->extent_granules = granules;
+            }
         }
-
-    return -1; // entry not found
+        if (ret == 0) {
+            atomic_store_explicit(&fs->compression_ready, true,
+                                  memory_order_release);
+        }
+    }
+    pthread_mutex_unlock(&fs->extent_mutex);
+    return ret;
 }
 
 /**
- * Allocate a new data block.
+ * Run one compression pass over the inode table.
  *
- * Returns block number/index if successful, -1 otherwise.
+ * Inodes busy with reads or writes are skipped (they are not cold).
  *
- * Possible errors:
- *   - No free data blocks.
+ * Returns the number of blocks compressed, or -1 in case of error.
  */
-int data_block_alloc(void) {
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+ssize_t state_compress_cold(void) {
+    if (!atomic_load_explicit(&fs->compression_ready, memory_order_acquire) ||
+        fs->extent_area == NULL) {
+        return 0; // compression disabled, or no file asked for it yet
+    }
+
+    char *scratch = malloc(BLOCK_SIZE);
+    if (scratch == NULL) {
+        return -1;
+    }
+
+    ssize_t compressed = 0;
+    size_t inodes = INODE_TABLE_SIZE;
+    for (size_t i = 0; i < inodes; i++) {
+        inode_t *inode = inode_at(i);
+        if (*freeinode_at(i) != TAKEN || !inode->i_compress ||
+            !inode_try_write_lock(inode)) {
+            continue;
+        }
+
+        if (inode->i_compress && inode->i_node_type == T_FILE &&
+            inode->i_extent == -1 && inode->i_size == BLOCK_SIZE &&
+            ++inode->i_cold_passes >= COMPRESS_COLD_PASSES) {
+            if (inode_compress(inode, scratch) == 0) {
+                compressed++;
+            } else {
+                inode->i_cold_passes = 0; // retry once cold again
+            }
         }
+        inode_write_unlock(inode);
+    }
+
+    free(scratch);
+    return compressed;
+}
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
+static void *periodic_task_thread(void *arg) {
+    periodic_task_t *task = (periodic_task_t *)arg;
+    fs = task->fs;
+
+    pthread_mutex_lock(&task->mutex);
+    while (!task->stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(task->interval_ms / 1000);
+        deadline.tv_nsec += (long)(task->interval_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
 
-            return (int)i;
+        if (pthread_cond_timedwait(&task->cond, &task->mutex, &deadline) ==
+                0 ||
+            task->stopping) {
+            continue;
         }
+
+        pthread_mutex_unlock(&task->mutex);
+        task->run();
+        pthread_mutex_lock(&task->mutex);
     }
-    return -1;
+    pthread_mutex_unlock(&task->mutex);
+    return NULL;
 }
 
 /**
- * Free a data block.
+ * Start running `run` every `interval_ms` in a background thread.
  *
- * Input:
- *   - block_number: the block number/index
+ * Returns 0 if successful, -1 otherwise.
  */
-void data_block_free(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_free: invalid block number");
+static int periodic_task_start(periodic_task_t *task, size_t interval_ms,
+                               void (*run)(void)) {
+    task->stopping = false;
+    task->interval_ms = interval_ms;
+    task->run = run;
+    task->fs = fs;
+    if (pthread_create(&task->thread, NULL, periodic_task_thread, task) != 0) {
+        return -1;
+    }
+    task->running = true;
+    return 0;
+}
 
-    insert_delay(); // simulate storage access delay to free_blocks
+/**
+ * Stop a background task (if running) and wait for its thread.
+ */
+static void periodic_task_stop(periodic_task_t *task) {
+    if (!task->running) {
+        return;
+    }
 
-    free_blocks[block_number] = FREE;
+    pthread_mutex_lock(&task->mutex);
+    task->stopping = true;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->mutex);
+
+    pthread_join(task->thread, NULL);
+    task->running = false;
 }
 
+static void compress_pass(void) { state_compress_cold(); }
+
+static void flush_pass(void) { state_syncfs(); }
+
 /**
- * Obtain a pointer to the contents of a given block.
- *
- * Input:
- *   - block_number: the block number/index
- *
- * Returns a pointer to the first byte of the block.
+ * Fill `stats` with the current usage statistics.
  */
-void *data_block_get(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_get: invalid block number");
+void state_stats(tfs_stats_t *stats) {
+    pthread_mutex_lock(&fs->extent_mutex);
+    stats->compressed_blocks = fs->compressed_blocks;
+    stats->compressed_bytes = fs->compressed_granules * EXTENT_GRANULE;
+    pthread_mutex_unlock(&fs->extent_mutex);
+
+    stats->blocks_in_use = 0;
+    stats->block_references = 0;
+    pthread_mutex_lock(&fs->dedup_mutex);
+    size_t blocks = DATA_BLOCKS;
+    for (size_t i = 0; i < blocks; i++) {
+        if (*free_block_at(i) == TAKEN) {
+            stats->blocks_in_use++;
+            stats->block_references += *block_ref_at(i);
+        }
+    }
+    pthread_mutex_unlock(&fs->dedup_mutex);
 
-    insert_delay(); // simulate storage access delay to block
-    return &fs_data[(size_t)block_number * BLOCK_SIZE];
+    stats->dedup_ratio =
+        stats->blocks_in_use > 0
+            ? (double)stats->block_references / (double)stats->blocks_in_use
+            : 1.0;
+
+    stats->flushed_blocks = atomic_load(&fs->flushed_blocks);
+    stats->readahead_bytes = atomic_load(&fs->readahead_bytes);
+
+    stats->inodes_in_use = 0;
+    size_t inodes = INODE_TABLE_SIZE;
+    for (size_t i = 0; i < inodes; i++) {
+        if (*freeinode_at(i) == TAKEN) {
+            stats->inodes_in_use++;
+        }
+    }
+
+    stats->open_files_in_use = 0;
+    pthread_mutex_lock(&fs->open_file_allocation_table_mutex);
+    size_t open_files = MAX_OPEN_FILES;
+    for (size_t i = 0; i < open_files; i++) {
+        if (*free_open_file_at(i) == TAKEN) {
+            stats->open_files_in_use++;
+        }
+    }
+    pthread_mutex_unlock(&fs->open_file_allocation_table_mutex);
 }
 
 /**
@@ -476,24 +2735,39 @@ void *data_block_get(int block_number) {
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - append: whether writes go to the end of the file (TFS_O_APPEND)
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No space in open file table for a new open file.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
-    pthread_mutex_lock(&open_file_allocation_table_mutex);
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
-            open_file_table[i].of_inumber = inumber;
-            open_file_table[i].of_offset = offset;
-            pthread_mutex_unlock(&open_file_allocation_table_mutex);
-            return i;
+int add_to_open_file_table(int inumber, size_t offset, bool append) {
+    pthread_mutex_lock(&fs->open_file_allocation_table_mutex);
+    size_t i = 0;
+    for (;;) {
+        size_t segments = published_segments(&fs->open_file_segments);
+        for (; i < OPEN_FILE_SEGMENT_LEN * segments; i++) {
+            if (*free_open_file_at(i) == FREE) {
+                *free_open_file_at(i) = TAKEN;
+                open_file_at(i)->of_inumber = inumber;
+                open_file_at(i)->of_offset = offset;
+                open_file_at(i)->of_append = append;
+                open_file_at(i)->of_ra_next = offset;
+                open_file_at(i)->of_ra_window = 0;
+                open_file_at(i)->of_ra_end = offset;
+                pthread_mutex_unlock(&fs->open_file_allocation_table_mutex);
+                return (int)i;
+            }
+        }
+
+        // table full: grow it (if allowed) and keep scanning
+        if (table_grow(&fs->open_file_segments, segments,
+                       open_file_segment_alloc) != 0) {
+            break;
         }
     }
-    pthread_mutex_unlock(&open_file_allocation_table_mutex);
+    pthread_mutex_unlock(&fs->open_file_allocation_table_mutex);
 
     return -1;
 }
@@ -505,15 +2779,15 @@ int add_to_open_file_table(int inumber, size_t offset) {
  *   - fhandle: file handle to free/close
  */
 void remove_from_open_file_table(int fhandle) {
-    pthread_mutex_lock(&open_file_allocation_table_mutex);
+    pthread_mutex_lock(&fs->open_file_allocation_table_mutex);
     ALWAYS_ASSERT(valid_file_handle(fhandle),
                   "remove_from_open_file_table: file handle must be valid");
 
-    ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
+    ALWAYS_ASSERT(*free_open_file_at((size_t)fhandle) == TAKEN,
                   "remove_from_open_file_table: file handle must be taken");
 
-    free_open_file_entries[fhandle] = FREE;
-    pthread_mutex_unlock(&open_file_allocation_table_mutex);
+    *free_open_file_at((size_t)fhandle) = FREE;
+    pthread_mutex_unlock(&fs->open_file_allocation_table_mutex);
 }
 
 /**
@@ -530,9 +2804,9 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
         return NULL;
     }
 
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    if (*free_open_file_at((size_t)fhandle) != TAKEN) {
         return NULL;
     }
 
-    return &open_file_table[fhandle];
+    return open_file_at((size_t)fhandle);
 }
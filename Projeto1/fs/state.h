@@ -4,7 +4,10 @@
 #include "config.h"
 #include "operations.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -25,17 +28,45 @@ typedef enum { T_FILE, T_DIRECTORY, T_SOFT_LINK } inode_type; // Different types
  * Inode 
  * i_node_type - type of inode
  * hard_links_count - number of hard links
- * i_size - size of the file or directory
+ * i_size - size of the file or directory (bytes readers may see)
+ * i_reserved - end of the bytes claimed by writers; only ahead of i_size while
+ *   appends are in flight (see tfs_write on TFS_O_APPEND handles)
  * i_data_block - data block number
  * i_target - stores the name of the file that the soft link points to 
+ * i_generation - bumped whenever the inode is (re)created or loses a name
+ * i_target_inumber, i_target_generation - soft link resolution cache: the
+ *   inode i_target named when it was last looked up (-1 if not cached); only
+ *   valid while that inode still has the same generation
+ * i_compress - file opted into background compression (TFS_O_COMPRESS)
+ * i_extent, i_extent_len, i_extent_crc - while compressed, the first granule
+ *   of its extent (-1 if the file is stored in i_data_block), the compressed
+ *   length and the checksum of the uncompressed block
+ * i_cold_passes - compression passes since the block was last modified
+ * i_data_lock - held for reading while appending to the file and for writing
+ *   while its data is modified, compressed or decompressed (see
+ *   inode_write_lock); tfs_read does not take it for plain data blocks
+ * i_seq - sequence counter: odd while a writer holds i_data_lock, so readers
+ *   can snapshot the inode and its block without locking and retry if a
+ *   writer raced with them (see inode_read_begin)
  * 
  */
 typedef struct {
     inode_type i_node_type;
     int hard_links_count;
-    size_t i_size;
+    _Atomic size_t i_size;
+    _Atomic size_t i_reserved;
     int i_data_block;
     char i_target[MAX_FILE_NAME];
+    unsigned int i_generation;
+    int i_target_inumber;
+    unsigned int i_target_generation;
+    bool i_compress;
+    int i_extent;
+    size_t i_extent_len;
+    uint32_t i_extent_crc;
+    unsigned int i_cold_passes;
+    pthread_rwlock_t i_data_lock;
+    _Atomic unsigned int i_seq;
 } inode_t;
 
 typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t; // State of a data block
@@ -44,11 +75,18 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t; // State of a data bloc
  * Open file entry (in open file table)
  * of_inumber - inode number (unique identifier for a file)
  * of_offset - offset (the current position within the file at which the next read or write operation will take place)
+ * of_append - opened with TFS_O_APPEND: every write goes to the end of the file
+ * of_ra_next, of_ra_window, of_ra_end - sequential read-ahead state: where a
+ *   sequential read would start, the current window and how far was prefetched
  * Offset is used to keep track of the current location in the file when r/w, to know where to pick up when it resumes r/w
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append;
+    size_t of_ra_next;
+    size_t of_ra_window;
+    size_t of_ra_end;
     pthread_mutex_t lock;
 } open_file_entry_t;
 
@@ -56,22 +94,58 @@ typedef struct {
 int state_init(tfs_params);  // Initializing and clean up file system state
 int state_destroy(void);
 
+tfs_t *state_new(void); // Instances (see tfs_t) and the current one
+void state_free(tfs_t *instance);
+tfs_t *state_switch(tfs_t *instance);
+pthread_mutex_t *state_root_mutex(void);
+
 size_t state_block_size(void); // Size of a data block
+tfs_backing_t state_data_backing(void); // Memory backing the data region
+bool state_verify_on_read(void); // Whether reads check block checksums
+tfs_durability_t state_durability(void); // Flush and read-ahead settings
+bool state_volume_mounted(void); // Whether state_init mounted an existing volume
+size_t state_readahead_max(void);
 
 int inode_create(inode_type n_type); // Create, delete and get inodes
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+void inode_write_lock(inode_t *inode); // Exclusive writers, optimistic readers
+bool inode_try_write_lock(inode_t *inode);
+void inode_write_unlock(inode_t *inode);
+unsigned int inode_read_begin(inode_t const *inode);
+bool inode_read_retry(inode_t const *inode, unsigned int seq);
+bool inode_generation_matches(int inumber, unsigned int generation); // Check a cached (inumber, generation) pair
 
 int clear_dir_entry(inode_t *inode, char const *sub_name); // Manipulate directory entries
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 
 int find_in_dir(inode_t const *inode, char const *sub_name); // Find a file or a directory in a directory
+size_t read_dir_entries(inode_t const *inode, size_t *cursor,
+                        tfs_dirent_t *entries, size_t max_entries); // List a directory in batches
 
 int data_block_alloc(void); // Alocate or free data blocks
 void data_block_free(int block_number);
+int data_block_unshare(int block_number); // Copy-on-write and dedup of shared blocks
+int data_block_dedup(int block_number);
 void *data_block_get(int block_number); // Get the data stored in a data block
+void data_block_modified(int block_number); // Maintain and check block checksums, flush dirty blocks
+void data_block_written(int block_number, size_t offset, size_t len);
+bool data_block_verify(int block_number);
+ssize_t state_scrub(size_t threads);
+int data_block_flush(int block_number);
+int inode_flush(int inumber);
+int state_syncfs(void);
+off_t data_block_offset(int block_number);
+void data_block_prefetch(int block_number, size_t offset, size_t len);
+
+void inode_release_data(inode_t *inode); // Transparent compression of file data
+int inode_inflate(inode_t *inode);
+int extent_read(inode_t const *inode, size_t offset, void *buffer, size_t len);
+int state_compression_start(void);
+ssize_t state_compress_cold(void);
+void state_stats(tfs_stats_t *stats);
  
-int add_to_open_file_table(int inumber, size_t offset); // Add and remove entries from the open file table
+int add_to_open_file_table(int inumber, size_t offset, bool append); // Add and remove entries from the open file table
 void remove_from_open_file_table(int fhandle);
 
 open_file_entry_t *get_open_file_entry(int fhandle); // Retrieve an entry from the open file table  
@@ -0,0 +1,86 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#define BLOCKS 64
+#define GROUPS 4
+#define GROUP_SIZE (BLOCKS / GROUPS)
+#define THREADS 3
+#define PER_THREAD (GROUP_SIZE / 2)
+
+static int allocated[THREADS][PER_THREAD];
+
+static void *allocator(void *arg) {
+    int *blocks = (int *)arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        blocks[i] = data_block_alloc();
+        assert(blocks[i] != -1);
+    }
+    return NULL;
+}
+
+/* Checks that a thread allocates from its own group first, that threads get
+ * distinct groups, and that a thread steals from other groups once its own is
+ * full, so every block can still be allocated.
+ */
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCKS;
+    params.alloc_groups = GROUPS;
+    params.max_table_segments = 1; // exhaustion is the point
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1); // the root directory takes a block
+
+    // Threads started now get the groups after this thread's
+    pthread_t tids[THREADS];
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_create(&tids[t], NULL, allocator, allocated[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; t++) {
+        assert(pthread_join(tids[t], NULL) == 0);
+    }
+
+    bool group_used[GROUPS] = {false};
+    for (int t = 0; t < THREADS; t++) {
+        int group = allocated[t][0] / GROUP_SIZE;
+        for (int i = 0; i < PER_THREAD; i++) {
+            // contiguous, within a single group
+            assert(allocated[t][i] == allocated[t][0] + i);
+            assert(allocated[t][i] / GROUP_SIZE == group);
+        }
+        assert(!group_used[group]);
+        group_used[group] = true;
+    }
+
+    // This thread fills its own group (where the root directory block is)
+    // before stealing from the others, until the whole region is taken
+    size_t taken = 1 + THREADS * PER_THREAD;
+    for (int i = 0; i < GROUP_SIZE - 1; i++) {
+        int b = data_block_alloc();
+        assert(b >= 0 && b < GROUP_SIZE);
+        taken++;
+    }
+    for (; taken < BLOCKS; taken++) {
+        int b = data_block_alloc();
+        assert(b >= GROUP_SIZE && b < BLOCKS);
+    }
+    assert(data_block_alloc() == -1);
+
+    // Freed blocks are found again
+    data_block_free(allocated[1][3]);
+    assert(data_block_alloc() == allocated[1][3]);
+    assert(data_block_alloc() == -1);
+
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.blocks_in_use == BLOCKS);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
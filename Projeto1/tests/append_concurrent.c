@@ -0,0 +1,141 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define APPENDERS 8
+#define RECORD_SIZE 16
+#define BLOCK_SIZE (RECORD_SIZE * 2048)
+
+static char const *path = "/log";
+static bool appenders_done;
+
+typedef struct {
+    int id;
+    int appended; // records written by this appender
+} appender_t;
+
+static void *appender(void *arg) {
+    appender_t *a = (appender_t *)arg;
+
+    // Each appender opens its own handle, like separate publisher sessions
+    int fd = tfs_open(path, TFS_O_APPEND);
+    assert(fd != -1);
+
+    for (;;) {
+        char record[RECORD_SIZE + 1];
+        snprintf(record, sizeof(record), "%02d:%012d\n", a->id, a->appended);
+        ssize_t written = tfs_write(fd, record, RECORD_SIZE);
+        assert(written == 0 || written == RECORD_SIZE);
+        if (written == 0) {
+            break; // file full
+        }
+        a->appended++;
+    }
+
+    assert(tfs_close(fd) != -1);
+    return NULL;
+}
+
+/* Reads the file while it is being appended to: it must always hold whole
+ * records and pass its checksum.
+ */
+static void *reader(void *arg) {
+    (void)arg;
+    char *buffer = malloc(BLOCK_SIZE);
+    assert(buffer != NULL);
+
+    while (!__atomic_load_n(&appenders_done, __ATOMIC_ACQUIRE)) {
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        ssize_t r = tfs_read(fd, buffer, BLOCK_SIZE);
+        assert(r >= 0 && r % RECORD_SIZE == 0);
+        for (ssize_t i = 0; i < r; i += RECORD_SIZE) {
+            assert(buffer[i + 2] == ':' && buffer[i + RECORD_SIZE - 1] == '\n');
+        }
+        assert(tfs_close(fd) != -1);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+/* Several handles append fixed-size records to one file in parallel until it
+ * is full: no record may be lost, overwritten or torn, and each appender's
+ * records must appear in the order it wrote them.
+ */
+int main() {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+
+    pthread_t tids[APPENDERS];
+    appender_t appenders[APPENDERS];
+    pthread_t reader_tid;
+    assert(pthread_create(&reader_tid, NULL, reader, NULL) == 0);
+    for (int i = 0; i < APPENDERS; i++) {
+        appenders[i] = (appender_t){.id = i, .appended = 0};
+        assert(pthread_create(&tids[i], NULL, appender, &appenders[i]) == 0);
+    }
+    int total = 0;
+    for (int i = 0; i < APPENDERS; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+        total += appenders[i].appended;
+    }
+    __atomic_store_n(&appenders_done, true, __ATOMIC_RELEASE);
+    assert(pthread_join(reader_tid, NULL) == 0);
+
+    assert(total == BLOCK_SIZE / RECORD_SIZE);
+
+    char *buffer = malloc(BLOCK_SIZE);
+    assert(buffer != NULL);
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    int next[APPENDERS] = {0};
+    for (size_t i = 0; i < BLOCK_SIZE; i += RECORD_SIZE) {
+        int id, seq;
+        assert(sscanf(buffer + i, "%02d:%012d\n", &id, &seq) == 2);
+        assert(id >= 0 && id < APPENDERS);
+        assert(seq == next[id]);
+        next[id]++;
+    }
+    for (int i = 0; i < APPENDERS; i++) {
+        assert(next[i] == appenders[i].appended);
+    }
+    free(buffer);
+
+    // A regular handle still writes at its own offset
+    fd = tfs_open(path, TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, "abc", 3) == 3);
+    int fd_append = tfs_open(path, TFS_O_APPEND);
+    assert(fd_append != -1);
+    assert(tfs_write(fd, "d", 1) == 1);
+    assert(tfs_write(fd_append, "e", 1) == 1); // at the end, after "abcd"
+    assert(tfs_close(fd) != -1);
+    assert(tfs_close(fd_append) != -1);
+
+    char contents[6] = {0};
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, contents, sizeof(contents)) == 5);
+    assert(strcmp(contents, "abcde") == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,178 @@
+#include "../fs/crc32c.h"
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RANDOM_BUFFERS 64
+#define RANDOM_BUFFER_SIZE 4099
+#define SCRUB_PASSES 5000
+
+static atomic_bool writing;
+
+// Keeps rewriting and appending to a file until told to stop
+static void *writer(void *arg) {
+    (void)arg;
+    char chunk[100];
+    for (unsigned char round = 0; atomic_load(&writing); round++) {
+        memset(chunk, round, sizeof(chunk));
+        int fd = tfs_open("/busy", TFS_O_TRUNC);
+        assert(fd != -1);
+        assert(tfs_write(fd, chunk, sizeof(chunk)) == sizeof(chunk));
+        assert(tfs_close(fd) != -1);
+
+        fd = tfs_open("/busy", TFS_O_APPEND);
+        assert(fd != -1);
+        for (int i = 0; i < 5; i++) {
+            assert(tfs_write(fd, chunk, sizeof(chunk)) == sizeof(chunk));
+        }
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+/* Checks the CRC32C implementations against each other and a known vector,
+ * then corrupts a data block behind the file system's back and checks both
+ * tfs_read and tfs_scrub notice it, and that a scrub racing with writes
+ * reports nothing on a healthy volume.
+ */
+int main() {
+    // Standard check value of CRC32C
+    assert(crc32c(0, "123456789", 9) == 0xE3069283);
+    assert(crc32c_portable(0, "123456789", 9) == 0xE3069283);
+
+    // Hardware and table-driven paths agree, at any length and alignment
+    unsigned char *random = malloc(RANDOM_BUFFER_SIZE);
+    assert(random != NULL);
+    srand(31);
+    for (int i = 0; i < RANDOM_BUFFERS; i++) {
+        for (size_t b = 0; b < RANDOM_BUFFER_SIZE; b++) {
+            random[b] = (unsigned char)rand();
+        }
+        size_t start = (size_t)i % 8;
+        size_t len = (size_t)rand() % (RANDOM_BUFFER_SIZE - start);
+        assert(crc32c(0, random + start, len) ==
+               crc32c_portable(0, random + start, len));
+        // Checksums can be computed incrementally
+        assert(crc32c(crc32c(0, random, len / 2), random + len / 2,
+                      len - len / 2) == crc32c(0, random, len));
+    }
+    free(random);
+
+    char const contents[] = "checksummed contents";
+    char buffer[sizeof(contents)];
+
+    tfs_params params = tfs_default_params();
+    params.verify_checksums = true;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_scrub(4) == 0);
+
+    // Find the file's data block through the directory listing
+    int dh = tfs_opendir("/");
+    assert(dh != -1);
+    tfs_dirent_t entry;
+    assert(tfs_readdir(dh, &entry, 1) == 1);
+    assert(strcmp(entry.d_name, "f1") == 0);
+    assert(tfs_closedir(dh) != -1);
+
+    inode_t *inode = inode_get(entry.d_inumber);
+    assert(inode != NULL);
+    char *block = data_block_get(inode->i_data_block);
+    assert(block != NULL);
+
+    // Flip one bit
+    block[3] ^= 0x10;
+
+    fd = tfs_open("/f1", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == -1);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_scrub(1) == 1);
+    assert(tfs_scrub(4) == 1);
+
+    // Restoring the bit makes the block valid again
+    block[3] ^= 0x10;
+    assert(tfs_scrub(4) == 0);
+
+    fd = tfs_open("/f1", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(memcmp(buffer, contents, sizeof(buffer)) == 0);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    // Verification on read is off by default: reads still succeed
+    assert(tfs_init(NULL) != -1);
+
+    fd = tfs_open("/f1", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, sizeof(contents)) == sizeof(contents));
+    assert(tfs_close(fd) != -1);
+
+    inode = inode_get(1);
+    assert(inode != NULL);
+    block = data_block_get(inode->i_data_block);
+    block[0] ^= 0x01;
+
+    fd = tfs_open("/f1", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == sizeof(buffer));
+    assert(tfs_close(fd) != -1);
+    assert(tfs_scrub(2) == 1);
+
+    assert(tfs_destroy() != -1);
+
+    // Appends extend the checksum of the bytes written so far; the rest of
+    // the block holds no file data, and is not covered
+    assert(tfs_init(NULL) != -1);
+    fd = tfs_open("/log", TFS_O_CREAT | TFS_O_APPEND);
+    assert(fd != -1);
+    for (int i = 0; i < 3; i++) {
+        assert(tfs_write(fd, contents, sizeof(contents)) == sizeof(contents));
+        assert(tfs_scrub(1) == 0);
+    }
+    assert(tfs_close(fd) != -1);
+
+    inode = inode_get(1);
+    assert(inode != NULL && inode->i_size == 3 * sizeof(contents));
+    block = data_block_get(inode->i_data_block);
+    block[3 * sizeof(contents)] ^= 0x01; // past the end of the file
+    assert(tfs_scrub(1) == 0);
+    block[2 * sizeof(contents)] ^= 0x01; // in the last append
+    assert(tfs_scrub(1) == 1);
+
+    assert(tfs_destroy() != -1);
+
+    // Writes and appends in flight are not mistaken for corruption
+    assert(tfs_init(NULL) != -1);
+    int busy = tfs_open("/busy", TFS_O_CREAT);
+    assert(busy != -1);
+    assert(tfs_close(busy) != -1);
+
+    atomic_store(&writing, true);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, writer, NULL) == 0);
+    for (int i = 0; i < SCRUB_PASSES; i++) {
+        assert(tfs_scrub(1) == 0);
+    }
+    atomic_store(&writing, false);
+    assert(pthread_join(tid, NULL) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,159 @@
+#include "../fs/lz.h"
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BLOCK_SIZE 1024
+#define COMPRESSED_FILES 8
+
+static char const message[] = "message from the broker, number ";
+
+static void fill_text(char *block, int seed) {
+    for (size_t i = 0; i < BLOCK_SIZE;) {
+        int n = snprintf(block + i, BLOCK_SIZE - i, "%s%d\n", message,
+                         seed + (int)i);
+        i += (size_t)n;
+    }
+}
+
+static void check_contents(char const *path, char const *expected) {
+    char buffer[BLOCK_SIZE];
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, expected, BLOCK_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Checks the LZ codec round-trips, then that full blocks of files opened with
+ * TFS_O_COMPRESS get compressed once cold (by explicit passes and by the
+ * background thread), read back the same, and can still be written to.
+ */
+int main() {
+    char block[BLOCK_SIZE];
+    char compressed[BLOCK_SIZE];
+    char restored[BLOCK_SIZE];
+
+    // Codec round trip, on text and on incompressible data
+    fill_text(block, 0);
+    size_t len = lz_compress(block, BLOCK_SIZE, compressed, BLOCK_SIZE);
+    assert(len > 0 && len < BLOCK_SIZE / 2);
+    assert(lz_decompress(compressed, len, restored, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(block, restored, BLOCK_SIZE) == 0);
+
+    srand(32);
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        block[i] = (char)rand();
+    }
+    assert(lz_compress(block, BLOCK_SIZE, compressed, BLOCK_SIZE / 2) == 0);
+    len = lz_compress(block, BLOCK_SIZE, compressed, BLOCK_SIZE * 2);
+    assert(len > 0);
+    assert(lz_decompress(compressed, len, restored, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(block, restored, BLOCK_SIZE) == 0);
+
+    // Long runs use extended lengths
+    memset(block, 'a', BLOCK_SIZE);
+    len = lz_compress(block, BLOCK_SIZE, compressed, BLOCK_SIZE);
+    assert(len > 0 && len < 16);
+    assert(lz_decompress(compressed, len, restored, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(block, restored, BLOCK_SIZE) == 0);
+
+    // Explicit compression passes
+    tfs_params params = tfs_default_params();
+    params.compress_interval_ms = 0;
+    assert(tfs_init(&params) != -1);
+
+    char contents[COMPRESSED_FILES][BLOCK_SIZE];
+    for (int f = 0; f < COMPRESSED_FILES; f++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/c%d", f);
+        fill_text(contents[f], f * 1000);
+
+        int fd = tfs_open(path, TFS_O_CREAT | TFS_O_COMPRESS);
+        assert(fd != -1);
+        assert(tfs_write(fd, contents[f], BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+
+    // Files that did not opt in, or are not full, stay as they are
+    int fd = tfs_open("/plain", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents[0], BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+    fd = tfs_open("/partial", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents[0], BLOCK_SIZE / 2) == BLOCK_SIZE / 2);
+    assert(tfs_close(fd) != -1);
+
+    // Blocks must stay cold for a few passes first
+    tfs_stats_t stats;
+    assert(tfs_compress_cold() == 0);
+    assert(tfs_compress_cold() == COMPRESSED_FILES);
+    assert(tfs_compress_cold() == 0);
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_blocks == COMPRESSED_FILES);
+    assert(stats.compressed_bytes < COMPRESSED_FILES * BLOCK_SIZE / 2);
+
+    for (int f = 0; f < COMPRESSED_FILES; f++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/c%d", f);
+        check_contents(path, contents[f]);
+    }
+    check_contents("/plain", contents[0]);
+
+    // Reads at an offset
+    fd = tfs_open("/c1", 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, restored, 10) == 10);
+    assert(tfs_read(fd, restored, 20) == 20);
+    assert(memcmp(restored, contents[1] + 10, 20) == 0);
+    assert(tfs_close(fd) != -1);
+
+    // Writing decompresses the file back into a data block
+    fd = tfs_open("/c2", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "X", 1) == 1);
+    assert(tfs_close(fd) != -1);
+    contents[2][0] = 'X';
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_blocks == COMPRESSED_FILES - 1);
+    check_contents("/c2", contents[2]);
+
+    // Truncating and unlinking release the extent
+    fd = tfs_open("/c3", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_unlink("/c4") != -1);
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_blocks == COMPRESSED_FILES - 3);
+
+    assert(tfs_destroy() != -1);
+
+    // Background thread
+    params.compress_interval_ms = 1;
+    assert(tfs_init(&params) != -1);
+
+    fd = tfs_open("/bg", TFS_O_CREAT | TFS_O_COMPRESS);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents[5], BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    for (int tries = 0; tries < 5000; tries++) {
+        assert(tfs_stats(&stats) != -1);
+        if (stats.compressed_blocks == 1) {
+            break;
+        }
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    assert(stats.compressed_blocks == 1);
+    check_contents("/bg", contents[5]);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
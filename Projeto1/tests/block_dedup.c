@@ -0,0 +1,125 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE 1024
+#define COPIES 5
+
+static void write_file(char const *path, char const *contents, size_t len) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, len) == len);
+    assert(tfs_close(fd) != -1);
+}
+
+static void check_contents(char const *path, char const *expected) {
+    char buffer[BLOCK_SIZE];
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(memcmp(buffer, expected, BLOCK_SIZE) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+static tfs_stats_t stats(void) {
+    tfs_stats_t s;
+    assert(tfs_stats(&s) != -1);
+    return s;
+}
+
+/* Writes the same full block to several files and checks they share one data
+ * block, that modifying one copies it (leaving the others intact), and that
+ * the shared block is only freed with its last file.
+ */
+int main() {
+    char heartbeat[BLOCK_SIZE];
+    char alert[BLOCK_SIZE];
+    memset(heartbeat, 'h', BLOCK_SIZE);
+    memset(alert, 'a', BLOCK_SIZE);
+
+    tfs_params params = tfs_default_params();
+    params.dedup = true;
+    params.compress_interval_ms = 0;
+    assert(tfs_init(&params) != -1);
+
+    // Only the root directory block
+    assert(stats().blocks_in_use == 1);
+
+    for (int i = 0; i < COPIES; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/h%d", i);
+        write_file(path, heartbeat, BLOCK_SIZE);
+    }
+    assert(stats().blocks_in_use == 2);
+    assert(stats().block_references == 1 + COPIES);
+    assert(stats().dedup_ratio > 2.5);
+
+    // A block filled by several writes is deduplicated once full
+    int fd = tfs_open("/h_parts", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, heartbeat, BLOCK_SIZE / 2) == BLOCK_SIZE / 2);
+    assert(stats().blocks_in_use == 3);
+    assert(tfs_write(fd, heartbeat, BLOCK_SIZE / 2) == BLOCK_SIZE / 2);
+    assert(tfs_close(fd) != -1);
+    assert(stats().blocks_in_use == 2);
+    assert(stats().block_references == 2 + COPIES);
+
+    // Different contents get their own block
+    write_file("/a", alert, BLOCK_SIZE);
+    assert(stats().blocks_in_use == 3);
+
+    // Copy-on-write
+    fd = tfs_open("/h1", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "X", 1) == 1);
+    assert(tfs_close(fd) != -1);
+    assert(stats().blocks_in_use == 4);
+
+    char modified[BLOCK_SIZE];
+    memcpy(modified, heartbeat, BLOCK_SIZE);
+    modified[0] = 'X';
+    check_contents("/h1", modified);
+    for (int i = 0; i < COPIES; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/h%d", i);
+        check_contents(path, i == 1 ? modified : heartbeat);
+    }
+    check_contents("/h_parts", heartbeat);
+
+    // Writing the original contents back shares the block again
+    fd = tfs_open("/h1", 0);
+    assert(fd != -1);
+    assert(tfs_write(fd, "h", 1) == 1);
+    assert(tfs_close(fd) != -1);
+    assert(stats().blocks_in_use == 3);
+    check_contents("/h1", heartbeat);
+
+    // The shared block survives until its last file goes
+    for (int i = 0; i < COPIES; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/h%d", i);
+        assert(tfs_unlink(path) != -1);
+        assert(stats().blocks_in_use == 3);
+    }
+    check_contents("/h_parts", heartbeat);
+    fd = tfs_open("/h_parts", TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_close(fd) != -1);
+    assert(stats().blocks_in_use == 2);
+    assert(stats().block_references == stats().blocks_in_use);
+
+    assert(tfs_destroy() != -1);
+
+    // Without dedup, nothing is shared
+    params.dedup = false;
+    assert(tfs_init(&params) != -1);
+    write_file("/h0", heartbeat, BLOCK_SIZE);
+    write_file("/h1", heartbeat, BLOCK_SIZE);
+    assert(stats().blocks_in_use == 3);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
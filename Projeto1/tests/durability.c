@@ -0,0 +1,117 @@
+#include "../fs/operations.h"
+#include "../fs/state.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 1024
+
+static char volume[] = "/tmp/tfs_volume_XXXXXX";
+
+static size_t flushed(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.flushed_blocks;
+}
+
+static int file_block(int fd) {
+    open_file_entry_t *file = get_open_file_entry(fd);
+    assert(file != NULL);
+    return inode_get(file->of_inumber)->i_data_block;
+}
+
+/* Checks the block a file handle writes to reached the volume file. */
+static void check_volume(int block, char const *expected, size_t len) {
+    char buffer[BLOCK_SIZE];
+    int vfd = open(volume, O_RDONLY);
+    assert(vfd != -1);
+    assert(pread(vfd, buffer, len, data_block_offset(block)) == len);
+    assert(memcmp(buffer, expected, len) == 0);
+    assert(close(vfd) == 0);
+}
+
+/* Checks that only modified blocks are flushed, by tfs_syncfs, tfs_fsync and
+ * each durability mode, and that they end up in the volume file.
+ */
+int main() {
+    int vfd = mkstemp(volume);
+    assert(vfd != -1);
+    assert(close(vfd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.volume_path = volume;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_data_backing() == TFS_BACKING_FILE);
+
+    // The root directory block was written by tfs_init
+    assert(tfs_syncfs() != -1);
+    assert(flushed() == 1);
+    assert(tfs_syncfs() != -1);
+    assert(flushed() == 1);
+
+    int fd = tfs_open("/f", TFS_O_CREAT); // modifies the root directory
+    assert(fd != -1);
+    assert(tfs_write(fd, "hello", 5) == 5);
+    int block = file_block(fd);
+    assert(tfs_fsync(fd) != -1);
+    assert(flushed() == 2);
+    assert(tfs_fsync(fd) != -1); // already clean
+    assert(flushed() == 2);
+    check_volume(block, "hello", 5);
+
+    assert(tfs_close(fd) != -1); // no flush in this mode
+    assert(tfs_syncfs() != -1);  // the root directory only
+    assert(flushed() == 3);
+    assert(tfs_destroy() != -1);
+
+    // Sync on close
+    params.durability = TFS_DURABILITY_ON_CLOSE;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_syncfs() != -1);
+    fd = tfs_open("/f", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "world", 5) == 5);
+    block = file_block(fd);
+    size_t before = flushed();
+    assert(tfs_close(fd) != -1);
+    assert(flushed() == before + 1);
+    check_volume(block, "world", 5);
+    assert(tfs_destroy() != -1);
+
+    // Periodic background flush (on a fresh volume, as the root directory
+    // block is only dirty when tfs_init creates it)
+    assert(truncate(volume, 0) == 0);
+    params.durability = TFS_DURABILITY_PERIODIC;
+    params.flush_interval_ms = 1;
+    assert(tfs_init(&params) != -1);
+    while (flushed() < 1) { // the root directory block
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    fd = tfs_open("/f", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "again", 5) == 5);
+    block = file_block(fd);
+    while (flushed() < 3) { // the root directory again, and the file
+        nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+    }
+    check_volume(block, "again", 5);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    // In-memory volumes have nothing to flush
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_syncfs() != -1);
+    assert(flushed() == 0);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(volume) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
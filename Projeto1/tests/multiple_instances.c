@@ -0,0 +1,104 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define INSTANCES 4
+#define FILES 8
+
+static tfs_t *instances[INSTANCES];
+
+static void write_file(tfs_t *fs, char const *path, char const *contents) {
+    int fd = tfs_open_ctx(fs, path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write_ctx(fs, fd, contents, strlen(contents)) ==
+           strlen(contents));
+    assert(tfs_close_ctx(fs, fd) != -1);
+}
+
+static void check_file(tfs_t *fs, char const *path, char const *expected) {
+    char buffer[64] = {0};
+    int fd = tfs_open_ctx(fs, path, 0);
+    assert(fd != -1);
+    assert(tfs_read_ctx(fs, fd, buffer, sizeof(buffer) - 1) ==
+           strlen(expected));
+    assert(strcmp(buffer, expected) == 0);
+    assert(tfs_close_ctx(fs, fd) != -1);
+}
+
+/* Fills its own instance with files named like every other instance's. */
+static void *worker(void *arg) {
+    int id = *(int *)arg;
+    tfs_t *fs = instances[id];
+
+    for (int i = 0; i < FILES; i++) {
+        char path[MAX_FILE_NAME], contents[32];
+        sprintf(path, "/f%d", i);
+        sprintf(contents, "instance %d file %d", id, i);
+        write_file(fs, path, contents);
+    }
+    for (int i = 0; i < FILES; i++) {
+        char path[MAX_FILE_NAME], contents[32];
+        sprintf(path, "/f%d", i);
+        sprintf(contents, "instance %d file %d", id, i);
+        check_file(fs, path, contents);
+    }
+    return NULL;
+}
+
+/* Checks that instances created with tfs_init_ctx are independent of each
+ * other and of the default instance, including when used from parallel
+ * threads.
+ */
+int main() {
+    tfs_params params = tfs_default_params();
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+    write_file(NULL, "/f0", "default instance");
+
+    params.max_inode_count = FILES + 1;
+    params.max_table_segments = 1; // so each table fills up
+    for (int i = 0; i < INSTANCES; i++) {
+        instances[i] = tfs_init_ctx(&params);
+        assert(instances[i] != NULL);
+    }
+
+    pthread_t tids[INSTANCES];
+    int ids[INSTANCES];
+    for (int i = 0; i < INSTANCES; i++) {
+        ids[i] = i;
+        assert(pthread_create(&tids[i], NULL, worker, &ids[i]) == 0);
+    }
+    for (int i = 0; i < INSTANCES; i++) {
+        assert(pthread_join(tids[i], NULL) == 0);
+    }
+
+    // Each instance has its own inode table (now full) and statistics
+    for (int i = 0; i < INSTANCES; i++) {
+        tfs_stats_t stats;
+        assert(tfs_stats_ctx(instances[i], &stats) != -1);
+        assert(stats.inodes_in_use == FILES + 1);
+        assert(tfs_open_ctx(instances[i], "/extra", TFS_O_CREAT) == -1);
+    }
+
+    // Handles belong to the instance that returned them
+    int fd = tfs_open_ctx(instances[0], "/f1", 0);
+    assert(fd != -1);
+    assert(tfs_close_ctx(instances[1], fd) == -1);
+    assert(tfs_close_ctx(instances[0], fd) != -1);
+
+    // The default instance is untouched
+    check_file(NULL, "/f0", "default instance");
+    assert(tfs_open("/f1", 0) == -1);
+
+    for (int i = 0; i < INSTANCES; i++) {
+        assert(tfs_destroy_ctx(instances[i]) != -1);
+    }
+    check_file(NULL, "/f0", "default instance");
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,111 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024 * 1024)
+#define CHUNK 4096
+
+static char volume[] = "/tmp/tfs_volume_XXXXXX";
+
+static size_t prefetched(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.readahead_bytes;
+}
+
+/* Reads a whole file in small chunks and returns the bytes prefetched. */
+static size_t replay(char const *path, char *data) {
+    size_t before = prefetched();
+    char chunk[CHUNK];
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    for (size_t offset = 0; offset < BLOCK_SIZE; offset += CHUNK) {
+        assert(tfs_read(fd, chunk, CHUNK) == CHUNK);
+        assert(memcmp(chunk, data + offset, CHUNK) == 0);
+    }
+    assert(tfs_close(fd) != -1);
+    return prefetched() - before;
+}
+
+/* Checks that sequential reads from a file-backed volume prefetch the rest of
+ * the file, a growing window at a time, and that a read after a write on the
+ * same handle starts over with a small window.
+ */
+int main() {
+    int vfd = mkstemp(volume);
+    assert(vfd != -1);
+    assert(close(vfd) == 0);
+
+    char *data = malloc(BLOCK_SIZE);
+    assert(data != NULL);
+    for (size_t i = 0; i < BLOCK_SIZE; i++) {
+        data[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 4;
+    params.volume_path = volume;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+
+    int fd = tfs_open("/box", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_syncfs() != -1);
+
+    // Everything after the first chunk is prefetched, exactly once
+    assert(replay("/box", data) == BLOCK_SIZE - CHUNK);
+
+    // The first window is small, and only refilled once it is half consumed
+    char chunk[CHUNK];
+    fd = tfs_open("/box", 0);
+    assert(fd != -1);
+    size_t before = prefetched();
+    assert(tfs_read(fd, chunk, CHUNK) == CHUNK);
+    assert(prefetched() - before == READAHEAD_MIN);
+    assert(tfs_read(fd, chunk, CHUNK) == CHUNK);
+    assert(prefetched() - before == READAHEAD_MIN);
+    assert(tfs_read(fd, chunk, CHUNK) == CHUNK);
+    assert(prefetched() - before == READAHEAD_MIN * 3); // then doubles
+
+    // A write breaks the sequential run
+    assert(tfs_write(fd, chunk, CHUNK) == CHUNK);
+    before = prefetched();
+    assert(tfs_read(fd, chunk, CHUNK) == CHUNK);
+    assert(prefetched() - before <= READAHEAD_MIN);
+    assert(tfs_close(fd) != -1);
+    assert(tfs_destroy() != -1);
+
+    // Disabled
+    params.readahead_max = 0;
+    assert(tfs_init(&params) != -1);
+    fd = tfs_open("/box", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+    assert(replay("/box", data) == 0);
+    assert(tfs_destroy() != -1);
+
+    // In-memory volumes have nothing to prefetch
+    params.readahead_max = tfs_default_params().readahead_max;
+    params.volume_path = NULL;
+    assert(tfs_init(&params) != -1);
+    fd = tfs_open("/box", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, data, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+    assert(replay("/box", data) == 0);
+    assert(tfs_destroy() != -1);
+
+    free(data);
+    assert(unlink(volume) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT 20
+#define BATCH 3
+#define CHURN_FILES 40 // with the files above, more than one directory block
+#define CHURN_LISTINGS 200
+
+static atomic_bool churning;
+
+/* Creates and unlinks files while the directory is being listed.
+ */
+static void *churn(void *arg) {
+    (void)arg;
+    while (atomic_load(&churning)) {
+        for (int i = 0; i < CHURN_FILES; i++) {
+            char path[MAX_FILE_NAME];
+            sprintf(path, "/churn%d", i);
+            int fd = tfs_open(path, TFS_O_CREAT);
+            assert(fd != -1);
+            assert(tfs_close(fd) != -1);
+        }
+        for (int i = 0; i < CHURN_FILES; i++) {
+            char path[MAX_FILE_NAME];
+            sprintf(path, "/churn%d", i);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+    return NULL;
+}
+
+/* Lists the root directory in small batches and checks every entry is
+ * returned exactly once, with the right type and size.
+ */
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/f%d", i);
+
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_write(fd, path, (size_t)i) == i);
+        assert(tfs_close(fd) != -1);
+    }
+    assert(tfs_sym_link("/f1", "/l1") != -1);
+
+    // Only the root directory can be listed
+    assert(tfs_opendir("/f1") == -1);
+
+    int dh = tfs_opendir("/");
+    assert(dh != -1);
+
+    // A directory handle cannot be used as a file, so the directory's
+    // entries cannot be overwritten through it
+    char junk[64];
+    memset(junk, 'x', sizeof(junk));
+    assert(tfs_write(dh, junk, sizeof(junk)) == -1);
+    assert(tfs_read(dh, junk, sizeof(junk)) == -1);
+    assert(tfs_fsync(dh) == -1);
+
+    int seen[FILE_COUNT] = {0};
+    int links_seen = 0;
+    tfs_dirent_t entries[BATCH];
+    ssize_t n;
+    while ((n = tfs_readdir(dh, entries, BATCH)) > 0) {
+        assert(n <= BATCH);
+        for (ssize_t e = 0; e < n; e++) {
+            if (strcmp(entries[e].d_name, "l1") == 0) {
+                assert(entries[e].d_type == TFS_DT_SOFT_LINK);
+                links_seen++;
+                continue;
+            }
+
+            int i;
+            assert(sscanf(entries[e].d_name, "f%d", &i) == 1);
+            assert(i >= 0 && i < FILE_COUNT);
+            assert(entries[e].d_type == TFS_DT_FILE);
+            assert(entries[e].d_size == (size_t)i);
+            seen[i]++;
+        }
+    }
+    assert(n == 0);
+    assert(links_seen == 1);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(seen[i] == 1);
+    }
+
+    assert(tfs_closedir(dh) != -1);
+    assert(tfs_readdir(dh, entries, BATCH) == -1);
+
+    // Listings running alongside creates and unlinks only ever see whole
+    // entries, and every file that stays put
+    atomic_store(&churning, true);
+    pthread_t tid;
+    assert(pthread_create(&tid, NULL, churn, NULL) == 0);
+    for (int l = 0; l < CHURN_LISTINGS; l++) {
+        int stable = 0;
+        dh = tfs_opendir("/");
+        assert(dh != -1);
+        while ((n = tfs_readdir(dh, entries, BATCH)) > 0) {
+            for (ssize_t e = 0; e < n; e++) {
+                int i;
+                char name[MAX_FILE_NAME];
+                if (sscanf(entries[e].d_name, "churn%d", &i) == 1) {
+                    assert(i >= 0 && i < CHURN_FILES);
+                    sprintf(name, "churn%d", i);
+                    assert(strcmp(entries[e].d_name, name) == 0);
+                    assert(entries[e].d_type == TFS_DT_FILE);
+                } else {
+                    stable++;
+                }
+            }
+        }
+        assert(n == 0);
+        assert(stable == FILE_COUNT + 1);
+        assert(tfs_closedir(dh) != -1);
+    }
+    atomic_store(&churning, false);
+    assert(pthread_join(tid, NULL) == 0);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
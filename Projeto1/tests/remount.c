@@ -0,0 +1,165 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 1024
+#define FILES 6 // more than one segment of inodes and of blocks
+
+static char volume[] = "/tmp/tfs_volume_XXXXXX";
+
+static tfs_stats_t stats(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats;
+}
+
+static void write_file(char const *path, char const *contents) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, strlen(contents)) == strlen(contents));
+    assert(tfs_close(fd) != -1);
+}
+
+static void check_file(char const *path, char const *contents) {
+    char buffer[BLOCK_SIZE];
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) == strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Runs `work` on the volume in a child that exits without tfs_destroy, as if
+ * the process had crashed.
+ */
+static void crash_after(tfs_params const *params, void (*work)(void)) {
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        assert(tfs_init(params) != -1);
+        work();
+        _exit(0);
+    }
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void create_synced(void) {
+    int fd = tfs_open("/synced", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "kept", 4) == 4);
+    assert(tfs_fsync(fd) != -1);
+}
+
+static void create_unsynced(void) {
+    int fd = tfs_open("/unsynced", TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, "lost", 4) == 4);
+}
+
+/* Checks that a file-backed volume is mounted again by tfs_init, with its
+ * files, links and contents, and that volumes of another geometry are refused.
+ */
+int main() {
+    int vfd = mkstemp(volume);
+    assert(vfd != -1);
+    assert(close(vfd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = 4;
+    params.max_block_count = 4;
+    params.max_table_segments = 4;
+    params.volume_path = volume;
+    params.access_delay = 0;
+    assert(tfs_init(&params) != -1);
+
+    char path[MAX_FILE_NAME], contents[MAX_FILE_NAME];
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%d", i);
+        sprintf(contents, "file %d", i);
+        write_file(path, contents);
+    }
+    assert(tfs_link("/f0", "/hard") != -1);
+    assert(tfs_sym_link("/f1", "/soft") != -1);
+    assert(tfs_unlink("/f2") != -1);
+    tfs_stats_t before = stats();
+    assert(tfs_destroy() != -1);
+
+    // Everything comes back, without the root directory being created anew
+    assert(tfs_init(&params) != -1);
+    tfs_stats_t after = stats();
+    assert(after.inodes_in_use == before.inodes_in_use);
+    assert(after.blocks_in_use == before.blocks_in_use);
+    for (int i = 0; i < FILES; i++) {
+        sprintf(path, "/f%d", i);
+        sprintf(contents, "file %d", i);
+        if (i == 2) {
+            assert(tfs_open(path, 0) == -1);
+        } else {
+            check_file(path, contents);
+        }
+    }
+    check_file("/hard", "file 0");
+    check_file("/soft", "file 1");
+
+    // Link counts were recounted: /f0 outlives one of its names
+    assert(tfs_unlink("/f0") != -1);
+    check_file("/hard", "file 0");
+    write_file("/f1", "rewritten");
+    assert(tfs_syncfs() != -1);
+    assert(tfs_destroy() != -1);
+
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/f0", 0) == -1);
+    check_file("/hard", "file 0");
+    check_file("/soft", "rewritten");
+    assert(tfs_destroy() != -1);
+
+    // After a crash, a file synced with tfs_fsync is there; an unsynced one
+    // is not, even if its name reached the volume
+    crash_after(&params, create_synced);
+    crash_after(&params, create_unsynced);
+    assert(tfs_init(&params) != -1);
+    check_file("/synced", "kept");
+    assert(tfs_open("/unsynced", 0) == -1);
+    check_file("/hard", "file 0");
+    assert(tfs_destroy() != -1);
+
+    // Another geometry is refused, and the volume left as it was
+    params.block_size = 2 * BLOCK_SIZE;
+    assert(tfs_init(&params) == -1);
+    params.block_size = BLOCK_SIZE;
+    params.max_inode_count = 8;
+    assert(tfs_init(&params) == -1);
+    params.max_inode_count = 4;
+    assert(tfs_init(&params) != -1);
+    check_file("/hard", "file 0");
+    assert(tfs_destroy() != -1);
+
+    // So is a file holding something else
+    vfd = open(volume, O_WRONLY | O_TRUNC);
+    assert(vfd != -1);
+    assert(write(vfd, "not a volume", 12) == 12);
+    assert(close(vfd) == 0);
+    assert(tfs_init(&params) == -1);
+
+    // An empty file is formatted
+    assert(truncate(volume, 0) == 0);
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/hard", 0) == -1);
+    assert(stats().inodes_in_use == 1);
+    assert(tfs_destroy() != -1);
+
+    assert(unlink(volume) == 0);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,148 @@
+#include "../fs/operations.h"
+#include "../fs/ring.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT 12
+#define RING_ENTRIES 8
+#define RING_WORKERS 4
+
+/* Submits every operation of a phase (possibly in several partial batches,
+ * as the ring holds fewer entries than there are files) and waits for all of
+ * them, storing each result at the index carried in user_data.
+ */
+static void run_phase(tfs_ring_t *ring, tfs_sqe_t *sqes, ssize_t *results) {
+    size_t submitted = 0;
+    size_t completed = 0;
+
+    while (completed < FILE_COUNT) {
+        ssize_t n = tfs_ring_submit(ring, sqes + submitted,
+                                    FILE_COUNT - submitted);
+        assert(n >= 0);
+        submitted += (size_t)n;
+
+        tfs_cqe_t cqes[RING_ENTRIES];
+        ssize_t reaped = tfs_ring_reap(ring, cqes, RING_ENTRIES, 1);
+        assert(reaped >= 1);
+        for (ssize_t i = 0; i < reaped; i++) {
+            results[(uintptr_t)cqes[i].user_data] = cqes[i].result;
+        }
+        completed += (size_t)reaped;
+    }
+    assert(submitted == FILE_COUNT);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    tfs_ring_t ring;
+    assert(tfs_ring_init(&ring, RING_ENTRIES, RING_WORKERS) != -1);
+
+    char paths[FILE_COUNT][MAX_FILE_NAME];
+    char buffers[FILE_COUNT][MAX_FILE_NAME];
+    tfs_sqe_t sqes[FILE_COUNT];
+    ssize_t fds[FILE_COUNT];
+    ssize_t results[FILE_COUNT];
+
+    // Nothing in flight: waiting would never return
+    tfs_cqe_t cqe;
+    assert(tfs_ring_reap(&ring, &cqe, 1, 1) == -1);
+
+    // Create
+    for (int i = 0; i < FILE_COUNT; i++) {
+        sprintf(paths[i], "/ring%d", i);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_OPEN,
+                              .name = paths[i],
+                              .mode = TFS_O_CREAT,
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, fds);
+
+    // Write the path into each file
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(fds[i] != -1);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_WRITE,
+                              .fhandle = (int)fds[i],
+                              .buffer = paths[i],
+                              .len = strlen(paths[i]) + 1,
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, results);
+
+    // Close, then reopen for reading
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] == (ssize_t)(strlen(paths[i]) + 1));
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_CLOSE,
+                              .fhandle = (int)fds[i],
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, results);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] == 0);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_OPEN,
+                              .name = paths[i],
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, fds);
+
+    // Read back
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(fds[i] != -1);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_READ,
+                              .fhandle = (int)fds[i],
+                              .buffer = buffers[i],
+                              .len = MAX_FILE_NAME,
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, results);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] == (ssize_t)(strlen(paths[i]) + 1));
+        assert(strcmp(buffers[i], paths[i]) == 0);
+        assert(tfs_close((int)fds[i]) != -1);
+    }
+
+    // Unlink
+    for (int i = 0; i < FILE_COUNT; i++) {
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_UNLINK,
+                              .name = paths[i],
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, results);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] == 0);
+        assert(tfs_open(paths[i], 0) == -1);
+    }
+
+    assert(tfs_ring_destroy(&ring) != -1);
+
+    // A ring on another instance works on that instance's files and handles
+    tfs_t *fs = tfs_init_ctx(NULL);
+    assert(fs != NULL);
+    assert(tfs_ring_init_ctx(&ring, fs, RING_ENTRIES, RING_WORKERS) != -1);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        int fd = tfs_open_ctx(fs, paths[i], TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_close_ctx(fs, fd) != -1);
+        sqes[i] = (tfs_sqe_t){.op = TFS_OP_OPEN,
+                              .name = paths[i],
+                              .mode = 0,
+                              .user_data = (void *)(uintptr_t)i};
+    }
+    run_phase(&ring, sqes, results);
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(results[i] != -1);
+        assert(tfs_close_ctx(fs, (int)results[i]) != -1);
+        // the default instance has none of them
+        assert(tfs_open(paths[i], 0) == -1);
+    }
+    assert(tfs_ring_destroy(&ring) != -1);
+    assert(tfs_destroy_ctx(fs) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE 1024
+#define READERS 4
+#define REWRITES 50000
+
+static char const *path = "/box";
+static bool writer_done;
+
+/* Rewrites the whole file over and over, each time filled with one letter. */
+static void *writer(void *arg) {
+    (void)arg;
+    char block[BLOCK_SIZE];
+    for (int i = 0; i < REWRITES; i++) {
+        memset(block, 'a' + i % 26, BLOCK_SIZE);
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_write(fd, block, BLOCK_SIZE) == BLOCK_SIZE);
+        assert(tfs_close(fd) != -1);
+    }
+    __atomic_store_n(&writer_done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Reads never see a mix of two rewrites, even with no lock between them and
+ * the writer.
+ */
+static void *reader(void *arg) {
+    (void)arg;
+    char block[BLOCK_SIZE];
+    while (!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE)) {
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+        assert(tfs_read(fd, block, BLOCK_SIZE) == BLOCK_SIZE);
+        for (size_t i = 1; i < BLOCK_SIZE; i++) {
+            assert(block[i] == block[0]);
+        }
+        assert(tfs_close(fd) != -1);
+    }
+    return NULL;
+}
+
+/* Checks that optimistic (lock-free) readers always get a consistent snapshot
+ * of a file being rewritten, including when dedup swaps its block on every
+ * rewrite.
+ */
+int main() {
+    tfs_params params = tfs_default_params();
+    params.access_delay = 0;
+    params.dedup = true;
+    params.compress_interval_ms = 0;
+    assert(tfs_init(&params) != -1);
+
+    char block[BLOCK_SIZE];
+    memset(block, 'z', BLOCK_SIZE);
+    int fd = tfs_open(path, TFS_O_CREAT);
+    assert(fd != -1);
+    assert(tfs_write(fd, block, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(fd) != -1);
+
+    pthread_t writer_tid, reader_tids[READERS];
+    assert(pthread_create(&writer_tid, NULL, writer, NULL) == 0);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_create(&reader_tids[i], NULL, reader, NULL) == 0);
+    }
+    assert(pthread_join(writer_tid, NULL) == 0);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_join(reader_tids[i], NULL) == 0);
+    }
+
+    // Reads from a handle opened before a truncation see an empty file
+    fd = tfs_open(path, 0);
+    assert(fd != -1);
+    int fd_trunc = tfs_open(path, TFS_O_TRUNC);
+    assert(fd_trunc != -1);
+    assert(tfs_read(fd, block, BLOCK_SIZE) == 0);
+    assert(tfs_close(fd_trunc) != -1);
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
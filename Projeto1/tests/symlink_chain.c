@@ -0,0 +1,85 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+static void write_file(char const *path, char const *contents) {
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(fd != -1);
+    assert(tfs_write(fd, contents, strlen(contents) + 1) ==
+           (ssize_t)(strlen(contents) + 1));
+    assert(tfs_close(fd) != -1);
+}
+
+static void assert_contents(char const *path, char const *contents) {
+    char buffer[MAX_FILE_NAME];
+    int fd = tfs_open(path, 0);
+    assert(fd != -1);
+    assert(tfs_read(fd, buffer, sizeof(buffer)) ==
+           (ssize_t)(strlen(contents) + 1));
+    assert(strcmp(buffer, contents) == 0);
+    assert(tfs_close(fd) != -1);
+}
+
+/* Chains of soft links are followed, their cached targets are dropped when
+ * the target is unlinked or recreated, and loops/long chains are rejected.
+ */
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // Chain /l3 -> /l2 -> /l1 -> /f
+    write_file("/f", "first");
+    assert(tfs_sym_link("/f", "/l1") != -1);
+    assert(tfs_sym_link("/l1", "/l2") != -1);
+    assert(tfs_sym_link("/l2", "/l3") != -1);
+    assert_contents("/l3", "first");
+    assert_contents("/l3", "first"); // served from the cached targets
+
+    // Unlinking the target invalidates the cache
+    assert(tfs_unlink("/f") != -1);
+    assert(tfs_open("/l3", 0) == -1);
+
+    // Recreating the target is picked up
+    write_file("/f", "second");
+    assert_contents("/l3", "second");
+
+    // Unlinking a name of a file that still has other hard links
+    write_file("/g", "hard");
+    assert(tfs_link("/g", "/h") != -1);
+    assert(tfs_sym_link("/g", "/lg") != -1);
+    assert_contents("/lg", "hard");
+    assert(tfs_unlink("/g") != -1);
+    assert(tfs_open("/lg", 0) == -1);
+    assert_contents("/h", "hard");
+
+    // Removing an intermediate link breaks the chain
+    assert(tfs_unlink("/l2") != -1);
+    assert(tfs_open("/l3", 0) == -1);
+    assert_contents("/l1", "second");
+
+    // Loop: /a -> /la -> /a
+    write_file("/a", "loop");
+    assert(tfs_sym_link("/a", "/la") != -1);
+    assert(tfs_unlink("/a") != -1);
+    assert(tfs_sym_link("/la", "/a") != -1);
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_open("/la", 0) == -1);
+
+    // Chains longer than MAX_SYMLINK_HOPS are rejected
+    write_file("/t", "deep");
+    char prev[MAX_FILE_NAME] = "/t";
+    for (int i = 0; i < MAX_SYMLINK_HOPS + 1; i++) {
+        char name[MAX_FILE_NAME];
+        sprintf(name, "/d%d", i);
+        assert(tfs_sym_link(prev, name) != -1);
+        strcpy(prev, name);
+    }
+    assert_contents("/d7", "deep");
+    assert(tfs_open("/d8", 0) == -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -39,6 +39,7 @@ int main() {
     tfs_params params = tfs_default_params();
     params.max_inode_count = 4;
     params.max_block_count = 2;
+    params.max_table_segments = 1;
     assert(tfs_init(&params) != -1);
 
     // create file with content
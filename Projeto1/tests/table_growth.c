@@ -0,0 +1,110 @@
+#include "../fs/operations.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT 12
+#define DIR_FILE_COUNT 100 // several blocks' worth of directory entries
+#define READDIR_BATCH 7
+
+/* Opens more files than the initial tables hold, so the inode table, data
+ * region and open file table all have to grow while earlier handles stay open.
+ */
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2;
+    params.max_block_count = 2;
+    params.max_open_files_count = 2;
+    params.max_table_segments = 8;
+    assert(tfs_init(&params) != -1);
+
+    int fds[FILE_COUNT];
+    for (int i = 0; i < FILE_COUNT; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/f%d", i);
+
+        fds[i] = tfs_open(path, TFS_O_CREAT);
+        assert(fds[i] != -1);
+        assert(tfs_write(fds[i], path, strlen(path) + 1) ==
+               (ssize_t)(strlen(path) + 1));
+    }
+
+    // Handles and blocks obtained before each growth are still valid
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(tfs_close(fds[i]) != -1);
+
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/f%d", i);
+
+        int fd = tfs_open(path, 0);
+        assert(fd != -1);
+
+        char buffer[MAX_FILE_NAME];
+        assert(tfs_read(fd, buffer, sizeof(buffer)) ==
+               (ssize_t)(strlen(path) + 1));
+        assert(strcmp(buffer, path) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    // Without growth, the tables keep their initial size
+    params.max_table_segments = 1;
+    assert(tfs_init(&params) != -1);
+    assert(tfs_open("/a", TFS_O_CREAT) != -1);
+    assert(tfs_open("/b", TFS_O_CREAT) == -1); // root dir + /a fill the table
+    assert(tfs_destroy() != -1);
+
+    // The root directory grows past a single block of entries
+    assert(tfs_init(NULL) != -1);
+    for (int i = 0; i < DIR_FILE_COUNT; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/d%d", i);
+
+        int fd = tfs_open(path, TFS_O_CREAT);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+
+    // Every entry is listed exactly once, across batches spanning blocks
+    bool seen[DIR_FILE_COUNT] = {false};
+    int dh = tfs_opendir("/");
+    assert(dh != -1);
+    tfs_dirent_t entries[READDIR_BATCH];
+    ssize_t n;
+    int listed = 0;
+    while ((n = tfs_readdir(dh, entries, READDIR_BATCH)) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            int index;
+            assert(sscanf(entries[i].d_name, "d%d", &index) == 1);
+            assert(index >= 0 && index < DIR_FILE_COUNT && !seen[index]);
+            seen[index] = true;
+            listed++;
+        }
+    }
+    assert(n == 0);
+    assert(listed == DIR_FILE_COUNT);
+    assert(tfs_closedir(dh) != -1);
+
+    // Entries freed in any block are found again and reused
+    for (int i = 0; i < DIR_FILE_COUNT; i += 2) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/d%d", i);
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_open(path, 0) == -1);
+    }
+    for (int i = 0; i < DIR_FILE_COUNT; i++) {
+        char path[MAX_FILE_NAME];
+        sprintf(path, "/d%d", i);
+
+        int fd = tfs_open(path, i % 2 == 0 ? TFS_O_CREAT : 0);
+        assert(fd != -1);
+        assert(tfs_close(fd) != -1);
+    }
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
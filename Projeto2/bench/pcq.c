@@ -0,0 +1,129 @@
+#include "producer-consumer.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_ITEMS 200000
+#define DEFAULT_CAPACITY 64
+#define MAX_THREADS 64
+
+static size_t items = DEFAULT_ITEMS;
+static pc_queue_t queue;
+
+typedef struct {
+    size_t count;    // items this thread enqueues or dequeues
+    double latency;  // sum of enqueue-to-dequeue latencies (consumers)
+    double worst;
+} worker_t;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Each item is the time it was enqueued at (a heap copy, freed by the
+ * consumer), so consumers can measure how long it waited in the queue.
+ */
+static void *producer(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    for (size_t i = 0; i < w->count; i++) {
+        double *stamp = malloc(sizeof(double));
+        assert(stamp != NULL);
+        *stamp = now();
+        assert(pcq_enqueue(&queue, stamp) == 0);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    worker_t *w = (worker_t *)arg;
+    for (size_t i = 0; i < w->count; i++) {
+        double *stamp = pcq_dequeue(&queue);
+        assert(stamp != NULL);
+        double waited = now() - *stamp;
+        w->latency += waited;
+        if (waited > w->worst) {
+            w->worst = waited;
+        }
+        free(stamp);
+    }
+    return NULL;
+}
+
+static void run(size_t producers, size_t consumers, size_t capacity) {
+    assert(pcq_create(&queue, capacity) == 0);
+
+    pthread_t tids[2 * MAX_THREADS];
+    worker_t workers[2 * MAX_THREADS];
+    size_t threads = producers + consumers;
+    for (size_t t = 0; t < threads; t++) {
+        // Items split evenly, remainder to the first threads of each side
+        size_t side = t < producers ? producers : consumers;
+        size_t index = t < producers ? t : t - producers;
+        workers[t] = (worker_t){.count = items / side +
+                                         (index < items % side ? 1 : 0)};
+    }
+
+    double start = now();
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_create(&tids[t], NULL,
+                              t < producers ? producer : consumer,
+                              &workers[t]) == 0);
+    }
+    for (size_t t = 0; t < threads; t++) {
+        assert(pthread_join(tids[t], NULL) == 0);
+    }
+    double elapsed = now() - start;
+
+    double latency = 0, worst = 0;
+    for (size_t t = producers; t < threads; t++) {
+        latency += workers[t].latency;
+        if (workers[t].worst > worst) {
+            worst = workers[t].worst;
+        }
+    }
+    printf("%3zu producers, %3zu consumers: %8.3f M items/s, latency avg "
+           "%8.2f us, max %9.2f us\n",
+           producers, consumers, (double)items / elapsed / 1e6,
+           latency / (double)items * 1e6, worst * 1e6);
+
+    assert(pcq_destroy(&queue) == 0);
+}
+
+/* Measures queue throughput and enqueue-to-dequeue latency for several
+ * producer/consumer counts.
+ *
+ * Usage: pcq [max threads per side] [items] [capacity]
+ */
+int main(int argc, char **argv) {
+    size_t max_threads = 8;
+    size_t capacity = DEFAULT_CAPACITY;
+    if (argc > 1) {
+        max_threads = strtoul(argv[1], NULL, 10);
+    }
+    if (argc > 2) {
+        items = strtoul(argv[2], NULL, 10);
+    }
+    if (argc > 3) {
+        capacity = strtoul(argv[3], NULL, 10);
+    }
+    if (max_threads == 0 || max_threads > MAX_THREADS || items == 0 ||
+        capacity == 0) {
+        fprintf(stderr, "usage: pcq [max threads per side (1-%d)] [items] "
+                        "[capacity]\n",
+                MAX_THREADS);
+        return 1;
+    }
+
+    for (size_t producers = 1; producers <= max_threads; producers *= 2) {
+        for (size_t consumers = 1; consumers <= max_threads; consumers *= 2) {
+            run(producers, consumers, capacity);
+        }
+    }
+    return 0;
+}
@@ -148,7 +148,7 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 
     // Finally, add entry to the open file table and return the corresponding
     // handle
-    int ret = add_to_open_file_table(inum, offset);
+    int ret = add_to_open_file_table(inum, offset, (mode & TFS_O_APPEND) != 0);
     if (pthread_mutex_unlock(&g_library_mutex) == -1) {
         WARN("failed to unlock mutex: %s", strerror(errno));
         return -1;
@@ -201,6 +201,12 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
     inode_t *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
 
+    // Append handles write at the current end of the file, wherever other
+    // handles (e.g. other publishers of the same box) left it
+    if (file->of_append) {
+        file->of_offset = inode->i_size;
+    }
+
     // Determine how many bytes to write
     size_t block_size = state_block_size();
     if (to_write + file->of_offset > block_size) {
@@ -33,7 +33,10 @@ static allocation_state_t *free_open_file_entries;
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+// Directory entries held by each block of a directory; the blocks of a
+// directory are chained, the last sizeof(int) bytes of each one holding the
+// number of the next block (-1 in the last one)
+#define MAX_DIR_ENTRIES ((BLOCK_SIZE - sizeof(int)) / sizeof(dir_entry_t))
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
@@ -178,6 +181,50 @@ static int inode_alloc(void) {
     return -1;
 }
 
+/**
+ * Obtain the number of the block following a directory block in its chain.
+ *
+ * Input:
+ *   - dir_entry: entries of the directory block
+ *
+ * Returns the next block number, or -1 if this is the last block.
+ */
+static int dir_block_next(dir_entry_t const *dir_entry) {
+    int next;
+    memcpy(&next, (char const *)dir_entry + BLOCK_SIZE - sizeof(int),
+           sizeof(int));
+    return next;
+}
+
+/**
+ * Set the block following a directory block in its chain.
+ *
+ * Input:
+ *   - dir_entry: entries of the directory block
+ *   - next: the next block number, or -1 to end the chain there
+ */
+static void dir_block_set_next(dir_entry_t *dir_entry, int next) {
+    memcpy((char *)dir_entry + BLOCK_SIZE - sizeof(int), &next, sizeof(int));
+}
+
+/**
+ * Fill a directory block with empty entries (labeled with inumber==-1), ending
+ * the chain there.
+ *
+ * Input:
+ *   - block_number: the block to initialize
+ */
+static void dir_block_init(int block_number) {
+    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(block_number);
+    ALWAYS_ASSERT(dir_entry != NULL, "dir_block_init: invalid block");
+
+    memset(dir_entry, 0, BLOCK_SIZE);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        dir_entry[i].d_inumber = -1;
+    }
+    dir_block_set_next(dir_entry, -1);
+}
+
 /**
  * Create a new inode in the inode table.
  *
@@ -207,8 +254,8 @@ int inode_create(inode_type i_type) {
     inode->i_node_type = i_type;
     switch (i_type) {
     case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
+        // Initializes directory (with a single block of empty entries, labeled
+        // with inumber==-1); more blocks are chained as it fills up
         int b = data_block_alloc();
         if (b == -1) {
             // ensure fields are initialized
@@ -222,14 +269,7 @@ int inode_create(inode_type i_type) {
 
         inode_table[inumber].i_size = BLOCK_SIZE;
         inode_table[inumber].i_data_block = b;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
+        dir_block_init(b);
     } break;
     case T_FILE:
         // In case of a new file, simply sets its size to 0
@@ -259,7 +299,14 @@ void inode_delete(int inumber) {
     ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
                   "inode_delete: inode already freed");
 
-    if (inode_table[inumber].i_size > 0) {
+    if (inode_table[inumber].i_node_type == T_DIRECTORY) {
+        // frees the whole chain of directory blocks
+        for (int b = inode_table[inumber].i_data_block; b != -1;) {
+            int next = dir_block_next((dir_entry_t *)data_block_get(b));
+            data_block_free(b);
+            b = next;
+        }
+    } else if (inode_table[inumber].i_size > 0) {
         data_block_free(inode_table[inumber].i_data_block);
     }
 
@@ -300,17 +347,20 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
+    // Walks the blocks containing the entries of the directory
+    for (int b = inode->i_data_block; b != -1;) {
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "clear_dir_entry: directory must have a data block");
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (!strcmp(dir_entry[i].d_name, sub_name)) {
+                dir_entry[i].d_inumber = -1;
+                memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
+                return 0;
+            }
         }
+        b = dir_block_next(dir_entry);
     }
     return -1; // sub_name not found
 }
@@ -328,7 +378,7 @@ int clear_dir_entry(inode_t *inode, char const *sub_name) {
  * Possible errors:
  *   - inode is not a directory inode.
  *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - Every block of the directory is full, and no block is left to chain.
  */
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
     if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
@@ -340,23 +390,46 @@ int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
+    // Finds the first empty entry, walking the blocks of the directory
+    int b = inode->i_data_block;
+    dir_entry_t *dir_entry = NULL;
+    size_t i = MAX_DIR_ENTRIES;
+    for (;;) {
+        dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "add_dir_entry: directory must have a data block");
 
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+        for (i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (dir_entry[i].d_inumber == -1) {
+                break;
+            }
+        }
+        int next = dir_block_next(dir_entry);
+        if (i < MAX_DIR_ENTRIES || next == -1) {
+            break;
+        }
+        b = next;
+    }
 
-            return 0;
+    if (i == MAX_DIR_ENTRIES) {
+        // Every block is full: chain a new one after the last
+        int next = data_block_alloc();
+        if (next == -1) {
+            return -1; // no space for entry
         }
+        dir_block_init(next);
+        dir_block_set_next(dir_entry, next);
+        inode->i_size += BLOCK_SIZE;
+
+        dir_entry = (dir_entry_t *)data_block_get(next);
+        i = 0;
     }
 
-    return -1; // no space for entry
+    dir_entry[i].d_inumber = sub_inumber;
+    strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
+    dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+
+    return 0;
 }
 
 /**
@@ -381,20 +454,22 @@ int find_in_dir(inode_t const *inode, char const *sub_name) {
         return -1; // not a directory
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
+    // Iterates over the entries of each block of the directory looking for one
+    // that has the target name
+    for (int b = inode->i_data_block; b != -1;) {
+        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
+        ALWAYS_ASSERT(dir_entry != NULL,
+                      "find_in_dir: directory inode must have a data block");
 
-    // Iterates over the directory entries looking for one that has the target
-    // name
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++)
+            if ((dir_entry[i].d_inumber != -1) &&
+                (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
-        }
+                int sub_inumber = dir_entry[i].d_inumber;
+                return sub_inumber;
+            }
+        b = dir_block_next(dir_entry);
+    }
 
     return -1; // entry not found
 }
@@ -459,18 +534,20 @@ void *data_block_get(int block_number) {
  * Input:
  *   - inumber: inode number of the file to open
  *   - offset: initial offset
+ *   - append: whether writes go to the end of the file (TFS_O_APPEND)
  *
  * Returns file handle if successful, -1 otherwise.
  *
  * Possible errors:
  *   - No space in open file table for a new open file.
  */
-int add_to_open_file_table(int inumber, size_t offset) {
+int add_to_open_file_table(int inumber, size_t offset, bool append) {
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         if (free_open_file_entries[i] == FREE) {
             free_open_file_entries[i] = TAKEN;
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
+            open_file_table[i].of_append = append;
 
             return i;
         }
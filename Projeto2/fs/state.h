@@ -35,10 +35,12 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 
 /**
  * Open file entry (in open file table)
+ * of_append - opened with TFS_O_APPEND: every write goes to the end of the file
  */
 typedef struct {
     int of_inumber;
     size_t of_offset;
+    bool of_append;
 } open_file_entry_t;
 
 int state_init(tfs_params);
@@ -58,7 +60,7 @@ int data_block_alloc(void);
 void data_block_free(int block_number);
 void *data_block_get(int block_number);
 
-int add_to_open_file_table(int inumber, size_t offset);
+int add_to_open_file_table(int inumber, size_t offset, bool append);
 void remove_from_open_file_table(int fhandle);
 open_file_entry_t *get_open_file_entry(int fhandle);
 
@@ -12,198 +12,206 @@
 #include <unistd.h>
 #include <signal.h>
 #include "logging.h"
-#include "send_msg.h"
-
-#define CLIENT_PIPE_NAME_SIZE (256)
-#define MESSAGE_SIZE (1+256+32)
+#include "protocol.h"
 
 
 static void print_usage() {
     fprintf(stderr, "usage: \n"
-                    "   manager <register_pipe_name> create <box_name>\n"
-                    "   manager <register_pipe_name> remove <box_name>\n"
-                    "   manager <register_pipe_name> list\n");
+                    "   manager <register_pipe_name> <pipe_name> create <box_name> [drop|block|disconnect [queue_length]]\n"
+                    "   manager <register_pipe_name> <pipe_name> remove <box_name>\n"
+                    "   manager <register_pipe_name> <pipe_name> list\n");
 }
 
-int main(int argc, char **argv) {
-    
-    
-    // Check if the correct number of arguments are passed in and Print usage if not and return an error code
-    if (argc < 4) {
-        print_usage();
-        return 1;
-    }
-
-    char *register_pipe_name = argv[1]; // name of the pipe to register to mbroker
-    char *operation = argv[2]; // operation to be performed (create/remove)
-    char *box_name = argv[3]; // name of the box
-    
-    // Open the client pipe for reading
-    char client_pipe_name[CLIENT_PIPE_NAME_SIZE];
-    int client_pipe = mkfifo(client_pipe_name, 0640);
-    if (client_pipe == -1) {
-        fprintf(stderr, "[ERR]: mkfifo failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
-    }
+// Orders box listing entries by name
+static int compare_entries(const void *a, const void *b) {
+    const box_entry_t *entry_a = a;
+    const box_entry_t *entry_b = b;
+    return strcmp(entry_a->box_name, entry_b->box_name);
+}
 
-    // Send request to mbroker
+// Sends a request to mbroker; the response arrives on the client pipe
+static void send_request(const char *register_pipe_name, const void *frame, size_t len) {
     int register_pipe = open(register_pipe_name, O_WRONLY);
     if (register_pipe == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
-
-    if (strcmp(operation, "create") == 0) {
-        
-        // Code for creating a box
-        uint8_t code = 3;
-        
-        // Construct the message to be sent to the server
-        char message[MESSAGE_SIZE];
-        snprintf(message, MESSAGE_SIZE, "%d %s %s", code, client_pipe_name, box_name);
-        
-        // Send the message to the server
-        send_msg(register_pipe, message);
-
-        // Open the pipe for reading
-        int rx = open(client_pipe_name, O_RDONLY);
-        if (rx == -1) {
-            fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-    char buffer[MESSAGE_SIZE];
-    ssize_t ret = read(rx, buffer, MESSAGE_SIZE - 1);
-    if (ret < 0) {
-    // read function returned an error, print the error message and exit the program
-    fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
-    exit(EXIT_FAILURE);
+    if (write_frame(register_pipe, frame, len) == -1) {
+        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(register_pipe);
 }
 
-    uint8_t response_code = buffer[0];  //Read the first byte of the buffer, which contains the response code.
-    if (response_code == 4) { //Check if the response code is 4, which indicates a successful request
-    
-    // Extract the return code and error message from the buffer
-    int32_t return_code;
-    char error_message[1024];
-    
-    // Extract the return code and error message from the buffer
-    sscanf(buffer + sizeof(uint8_t), "%d %s", &return_code, error_message); 
-        
-        // If the return code is 0, this means the request was successful
-        if (return_code == 0) {
-        fprintf(stdout, "OK\n"); 
-        } 
-        else {
-            // If the return code is not 0, print out the error message
-            fprintf(stdout, "ERROR %s\n", error_message); 
-            }
-        }
-
-        close(rx); // close the reading pipe
-
-    } else if (strcmp(operation, "remove") == 0) {
-        // Send request to mbroker
-        int register_pipe = open(register_pipe_name, O_WRONLY);
-        if (register_pipe == -1) {
-            fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        // Remove box code
-        uint8_t code = 5; 
-        char message[MESSAGE_SIZE];
-        // [ code = 5 (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ]
-        snprintf(message, MESSAGE_SIZE, "%d %s %s", code, client_pipe_name, box_name);
-        send_msg(register_pipe, message);
-
-        // Open the pipe for reading
-        int rx = open(client_pipe_name, O_RDONLY);
-        if (rx == -1) {
-            fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        }
-
-        // Read response from server
-        char buffer[MESSAGE_SIZE];
-        ssize_t ret = read(rx, buffer, MESSAGE_SIZE - 1);
-        if (ret < 0) {
-            fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        } 
-        buffer[ret] = 0;
+// Sends a box creation or removal request and prints the result
+static int box_operation(const char *register_pipe_name, const char *client_pipe_name, const void *request, size_t len) {
+    send_request(register_pipe_name, request, len);
 
-        // Extract the return code and error message from the buffer
-        uint8_t message_code = buffer[0];
-        int32_t return_code = *((int32_t *)(buffer + sizeof(uint8_t)));
-        char *error_message = buffer + sizeof(uint8_t) + sizeof(int32_t);
+    // Open the pipe for reading
+    int rx = open(client_pipe_name, O_RDONLY);
+    if (rx == -1) {
+        fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        return -1;
+    }
 
-        if (message_code == 4 && return_code == 0) {
-            fprintf(stdout, "OK\n");
-        } else {
-            fprintf(stdout, "ERROR %s\n", error_message);
-        }
+    // [ code (uint8_t) ] | [ return_code (int32_t) ] | [ error_message (char[1024]) ]
+    box_response_t frame;
+    ssize_t ret = read_frame(rx, &frame, BOX_RESPONSE_SIZE);
+    close(rx);
+    if (ret <= 0) {
+        fprintf(stderr, "[ERR]: read failed: %s\n", ret == 0 ? "no response" : strerror(errno));
+        return -1;
+    }
+    box_response_t *response = decode_box_response(&frame, (size_t)ret);
+    if (response == NULL) {
+        fprintf(stderr, "[ERR]: unexpected response code %d\n", frame.code);
+        return -1;
+    }
 
-        close(rx);
-        close(register_pipe);
-        unlink(client_pipe_name);
-    } else if (strcmp(operation, "list") == 0) {
-    // Send request to mbroker
-    int register_pipe = open(register_pipe_name, O_WRONLY);
-    if (register_pipe == -1) {
-        fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+    // If the return code is 0, this means the request was successful
+    if (response->return_code == 0) {
+        fprintf(stdout, "OK\n");
+    } else {
+        fprintf(stdout, "ERROR %s\n", response->error_message);
     }
-    // Send request to mbroker
-    uint8_t code = 7;
-    char message[MESSAGE_SIZE];
+    return 0;
+}
+
+// Lists the boxes, sorted by name
+static int list_boxes(const char *register_pipe_name, const char *client_pipe_name) {
     // [ code = 7 (uint8_t) ] | [ client_named_pipe_path (char[256]) ]
-    snprintf(message, MESSAGE_SIZE, "%d %s", code, client_pipe_name);
-    send_msg(register_pipe, message);
+    list_request_t request;
+    size_t len = encode_list_request(&request, client_pipe_name);
+    send_request(register_pipe_name, &request, len);
+
     // Open the pipe for reading
     int rx = open(client_pipe_name, O_RDONLY);
     if (rx == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
-        exit(EXIT_FAILURE);
+        return -1;
     }
 
-    // Print out the list of boxes
-    char buffer[MESSAGE_SIZE];
-    ssize_t ret;
-    int box_count = 0;
+    // Collect the entries until the one flagged as last; the broker does not
+    // send them in any particular order
+    box_entry_t *entries = NULL;
+    size_t box_count = 0;
+    size_t capacity = 0;
     while (true) {
-        ret = read(rx, buffer, MESSAGE_SIZE - 1);
+        box_entry_t frame;
+        ssize_t ret = read_frame(rx, &frame, BOX_ENTRY_SIZE);
         if (ret < 0) {
             fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
-        } 
-        else if (ret == 0) {
+            break;
+        } else if (ret == 0) {
             break;
         }
-
-        buffer[ret] = 0;
-
-        // Check if the message is the end of list message
-        if (strcmp(buffer, "/0") == 0) {
+        box_entry_t *entry = decode_box_entry(&frame, (size_t)ret);
+        if (entry == NULL) {
+            fprintf(stderr, "[ERR]: unexpected response code %d\n", frame.code);
+            break;
+        }
+        // an empty name means there are no boxes
+        if (entry->box_name[0] != '\0') {
+            if (box_count == capacity) {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                box_entry_t *grown = realloc(entries, capacity * sizeof(box_entry_t));
+                if (grown == NULL) {
+                    fprintf(stderr, "[ERR]: out of memory\n");
+                    break;
+                }
+                entries = grown;
+            }
+            entries[box_count++] = *entry;
+        }
+        if (entry->last) {
             break;
         }
-        char box_name[32];
-        size_t box_size;
-        size_t n_publishers;
-        size_t n_subscribers;
-        sscanf(buffer, "%s %zu %zu %zu", box_name, &box_size, &n_publishers, &n_subscribers);
-        fprintf("%s %zu %zu %zu\n", box_name, box_size, n_publishers, n_subscribers);
-        box_count++;
     }
+    // Close the pipe for reading
+    close(rx);
+
     if (box_count == 0) {
         fprintf(stdout, "NO BOXES FOUND\n");
     }
-    // Close the pipe for reading
-    close(rx);
-    // Close the register pipe
-    close(register_pipe);
-    // Unlink the client pipe
-    unlink(client_pipe_name);
+    qsort(entries, box_count, sizeof(box_entry_t), compare_entries);
+    for (size_t i = 0; i < box_count; i++) {
+        fprintf(stdout, "%s %zu %zu %zu\n", entries[i].box_name, (size_t)entries[i].box_size,
+                (size_t)entries[i].n_publishers, (size_t)entries[i].n_subscribers);
+    }
+    free(entries);
     return 0;
+}
+
+int main(int argc, char **argv) {
+    
+    // Check if the correct number of arguments are passed in and Print usage if not and return an error code
+    if (argc < 4) {
+        print_usage();
+        return 1;
     }
+
+    char *register_pipe_name = argv[1]; // name of the pipe to register to mbroker
+    char *client_pipe_name = argv[2]; // name of the pipe for the responses
+    char *operation = argv[3]; // operation to be performed (create/remove/list)
+
+    op_code_t code;
+    overflow_policy_t policy = POLICY_DROP_OLDEST;
+    unsigned long queue_length = 0;
+    if (strcmp(operation, "create") == 0 && argc == 5) {
+        code = OP_CREATE_BOX;
+    } else if (strcmp(operation, "create") == 0 && (argc == 6 || argc == 7)) {
+        // create with a slow subscriber policy
+        code = OP_CREATE_POLICY_BOX;
+        if (strcmp(argv[5], "drop") == 0) {
+            policy = POLICY_DROP_OLDEST;
+        } else if (strcmp(argv[5], "block") == 0) {
+            policy = POLICY_BLOCK;
+        } else if (strcmp(argv[5], "disconnect") == 0) {
+            policy = POLICY_DISCONNECT;
+        } else {
+            print_usage();
+            return 1;
+        }
+        char *end = NULL;
+        if (argc == 7 && ((queue_length = strtoul(argv[6], &end, 10)) == 0 || *end != '\0' || queue_length > UINT32_MAX)) {
+            print_usage();
+            return 1;
+        }
+    } else if (strcmp(operation, "remove") == 0 && argc == 5) {
+        code = OP_REMOVE_BOX;
+    } else if (strcmp(operation, "list") == 0 && argc == 4) {
+        code = OP_LIST_BOXES;
+    } else {
+        print_usage();
+        return 1;
+    }
+
+    // Create the client pipe, removing a stale one
+    if (unlink(client_pipe_name) != 0 && errno != ENOENT) {
+        fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", client_pipe_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (mkfifo(client_pipe_name, 0640) == -1) {
+        fprintf(stderr, "[ERR]: mkfifo failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    int result;
+    if (code == OP_LIST_BOXES) {
+        result = list_boxes(register_pipe_name, client_pipe_name);
+    } else if (code == OP_CREATE_POLICY_BOX) {
+        // [ code = 12 (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ] | [ policy (uint8_t) ] | [ queue_length (uint32_t) ]
+        policy_request_t request;
+        size_t len = encode_policy_request(&request, client_pipe_name, argv[4], policy, (uint32_t)queue_length);
+        result = box_operation(register_pipe_name, client_pipe_name, &request, len);
+    } else {
+        // [ code (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ]
+        request_t request;
+        size_t len = encode_request(&request, code, client_pipe_name, argv[4]);
+        result = box_operation(register_pipe_name, client_pipe_name, &request, len);
+    }
+
+    // Remove the client pipe before exiting
+    unlink(client_pipe_name);
+    return result == 0 ? 0 : 1;
 }
@@ -1,4 +1,6 @@
 #include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,423 +13,1813 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include "operations.h"
 #include "config.h"
-#include "state.h"
-#include "send_msg.h"
+#include "producer-consumer.h"
+#include "protocol.h"
 
-// Number of inodes
-#define MAX_BOXES 64
+// Buckets of the box registry
+#define REGISTRY_BUCKETS 64
 
-//global variables
-int num_boxes = 0;
+// Size of a box path ("/" followed by the box name)
+#define BOX_PATH_SIZE (1 + BOX_NAME_SIZE)
+
+// The dispatcher reads the register pipe this many requests at a time
+#define DISPATCH_BUFFER_SIZE (64 * REQUEST_SIZE)
+
+// Subscribers a box can have at once
+#define MAX_SUBSCRIBERS 32
+
+// Bytes of the most recent messages each box keeps in memory
+#define BOX_RING_SIZE (8192)
+
+// Largest segment of a box log, header included, which is also the TFS block
+// size: a TFS file takes a single block
+#define BOX_SEGMENT_SIZE (16384)
+// Segment numbers have six digits
+#define MAX_SEGMENT 999999
+// Size of a segment path (a box path followed by ".000001")
+#define SEGMENT_PATH_SIZE (BOX_PATH_SIZE + 7)
+// Files the file system holds; each segment takes one, and one block. The root
+// directory takes one more file, and every box at least one segment, so this
+// bounds the boxes to MAX_FILES - 1, and what all boxes retain together to
+// MAX_FILES - 1 segments (about 8 MB): past that, retention makes room
+#define MAX_FILES 512
+// Blocks the file system holds: one for each file, and those the root
+// directory chains for their entries
+#define MAX_BLOCKS (MAX_FILES + MAX_FILES * (MAX_FILE_NAME + sizeof(int)) / BOX_SEGMENT_SIZE + 1)
+
+// Messages queued for each subscriber before the policy of its box applies,
+// unless the box asks for another length (up to SUBSCRIBER_QUEUE_MAX)
+#define SUBSCRIBER_QUEUE_LENGTH 256
+#define SUBSCRIBER_QUEUE_MAX 4096
+// Bytes of the ring copied at a time to catch a lagging subscriber up
+#define CATCH_UP_CHUNK 4096
+// Largest frame a publisher sends
+#define PUBLISHER_FRAME_MAX (MAX_BATCH_SIZE > MESSAGE_FRAME_SIZE ? MAX_BATCH_SIZE : MESSAGE_FRAME_SIZE)
+// Events an I/O thread handles per epoll_wait
+#define IO_EVENTS 64
+
+typedef struct session session_t;
+typedef struct io_thread io_thread_t;
+
+// Header of a segment file, ahead of its messages: where the segment starts
+// in the box. With the segment numbers in the file names, the headers are the
+// manifest of the box (its first and active segments, and where each one
+// starts), so a box needs no file, and no block, of its own for it
+typedef struct {
+    uint64_t start;
+} segment_header_t;
+
+// Bytes of messages a segment holds
+#define SEGMENT_CAPACITY (BOX_SEGMENT_SIZE - sizeof(segment_header_t))
+
+_Static_assert(MESSAGE_SIZE <= SEGMENT_CAPACITY, "a segment holds at least one message");
 
 // Message box data structure
+// The messages, each one terminated by '\0', are appended to a log of segment
+// files, first_segment to active_segment, each starting at
+// *segment_start(box, segment) bytes into the box and holding whole messages.
+// New messages go to the active segment, and a new one is started when the
+// next message does not fit. Retention deletes whole segments from the start
+// of the log, so the box holds bytes start to size; once the file system is
+// full, they are taken from the box with the most segments (see
+// reclaim_segment), so a busy box cannot starve the others. The ring holds the last
+// ring_len bytes of the log, starting at ring[ring_start], so new
+// subscribers catch up from memory and only go to TFS for messages older than
+// that. subscribers_lock protects the whole box; appends to the log and the
+// ring happen with it held, so both always agree. Lagging subscribers read
+// segments with the box unlocked; segments_lock is held for reading while
+// they do, and for writing to unlink a segment.
+// subscribers holds the session of each subscriber, whose pipe stays open for
+// as long as the session lasts, and publisher the session of the publisher.
+// Boxes are reference counted: the registry holds a reference, and so does
+// every session on the box, so a removed box (unlinked from the registry and
+// marked removed) is only freed once its last session ends.
+// Each subscriber has a queue of at most queue_limit bytes of frames; policy
+// says what happens to a subscriber whose queue is full (see deliver). A
+// publisher held back by the block policy waits on queue_room.
 typedef struct message_box {
-    char name[32]; 
+    char name[BOX_PATH_SIZE]; 
+    struct message_box *next;
+    atomic_int refs;
+    bool removed;
     int num_subscribers;
     int num_messages;
-    int num_publishers;   
-    char subscriber_pipes[32][256];
-    char publisher_pipe[256];
+    session_t *subscribers[MAX_SUBSCRIBERS];
+    session_t *publisher;
+    size_t size;
+    size_t start;
+    uint32_t first_segment;
+    uint32_t active_segment;
+    size_t *segment_starts;
+    size_t segments_capacity;
+    char *ring;
+    size_t ring_start;
+    size_t ring_len;
+    overflow_policy_t policy;
+    size_t queue_limit;
     pthread_mutex_t subscribers_lock;
+    pthread_rwlock_t segments_lock;
+    pthread_cond_t queue_room;
 } message_box_t;
 
+// Publisher or subscriber session
+// A session is served either by the worker that accepted it, which blocks on
+// its pipe until it ends (io is NULL), or by an I/O thread of the event loop.
+// Event loop sessions use non-blocking pipes: publishers keep what they sent
+// of the next frames in in, and frames for subscribers wait in the out buffer (protected by
+// out_lock) until the pipe has room, with EPOLLOUT requested meanwhile.
+// The out buffer is also the queue of a subscriber served by a worker, which
+// polls its pipe, to find out when the subscriber goes away, along with
+// ready_fd, an eventfd signalled once frames are queued or the session ends.
+// A lagging subscriber gets nothing queued by publishers: the thread serving
+// it reads the box, from offset catch_up, until it reaches the end (see
+// session_catch_up); segment holds the first segment_len bytes of messages of
+// segment segment_number of the box, the last one it read (0 for none). A publisher held back by the block policy is paused,
+// out of its I/O thread's epoll instance.
+struct session {
+    int fd;
+    bool publisher;
+    message_box_t *box;
+    char pipe[CLIENT_PIPE_PATH_SIZE];
+    io_thread_t *io;
+    uint8_t *in;
+    size_t in_len;
+    pthread_mutex_t out_lock;
+    char *out;
+    size_t out_start;
+    size_t out_len;
+    size_t out_capacity;
+    bool want_out;
+    int ready_fd;
+    bool ended;
+    bool lagging;
+    size_t catch_up;
+    char *segment;
+    uint32_t segment_number;
+    size_t segment_len;
+    bool paused;
+    session_t *next_closing;
+};
 
-// Array of message boxes
-message_box_t *boxes[MAX_BOXES];
+// I/O thread of the event loop
+// Each one has its own epoll instance; sessions other threads drop are queued
+// on closing and the thread is woken up through wake_fd to close them.
+struct io_thread {
+    pthread_t tid;
+    int epoll_fd;
+    int wake_fd;
+    pthread_mutex_t closing_lock;
+    session_t *closing;
+};
+
+// I/O threads, none unless the event loop is enabled
+io_thread_t *io_threads;
+size_t num_io_threads = 0;
+
+// Box registry: a hash table from box name to box, chained through next.
+// registry_lock is taken for reading to look boxes up and for writing to add
+// or remove them, always before any box lock.
+message_box_t *registry[REGISTRY_BUCKETS];
+int num_boxes = 0;
+pthread_rwlock_t registry_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-// Threads
-pthread_t *worker_threads;
+// Requests read by the dispatcher, waiting for a worker
+pc_queue_t requests;
 
 // Register pipe file descriptor
 int reg_pipe;
 
-int box_exists(const char *name) {
-    //lookup for the box with the given name
-    int inode_num = tfs_lookup(name, inode_get(ROOT_DIR_INUM));
-    if (inode_num != -1) {
-        return 1; // box with this name already exists
+// Bucket of the registry a box name hashes to (FNV-1a)
+static size_t box_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 16777619u;
+    }
+    return hash % REGISTRY_BUCKETS;
+}
+
+// Finds a box by name in the registry (registry_lock must be held)
+static message_box_t *registry_find(const char *name) {
+    for (message_box_t *box = registry[box_hash(name)]; box != NULL; box = box->next) {
+        if (strcmp(box->name + 1, name) == 0) {
+            return box;
+        }
+    }
+    return NULL;
+}
+
+// Looks up a box by name and takes a reference to it, NULL if there is none
+static message_box_t *box_get(const char *name) {
+    pthread_rwlock_rdlock(&registry_lock);
+    message_box_t *box = registry_find(name);
+    if (box != NULL) {
+        atomic_fetch_add(&box->refs, 1);
+    }
+    pthread_rwlock_unlock(&registry_lock);
+    return box;
+}
+
+// Drops a reference to a box, freeing it with the last one
+static void box_put(message_box_t *box) {
+    if (atomic_fetch_sub(&box->refs, 1) == 1) {
+        pthread_mutex_destroy(&box->subscribers_lock);
+        pthread_rwlock_destroy(&box->segments_lock);
+        pthread_cond_destroy(&box->queue_room);
+        free(box->segment_starts);
+        free(box->ring);
+        free(box);
+    }
+}
+
+// Where a segment of the box starts in the box; segment_starts is a ring
+// indexed by segment number
+static size_t *segment_start(const message_box_t *box, uint32_t segment) {
+    return &box->segment_starts[segment % box->segments_capacity];
+}
+
+// Path of a segment of the box ("/<box>.000001" for the first)
+static void segment_path(char *path, const message_box_t *box, uint32_t segment) {
+    snprintf(path, SEGMENT_PATH_SIZE, "%s.%06u", box->name, segment);
+}
+
+// Whether a box name could be taken for a segment of another box
+static bool segment_like(const char *name) {
+    size_t len = strlen(name);
+    if (len < 7 || name[len - 7] != '.') {
+        return false;
+    }
+    for (size_t i = len - 6; i < len; i++) {
+        if (name[i] < '0' || name[i] > '9') {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Creates a segment of the box, starting start bytes into the box, with just
+// its header; the header takes the segment's block, so appends never fail for
+// lack of room
+// Returns -1 if the file system has no room for it
+static int segment_create(const message_box_t *box, uint32_t segment, size_t start) {
+    char path[SEGMENT_PATH_SIZE];
+    segment_path(path, box, segment);
+    segment_header_t header = {.start = start};
+    int fd = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    ssize_t written = fd == -1 ? -1 : tfs_write(fd, &header, sizeof(header));
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+    if (written != (ssize_t)sizeof(header)) {
+        if (fd != -1) {
+            tfs_unlink(path);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Creates the next segment of the box, starting at its current end, and makes
+// it the active one (the box must be locked)
+// Returns -1 with errno ENOSPC if the file system has no room for it
+static int box_rotate(message_box_t *box) {
+    uint32_t segment = box->active_segment + 1;
+    if (segment > MAX_SEGMENT) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (segment - box->first_segment >= box->segments_capacity) {
+        size_t capacity = box->segments_capacity * 2;
+        size_t *starts = malloc(capacity * sizeof(size_t));
+        if (starts == NULL) {
+            return -1;
+        }
+        for (uint32_t s = box->first_segment; s < segment; s++) {
+            starts[s % capacity] = *segment_start(box, s);
+        }
+        free(box->segment_starts);
+        box->segment_starts = starts;
+        box->segments_capacity = capacity;
+    }
+    if (segment_create(box, segment, box->size) == -1) {
+        errno = ENOSPC;
+        return -1;
+    }
+    box->active_segment = segment;
+    *segment_start(box, segment) = box->size;
+    return 0;
+}
+
+// Retention: deletes the oldest segment of the box, and the messages in it
+// (the box must be locked)
+// Returns -1 if only the active segment is left
+static int box_drop_segment(message_box_t *box) {
+    if (box->first_segment == box->active_segment) {
+        return -1;
+    }
+    char path[SEGMENT_PATH_SIZE];
+    segment_path(path, box, box->first_segment);
+    pthread_rwlock_wrlock(&box->segments_lock);
+    if (tfs_unlink(path) == -1) {
+        WARN("Error: failed to unlink segment %s\n", path);
     }
-    return 0; // box with this name does not exist
+    pthread_rwlock_unlock(&box->segments_lock);
+    box->first_segment++;
+    box->start = *segment_start(box, box->first_segment);
+    WARN("Message box %s dropped its oldest segment\n", box->name + 1);
+    return 0;
 }
 
-// Create a new message box
-int create_message_box(const char *name) {
-    char full_name[32];
-    snprintf(full_name, 32, "/%s", name);    
+// Retention once the file system is full: deletes the oldest segment of the
+// box with the most segments, so every box keeps its fair share of the file
+// system however busy the others are (registry_lock must be held, and no box
+// lock)
+// Returns -1 if no box has a segment other than its active one
+static int reclaim_segment(void) {
+    message_box_t *largest = NULL;
+    uint32_t most = 1;
+    for (size_t bucket = 0; bucket < REGISTRY_BUCKETS; bucket++) {
+        for (message_box_t *box = registry[bucket]; box != NULL; box = box->next) {
+            pthread_mutex_lock(&box->subscribers_lock);
+            uint32_t segments = box->active_segment - box->first_segment + 1;
+            pthread_mutex_unlock(&box->subscribers_lock);
+            if (segments > most) {
+                largest = box;
+                most = segments;
+            }
+        }
+    }
+    if (largest == NULL) {
+        return -1;
+    }
+    pthread_mutex_lock(&largest->subscribers_lock);
+    int result = box_drop_segment(largest);
+    pthread_mutex_unlock(&largest->subscribers_lock);
+    return result;
+}
+
+// Create a new message box, whose subscribers may queue queue_length
+// messages (0 for the default) before policy applies
+int create_message_box(const char *name, overflow_policy_t policy, uint32_t queue_length) {
+    char full_name[BOX_PATH_SIZE];
+    snprintf(full_name, BOX_PATH_SIZE, "/%s", name);    
+    pthread_rwlock_wrlock(&registry_lock);
     // Check if a box with the same name already exists
-    if (tfs_lookup(full_name, inode_get(ROOT_DIR_INUM)) == -1) {
+    if (registry_find(name) != NULL) {
+        pthread_rwlock_unlock(&registry_lock);
         fprintf(stdout, "ERROR Box %s already exists\n", name);
         return -1;
     }
-    if (num_boxes >= MAX_BOXES) {
-        fprintf(stdout, "ERROR Cannot create more message boxes. Maximum limit reached.\n");
+    if (segment_like(name)) {
+        pthread_rwlock_unlock(&registry_lock);
+        fprintf(stdout, "ERROR Box name %s is reserved for segments\n", name);
         return -1;
     }
 
-    int handle = tfs_open(full_name, TFS_O_CREAT);
-    if (handle == -1) {
+    // Initialize variables
+    message_box_t *box = malloc(sizeof(message_box_t));
+    char *ring = malloc(BOX_RING_SIZE);
+    size_t *segment_starts = malloc(8 * sizeof(size_t));
+    int created = -1;
+    // there is no fixed limit on boxes: one is refused when no box has a
+    // segment to spare for its first one
+    if (box != NULL && ring != NULL && segment_starts != NULL) {
+        // the log starts with an empty first segment
+        snprintf(box->name, BOX_PATH_SIZE, "%s", full_name);
+        while ((created = segment_create(box, 1, 0)) == -1 && reclaim_segment() == 0) {
+        }
+    }
+    if (created == -1) {
+        pthread_rwlock_unlock(&registry_lock);
         fprintf(stdout, "ERROR Failed to create message box %s\n", name);
+        free(box);
+        free(ring);
+        free(segment_starts);
         return -1;
     }
-    // Initialize variables
-    message_box_t *box = malloc(sizeof(message_box_t));
-    snprintf(box->name, 32, "%s", full_name);
-    memset(box->subscriber_pipes, 0, sizeof(box->subscriber_pipes));
-    memset(box->publisher_pipe, 0, sizeof(box->publisher_pipe));
+    atomic_init(&box->refs, 1); // the registry's
+    box->removed = false;
+    memset(box->subscribers, 0, sizeof(box->subscribers));
+    box->publisher = NULL;
     box->num_subscribers = 0;
-    box->num_publishers = 0;
     box->num_messages = 0;
-    boxes[handle] = box;
+    box->size = 0;
+    box->start = 0;
+    box->first_segment = 1;
+    box->active_segment = 1;
+    box->segment_starts = segment_starts;
+    box->segments_capacity = 8;
+    *segment_start(box, 1) = 0;
+    box->ring = ring;
+    box->ring_start = 0;
+    box->ring_len = 0;
+    box->policy = policy;
+    if (queue_length == 0) {
+        queue_length = SUBSCRIBER_QUEUE_LENGTH;
+    }
+    box->queue_limit = (queue_length < SUBSCRIBER_QUEUE_MAX ? queue_length : SUBSCRIBER_QUEUE_MAX) * MESSAGE_FRAME_SIZE;
+    pthread_mutex_init(&box->subscribers_lock, NULL);
+    pthread_rwlock_init(&box->segments_lock, NULL);
+    pthread_cond_init(&box->queue_room, NULL);
+
+    size_t bucket = box_hash(name);
+    box->next = registry[bucket];
+    registry[bucket] = box;
     num_boxes++;
-    pthread_mutex_init(&box->lock, NULL);
+    pthread_rwlock_unlock(&registry_lock);
     fprintf(stdout, "OK\n");
-    return handle;
+    return 0;
 }
 
+static void end_box_sessions(message_box_t *box);
+
 // Remove message box
+// The box leaves the registry and its files are unlinked right away, and every
+// session on it is ended; sessions still holding it free it as they go.
 int remove_message_box(const char *name) {
-    char full_name[32];
-    snprintf(full_name, 32, "/%s", name);
-    int result = tfs_unlink(full_name);
-    if (result == -1) {
+    pthread_rwlock_wrlock(&registry_lock);
+    message_box_t **link = &registry[box_hash(name)];
+    while (*link != NULL && strcmp((*link)->name + 1, name) != 0) {
+        link = &(*link)->next;
+    }
+    message_box_t *box = *link;
+    if (box == NULL) {
+        pthread_rwlock_unlock(&registry_lock);
         fprintf(stdout, "ERROR removing Box %s\n", name);
         return -1;
     }
+    *link = box->next;
+    num_boxes--;
+
+    pthread_mutex_lock(&box->subscribers_lock);
+    box->removed = true;
+    // still under registry_lock, so a box created with the same name
+    // cannot get these files
+    char path[SEGMENT_PATH_SIZE];
+    pthread_rwlock_wrlock(&box->segments_lock);
+    for (uint32_t segment = box->first_segment; segment <= box->active_segment; segment++) {
+        segment_path(path, box, segment);
+        tfs_unlink(path);
+    }
+    pthread_rwlock_unlock(&box->segments_lock);
+    end_box_sessions(box);
+    pthread_mutex_unlock(&box->subscribers_lock);
+    pthread_rwlock_unlock(&registry_lock);
+    box_put(box);
     return 0;
 }
 
-// Find a message box 
-int find_box(const char *name) {
-    char full_name[32];
-    snprintf(full_name, 32, "/%s", name); 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-    int inum = tfs_lookup(full_name, root_dir_inode);
-    if (inum >= 0) {
-        inode_t *inode = inode_get(inum);
-        if (inode != NULL) {
-            return inum;
+// Appends bytes to the ring of a box, evicting the oldest ones once it is full
+// (the box must be locked)
+static void ring_append(message_box_t *box, const char *data, size_t len) {
+    if (len >= BOX_RING_SIZE) {
+        // only the tail of the data fits
+        data += len - BOX_RING_SIZE;
+        len = BOX_RING_SIZE;
+        box->ring_start = 0;
+        box->ring_len = 0;
+    }
+    if (box->ring_len + len > BOX_RING_SIZE) {
+        size_t evicted = box->ring_len + len - BOX_RING_SIZE;
+        box->ring_start = (box->ring_start + evicted) % BOX_RING_SIZE;
+        box->ring_len -= evicted;
+    }
+    size_t end = (box->ring_start + box->ring_len) % BOX_RING_SIZE;
+    size_t first = BOX_RING_SIZE - end < len ? BOX_RING_SIZE - end : len;
+    memcpy(box->ring + end, data, first);
+    memcpy(box->ring, data + first, len - first);
+    box->ring_len += len;
+}
+
+// Copies len bytes of the ring of a box, starting from byte from of the ring
+// (oldest first) (the box must be locked)
+static void ring_copy(const message_box_t *box, size_t from, char *dest, size_t len) {
+    size_t start = (box->ring_start + from) % BOX_RING_SIZE;
+    size_t first = BOX_RING_SIZE - start < len ? BOX_RING_SIZE - start : len;
+    memcpy(dest, box->ring + start, first);
+    memcpy(dest + first, box->ring, len - first);
+}
+
+// Reads the first len bytes of messages of a segment of the box; TFS files
+// are only read from the start, so callers read a segment whole, once.
+// The box need not be locked: segments_lock keeps the segment from being
+// unlinked meanwhile.
+static int read_segment(message_box_t *box, uint32_t segment, char *dest, size_t len) {
+    char path[SEGMENT_PATH_SIZE];
+    segment_path(path, box, segment);
+    pthread_rwlock_rdlock(&box->segments_lock);
+    int fd = tfs_open(path, 0);
+    segment_header_t header;
+    int result = fd == -1 || tfs_read(fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ? -1 : 0;
+    size_t done = 0;
+    while (result == 0 && done < len) {
+        ssize_t ret = tfs_read(fd, dest + done, len - done);
+        if (ret <= 0) {
+            result = -1;
+        } else {
+            done += (size_t)ret;
+        }
+    }
+    if (fd != -1) {
+        tfs_close(fd);
+    }
+    pthread_rwlock_unlock(&box->segments_lock);
+    return result;
+}
+
+// The segment of the box holding the byte at offset (the box must be locked)
+static uint32_t segment_at(const message_box_t *box, size_t offset) {
+    uint32_t low = box->first_segment;
+    uint32_t high = box->active_segment;
+    while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
+        if (*segment_start(box, middle) <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
+
+// Appends '\0'-terminated messages to the log of the box, starting a new
+// segment whenever the next message does not fit in the active one
+// (the box must be locked)
+// Returns how many bytes were appended, always whole messages; errno is
+// ENOSPC if it stopped short for lack of room for a new segment
+static size_t box_append(message_box_t *box, const char *messages, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        size_t active_start = *segment_start(box, box->active_segment);
+        size_t room = SEGMENT_CAPACITY - (box->size - active_start);
+        size_t fits = 0;
+        const char *end;
+        while (done + fits < len &&
+               (end = memchr(messages + done + fits, '\0', len - done - fits)) != NULL &&
+               (size_t)(end - messages) + 1 - done <= room) {
+            fits = (size_t)(end - messages) + 1 - done;
+        }
+        if (fits == 0) {
+            if (box_rotate(box) == -1) {
+                return done;
+            }
+            continue;
+        }
+
+        char path[SEGMENT_PATH_SIZE];
+        segment_path(path, box, box->active_segment);
+        int fd = tfs_open(path, TFS_O_APPEND);
+        ssize_t written = fd == -1 ? -1 : tfs_write(fd, messages + done, fits);
+        if (fd != -1) {
+            tfs_close(fd);
+        }
+        if (written <= 0) {
+            errno = EIO;
+            return done;
+        }
+        // a segment never outgrows its block, so writes are never cut short
+        box->size += (size_t)written;
+        done += (size_t)written;
+    }
+    return done;
+}
+
+// Position of a subscriber session in the box, -1 if it is not there
+// (the box must be locked)
+static int subscriber_index(const message_box_t *box, const session_t *session) {
+    for (int i = 0; i < box->num_subscribers; i++) {
+        if (box->subscribers[i] == session) {
+            return i;
         }
     }
     return -1;
 }
 
-// Associates a subscriber with a message box
+// Whether a client pipe is subscribed to the box (the box must be locked)
+static bool pipe_subscribed(const message_box_t *box, const char *pipe_name) {
+    for (int i = 0; i < box->num_subscribers; i++) {
+        if (strcmp(box->subscribers[i]->pipe, pipe_name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void io_close_later(session_t *session);
+static void queue_room_locked(message_box_t *box);
+
+// Wakes up the worker serving a subscriber session
+static void session_ready(session_t *session) {
+    uint64_t one = 1;
+    if (write(session->ready_fd, &one, sizeof(one)) == -1) {
+        WARN("Error: failed to wake up subscriber pipe %s: %s\n", session->pipe, strerror(errno));
+    }
+}
+
+// Removes the i-th subscriber of the box, ending its session
+// (the box must be locked)
+static void drop_subscriber(message_box_t *box, int i) {
+    session_t *session = box->subscribers[i];
+    for (; i < box->num_subscribers - 1; i++) {
+        box->subscribers[i] = box->subscribers[i + 1];
+    }
+    box->num_subscribers--;
+    if (session->io != NULL) {
+        io_close_later(session);
+    } else {
+        pthread_mutex_lock(&session->out_lock);
+        session->ended = true;
+        session_ready(session);
+        pthread_mutex_unlock(&session->out_lock);
+    }
+    queue_room_locked(box);
+}
+
+// Ends every session on a box being removed (the box must be locked); a
+// worker serving its publisher finds out on the next publish
+static void end_box_sessions(message_box_t *box) {
+    while (box->num_subscribers > 0) {
+        drop_subscriber(box, box->num_subscribers - 1);
+    }
+    session_t *publisher = box->publisher;
+    box->publisher = NULL;
+    if (publisher != NULL && publisher->io != NULL) {
+        io_close_later(publisher);
+    }
+}
+
+// Sets up a session for a client pipe that is already open; the session
+// takes over the caller's reference to the box
+static void session_init(session_t *session, int fd, message_box_t *box, const char *pipe_name) {
+    memset(session, 0, sizeof(*session));
+    session->fd = fd;
+    session->box = box;
+    snprintf(session->pipe, sizeof(session->pipe), "%s", pipe_name);
+    session->ready_fd = -1;
+    pthread_mutex_init(&session->out_lock, NULL);
+}
+
+// Releases what a session holds, other than its pipe
+static void session_destroy(session_t *session) {
+    pthread_mutex_destroy(&session->out_lock);
+    if (session->ready_fd != -1) {
+        close(session->ready_fd);
+    }
+    free(session->in);
+    free(session->out);
+    free(session->segment);
+    box_put(session->box);
+}
+
+static void session_free(session_t *session) {
+    session_destroy(session);
+    free(session);
+}
+
+// Writes as much of the output buffer of a session as the pipe takes, and
+// only asks for EPOLLOUT while something is left (out_lock must be held)
+// Returns -1 if the subscriber is gone
+static int session_flush(session_t *session) {
+    while (session->out_len > 0) {
+        ssize_t ret = write(session->fd, session->out + session->out_start, session->out_len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return -1;
+        }
+        session->out_start += (size_t)ret;
+        session->out_len -= (size_t)ret;
+    }
+    if (session->out_len == 0) {
+        session->out_start = 0;
+    }
+    bool want_out = session->out_len > 0;
+    if (want_out != session->want_out) {
+        struct epoll_event event = {.events = want_out ? EPOLLOUT : 0, .data.ptr = session};
+        if (epoll_ctl(session->io->epoll_fd, EPOLL_CTL_MOD, session->fd, &event) == -1) {
+            return -1;
+        }
+        session->want_out = want_out;
+    }
+    return 0;
+}
+
+// Appends frames to the output buffer of a session (out_lock must be held)
+static int out_append(session_t *session, const void *frames, size_t len) {
+    if (session->out_start + session->out_len + len > session->out_capacity) {
+        // compact, and grow if that is not enough
+        memmove(session->out, session->out + session->out_start, session->out_len);
+        session->out_start = 0;
+        if (session->out_len + len > session->out_capacity) {
+            size_t capacity = session->out_capacity == 0 ? MESSAGE_FRAME_SIZE : session->out_capacity;
+            while (capacity < session->out_len + len) {
+                capacity *= 2;
+            }
+            char *out = realloc(session->out, capacity);
+            if (out == NULL) {
+                return -1;
+            }
+            session->out = out;
+            session->out_capacity = capacity;
+        }
+    }
+    memcpy(session->out + session->out_start + session->out_len, frames, len);
+    session->out_len += len;
+    return 0;
+}
+
+// Whether the queue of a subscriber session is full (out_lock must be held)
+static bool session_full(const session_t *session) {
+    return session->out_len >= session->box->queue_limit;
+}
+
+// Queues the messages of the box a lagging session has yet to get, up to its
+// queue limit, and ends the lag once it reaches the end of the box. Messages
+// still in the ring are copied with the box locked; older ones are read from
+// their segment with it unlocked, so publishers never wait for the file
+// system on behalf of a subscriber. Each segment is read whole into the
+// session, and queued from there, so catching up reads it once (the active
+// one again only if it has grown by the time the session gets there). With
+// the event loop, goes on for as long as the pipe takes what is queued.
+// Only the thread serving the session calls this, with no lock held; nothing
+// else moves catch_up while the session lags.
+// Returns -1 if the subscriber is gone
+static int session_catch_up(session_t *session) {
+    message_box_t *box = session->box;
+    char chunk[CATCH_UP_CHUNK];
+    int result = 0;
+    pthread_mutex_lock(&box->subscribers_lock);
+    pthread_mutex_lock(&session->out_lock);
+    while (!box->removed && session->lagging && session->out_len + MESSAGE_FRAME_SIZE <= box->queue_limit) {
+        if (session->catch_up < box->start) {
+            WARN("Subscriber pipe %s missed messages dropped by retention\n", session->pipe);
+            session->catch_up = box->start;
+        }
+        size_t from = session->catch_up;
+        size_t ring_from = box->size - box->ring_len;
+        const char *source;
+        size_t len;
+        if (from >= ring_from) {
+            len = box->size - from;
+            if (len > sizeof(chunk)) {
+                len = sizeof(chunk);
+            }
+            ring_copy(box, from - ring_from, chunk, len);
+            source = chunk;
+        } else {
+            uint32_t segment = segment_at(box, from);
+            size_t segment_offset = from - *segment_start(box, segment);
+            if (session->segment_number != segment || segment_offset >= session->segment_len) {
+                // snapshot how far the segment goes, and read it with the box
+                // unlocked; segments hold whole messages
+                size_t segment_end = segment == box->active_segment ? box->size : *segment_start(box, segment + 1);
+                size_t segment_len = segment_end - *segment_start(box, segment);
+                session->segment_number = 0;
+                pthread_mutex_unlock(&session->out_lock);
+                pthread_mutex_unlock(&box->subscribers_lock);
+                if (session->segment == NULL) {
+                    session->segment = malloc(SEGMENT_CAPACITY);
+                }
+                int read = session->segment == NULL ? -1 : read_segment(box, segment, session->segment, segment_len);
+                pthread_mutex_lock(&box->subscribers_lock);
+                pthread_mutex_lock(&session->out_lock);
+                if (read == -1) {
+                    if (box->removed || segment < box->first_segment) {
+                        continue; // removed, or dropped by retention meanwhile
+                    }
+                    WARN("Error: failed to read segment %u of message box %s\n", segment, box->name);
+                    result = -1;
+                    break;
+                }
+                session->segment_number = segment;
+                session->segment_len = segment_len;
+                continue; // retention may have moved the start meanwhile
+            }
+            source = session->segment + segment_offset;
+            len = session->segment_len - segment_offset;
+        }
+        size_t offset = 0;
+        const char *end;
+        while (session->out_len + MESSAGE_FRAME_SIZE <= box->queue_limit &&
+               (end = memchr(source + offset, '\0', len - offset)) != NULL) {
+            message_t frame;
+            encode_message(&frame, OP_DELIVER, source + offset);
+            if (out_append(session, &frame, MESSAGE_FRAME_SIZE) == -1) {
+                result = -1;
+                break;
+            }
+            offset = (size_t)(end - source) + 1;
+        }
+        if (result == -1) {
+            break;
+        }
+        session->catch_up += offset;
+        // what is read holds whole messages, so if none was taken from it
+        // the box ends there; new messages are queued as they are published
+        // once the lag ends, which happens with the box locked
+        if (offset == 0 || session->catch_up == box->size) {
+            session->lagging = false;
+            // the segment is only needed again if the session lags again
+            free(session->segment);
+            session->segment = NULL;
+            session->segment_number = 0;
+        }
+        if (session->io != NULL) {
+            if (session_flush(session) == -1) {
+                result = -1;
+                break;
+            }
+            if (session->out_len > 0) {
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&session->out_lock);
+    pthread_mutex_unlock(&box->subscribers_lock);
+    return result;
+}
+
+// Has the I/O thread of a session called back as soon as its pipe has room,
+// even with nothing queued, so it catches a lagging session up
+// (out_lock must be held)
+static int session_want_out(session_t *session) {
+    if (!session->want_out) {
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = session};
+        if (epoll_ctl(session->io->epoll_fd, EPOLL_CTL_MOD, session->fd, &event) == -1) {
+            return -1;
+        }
+        session->want_out = true;
+    }
+    return 0;
+}
+
+// Bytes of the box taken by the messages in a run of frames
+static size_t frames_box_size(const char *frames, size_t len) {
+    size_t size = 0;
+    for (size_t at = 0; at < len; at += MESSAGE_FRAME_SIZE) {
+        const message_t *frame = (const message_t *)(frames + at);
+        size += strnlen(frame->message, MESSAGE_SIZE) + 1;
+    }
+    return size;
+}
+
+// Drops the frames queued for a session, along with the len bytes of frames
+// being delivered (the last messages in the box), so it catches up from the
+// box starting with the oldest of them (the box must be locked and out_lock held)
+// A frame the pipe took part of is kept, so the next one starts a frame. The
+// catch-up itself is left to the thread serving the session.
+static int session_drop_oldest(session_t *session, const char *frames, size_t len) {
+    const message_box_t *box = session->box;
+    size_t partial = session->out_len % MESSAGE_FRAME_SIZE;
+    size_t dropped = frames_box_size(session->out + session->out_start + partial, session->out_len - partial);
+    session->catch_up = box->size - frames_box_size(frames, len) - dropped;
+    session->out_len = partial;
+    session->lagging = true;
+    WARN("Subscriber pipe %s fell behind, catching up from the box\n", session->pipe);
+    if (session->io == NULL) {
+        session_ready(session);
+        return 0;
+    }
+    // the I/O thread catches up once the pipe takes what is left
+    return session_want_out(session);
+}
+
+// Queues frames for a subscriber session, applying the policy of the box if
+// they do not fit its queue (a publish larger than the whole queue only fits
+// an empty one): the frames are dropped (the subscriber catches up from
+// the box), queued anyway (the publisher waits before sending more) or the
+// session ends. With the event loop, writes what the pipe takes right away.
+// (the box must be locked)
+// Returns -1 if the session must end
+static int deliver(session_t *session, const void *frames, size_t len) {
+    const message_box_t *box = session->box;
+    int result = 0;
+    pthread_mutex_lock(&session->out_lock);
+    bool fits = session->out_len == 0 || session->out_len + len <= box->queue_limit;
+    if (session->lagging) {
+        // they are in the box, where it reads them from
+    } else if (!fits && box->policy == POLICY_DISCONNECT) {
+        errno = ENOBUFS;
+        result = -1;
+    } else if (!fits && box->policy == POLICY_DROP_OLDEST) {
+        result = session_drop_oldest(session, frames, len);
+    } else if ((result = out_append(session, frames, len)) == 0) {
+        if (session->io != NULL) {
+            result = session_flush(session);
+        } else {
+            session_ready(session);
+        }
+    }
+    pthread_mutex_unlock(&session->out_lock);
+    return result;
+}
+
+// Whether a subscriber of the box has a full queue (the box must be locked)
+static bool box_backlogged(message_box_t *box) {
+    for (int i = 0; i < box->num_subscribers; i++) {
+        session_t *session = box->subscribers[i];
+        pthread_mutex_lock(&session->out_lock);
+        bool full = session_full(session);
+        pthread_mutex_unlock(&session->out_lock);
+        if (full) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lets the publisher of a box with the block policy go on, once no subscriber
+// queue is full (the box must be locked)
+static void queue_room_locked(message_box_t *box) {
+    if (box->policy != POLICY_BLOCK || box_backlogged(box)) {
+        return;
+    }
+    pthread_cond_broadcast(&box->queue_room);
+    session_t *publisher = box->publisher;
+    if (publisher != NULL && publisher->paused) {
+        publisher->paused = false;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = publisher};
+        if (epoll_ctl(publisher->io->epoll_fd, EPOLL_CTL_ADD, publisher->fd, &event) == -1) {
+            WARN("Error: failed to resume publisher pipe %s: %s\n", publisher->pipe, strerror(errno));
+        }
+    }
+}
+
+// Called by whoever drains a subscriber queue that was full
+static void queue_room(message_box_t *box) {
+    if (box->policy == POLICY_BLOCK) {
+        pthread_mutex_lock(&box->subscribers_lock);
+        queue_room_locked(box);
+        pthread_mutex_unlock(&box->subscribers_lock);
+    }
+}
+
+// Removes a subscriber session from its box, unless someone else already did
+static void end_subscriber(session_t *session) {
+    message_box_t *box = session->box;
+    pthread_mutex_lock(&box->subscribers_lock);
+    int i = subscriber_index(box, session);
+    if (i != -1) {
+        drop_subscriber(box, i);
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+}
+
+// Waits until frames are queued for a subscriber session or it ends, with no
+// lock held
+// Returns -1 if the subscriber is gone
+static int subscriber_wait(session_t *session) {
+    struct pollfd fds[] = {
+        {.fd = session->fd, .events = 0},
+        {.fd = session->ready_fd, .events = POLLIN},
+    };
+    while (poll(fds, 2, -1) == -1) {
+        if (errno != EINTR) {
+            WARN("Error: failed to wait on subscriber pipe %s: %s\n", session->pipe, strerror(errno));
+            return -1;
+        }
+    }
+    if (fds[0].revents & (POLLERR | POLLHUP)) {
+        WARN("Subscriber pipe %s was closed\n", session->pipe);
+        return -1;
+    }
+    uint64_t count;
+    if (read(session->ready_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        WARN("Error: failed to read wake-up counter: %s\n", strerror(errno));
+    }
+    return 0;
+}
+
+// Runs the worker side of a subscriber session: takes the whole queue at
+// once, swapping buffers with the session, and writes it to the pipe,
+// catching it up from the box while it lags, until the session is dropped or
+// the subscriber goes away, which it notices even while the box is idle
+static void subscriber_run(session_t *session) {
+    message_box_t *box = session->box;
+    char *batch = NULL;
+    size_t batch_capacity = 0;
+    pthread_mutex_lock(&session->out_lock);
+    while (!session->ended) {
+        if (session->out_len == 0 && session->lagging) {
+            pthread_mutex_unlock(&session->out_lock);
+            int result = session_catch_up(session);
+            pthread_mutex_lock(&session->out_lock);
+            if (result == -1) {
+                break;
+            }
+            continue;
+        }
+        if (session->out_len == 0) {
+            pthread_mutex_unlock(&session->out_lock);
+            int result = subscriber_wait(session);
+            pthread_mutex_lock(&session->out_lock);
+            if (result == -1) {
+                break;
+            }
+            continue;
+        }
+        bool room = session_full(session);
+        char *frames = session->out;
+        size_t capacity = session->out_capacity;
+        size_t start = session->out_start;
+        size_t len = session->out_len;
+        session->out = batch;
+        session->out_capacity = batch_capacity;
+        session->out_start = 0;
+        session->out_len = 0;
+        batch = frames;
+        batch_capacity = capacity;
+        pthread_mutex_unlock(&session->out_lock);
+
+        if (room) {
+            queue_room(box);
+        }
+        int result = write_frame(session->fd, batch + start, len);
+        pthread_mutex_lock(&session->out_lock);
+        if (result == -1) {
+            WARN("Error: failed to deliver to subscriber pipe %s: %s\n", session->pipe, strerror(errno));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&session->out_lock);
+    free(batch);
+    end_subscriber(session);
+}
+
+// Hands a session over to the next I/O thread (round robin); publishers are
+// woken up by incoming frames, subscribers by room in the pipe
+static int io_add_session(session_t *session) {
+    static atomic_size_t next_io_thread;
+    io_thread_t *io = &io_threads[atomic_fetch_add(&next_io_thread, 1) % num_io_threads];
+    int flags = fcntl(session->fd, F_GETFL);
+    if (flags == -1 || fcntl(session->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return -1;
+    }
+    session->io = io;
+    struct epoll_event event = {.events = session->publisher ? EPOLLIN : 0, .data.ptr = session};
+    if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, session->fd, &event) == -1) {
+        session->io = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Runs a subscriber session: the subscriber starts out lagging, so it catches
+// up with the messages already in the box, and stays subscribed, so
+// publish_message queues the new ones for it, until it closes its pipe. With
+// the event loop the worker only sets the session up, and an I/O thread takes
+// it from there.
 int add_subscriber(const char *box_name, const char *pipe_name) {
+    // Open the subscriber's pipe; closing it rejects or ends the session
+    int subscriber_fd = open(pipe_name, O_WRONLY);
+    if (subscriber_fd == -1) {
+        WARN("Error: Failed to open subscriber pipe %s: %s\n", pipe_name, strerror(errno));
+        return -1;
+    }
+
     // Find the message box with the given name
-    char full_box_name[32];
-    snprintf(full_box_name, 32, "/%s", box_name); 
-    int box_index = find_box(full_box_name);
-    if (box_index == -1) {
+    message_box_t *box = box_get(box_name);
+    if (box == NULL) {
         WARN("Error: message box %s does not exist\n", box_name);
+        close(subscriber_fd);
         return -1;
     }
 
-    pthread_mutex_lock(&boxes[box_index]->subscribers_lock);
-    // Check if the subscriber pipe is already registered
-    for (int i = 0; i < boxes[box_index]->num_subscribers; i++) {
-        if (strcmp(boxes[box_index]->subscriber_pipes[i], pipe_name) == 0) {
-            WARN("Error: subscriber pipe %s is already registered to message box %s\n", pipe_name, box_name);
-            pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
+    session_t local_session;
+    session_t *session = &local_session;
+    if (num_io_threads > 0) {
+        session = malloc(sizeof(session_t));
+        if (session == NULL) {
+            close(subscriber_fd);
+            box_put(box);
             return -1;
         }
     }
-
-    // Add the subscriber pipe to the message box
-    pthread_mutex_lock(&boxes[box_index]->subscribers_lock);
-    if (strcpy(boxes[box_index]->subscriber_pipes[boxes[box_index]->num_subscribers], pipe_name) == NULL) {
-        WARN("Error: strcpy failed when adding subscriber pipe %s to message box %s\n", pipe_name, box_name);
-        pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
+    session_init(session, subscriber_fd, box, pipe_name);
+    if (num_io_threads == 0 && (session->ready_fd = eventfd(0, EFD_NONBLOCK)) == -1) {
+        WARN("Error: failed to set up subscriber pipe %s: %s\n", pipe_name, strerror(errno));
+        close(subscriber_fd);
+        session_destroy(session);
         return -1;
     }
-    boxes[box_index]->num_subscribers++;
 
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (box->removed) {
+        WARN("Error: message box %s was removed\n", box_name);
+        goto reject;
+    }
+    // Check if the subscriber pipe is already registered
+    if (pipe_subscribed(box, pipe_name)) {
+        WARN("Error: subscriber pipe %s is already registered to message box %s\n", pipe_name, box_name);
+        goto reject;
+    }
+    if (box->num_subscribers == MAX_SUBSCRIBERS) {
+        WARN("Error: message box %s has too many subscribers\n", box_name);
+        goto reject;
+    }
+    // Register with the event loop while the box is locked, so the I/O thread
+    // cannot see the session go before it is in the box
+    if (num_io_threads > 0 && io_add_session(session) == -1) {
+        WARN("Error: failed to add subscriber pipe %s to the event loop: %s\n", pipe_name, strerror(errno));
+        goto reject;
+    }
+
+    // Add the subscriber session to the message box
+    box->subscribers[box->num_subscribers++] = session;
+    session->lagging = box->size > box->start;
+    session->catch_up = box->start;
     WARN("Successfully added subscriber pipe %s to message box %s\n", pipe_name, box_name);
+    if (num_io_threads > 0) {
+        // the I/O thread catches the session up once the pipe has room
+        pthread_mutex_lock(&session->out_lock);
+        int result = session->lagging ? session_want_out(session) : 0;
+        pthread_mutex_unlock(&session->out_lock);
+        if (result == -1) {
+            drop_subscriber(box, box->num_subscribers - 1);
+        }
+        pthread_mutex_unlock(&box->subscribers_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+
+    // Keep the pipe open until the session is dropped or the subscriber
+    // goes away; the fd is only closed once it is no longer in the box
+    subscriber_run(session);
+    close(subscriber_fd);
+    session_destroy(session);
     return 0;
+
+reject:
+    pthread_mutex_unlock(&box->subscribers_lock);
+    close(subscriber_fd);
+    if (session != &local_session) {
+        session_free(session);
+    } else {
+        session_destroy(session);
+    }
+    return -1;
 }
 
 // Removes a subscriber from the message box
 int remove_subscriber(const char *box_name, const char *pipe_name) {
-    char full_box_name[32];
-    snprintf(full_box_name, 32, "/%s", box_name); 
-    // find the index of the message box in the array of boxes
-    int box_index = find_box(full_box_name);
-    if (box_index == -1) {
+    message_box_t *box = box_get(box_name);
+    if (box == NULL) {
         WARN("Error: message box with name %s does not exist\n", box_name);
         return -1;
     }
 
-    // check if there are no subscribers
-    if(boxes[box_index]->num_subscribers == 0){
-        WARN("Error: There are no subscribers in message box %s\n", box_name);
-        return -1;
-    }
-
-    // Check if the subscriber pipe is already registered with the box
-    int pipe_index = -1;
-    pthread_mutex_lock(&boxes[box_index]->subscribers_lock);
-    for (int i = 0; i < boxes[box_index]->num_subscribers; i++) {
-        if (strcmp(boxes[box_index]->subscriber_pipes[i], pipe_name) == 0) {
-            pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
-            pipe_index = i;
+    // Check if the subscriber pipe is registered with the box
+    int result = -1;
+    pthread_mutex_lock(&box->subscribers_lock);
+    for (int i = 0; i < box->num_subscribers; i++) {
+        if (strcmp(box->subscribers[i]->pipe, pipe_name) == 0) {
+            // Remove the subscriber session
+            drop_subscriber(box, i);
+            result = 0;
             break;
         }
     }
-    if (pipe_index == -1) {
+    pthread_mutex_unlock(&box->subscribers_lock);
+    box_put(box);
+    if (result == 0) {
+        WARN("Successfully removed subscriber pipe %s from message box %s\n", pipe_name, box_name);
+    } else {
         WARN("Error: subscriber pipe %s is not registered with message box %s\n", pipe_name, box_name);
-        return -1;
     }
+    return result;
+}
 
-    // Remove the subscriber pipe
-    pthread_mutex_lock(&boxes[box_index]->subscribers_lock);
-    for (int i = pipe_index; i < boxes[box_index]->num_subscribers - 1; i++) {
-        if (strcpy(boxes[box_index]->subscriber_pipes[i], boxes[box_index]->subscriber_pipes[i + 1]) != boxes[box_index]->subscriber_pipes[i]) {
-            WARN("Error: failed to copy the subscriber pipes\n");
-            pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
-            return -1;
-        }
-    }
-    boxes[box_index]->num_subscribers--;
+static int publish_frame(message_box_t *box, uint8_t *frame, size_t len);
 
-    WARN("Successfully removed subscriber pipe %s from message box %s\n", pipe_name, box_name);
-    return 0;
+// Detaches a publisher session from its box once it ends
+// Returns false if removing the box already did, and so ended the session
+static bool detach_publisher(session_t *session) {
+    message_box_t *box = session->box;
+    pthread_mutex_lock(&box->subscribers_lock);
+    bool attached = box->publisher == session;
+    if (attached) {
+        box->publisher = NULL;
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+    return attached;
 }
 
-// Add a publisher to the message box
+// Runs a publisher session: publishes every message the publisher sends until
+// it closes its pipe. With the event loop the worker only sets the session up,
+// and an I/O thread reads the messages.
 int add_publisher(const char *box_name, const char *pipe_name) {
+    // Open the publisher's pipe; closing it rejects or ends the session
+    int publisher_pipe = open(pipe_name, O_RDONLY);
+    if (publisher_pipe < 0) {
+        WARN("Error: Failed to open publisher pipe %s: %s\n", pipe_name, strerror(errno));
+        return -1;
+    }
+
     // Find the message box with the given name
-    char full_box_name[32];
-    snprintf(full_box_name, 32, "/%s", box_name); 
-    int box_index = find_box(full_box_name);
-    if (box_index == -1) {
+    message_box_t *box = box_get(box_name);
+    if (box == NULL) {
         WARN("Error: message box %s does not exist\n", box_name);   
+        close(publisher_pipe);
         return -1;
     }
 
-    // Try to open the publisher's pipe
-    int publisher_pipe = open(pipe_name, O_WRONLY);
-    if (publisher_pipe < 0) {
-        if (errno == EOF) {
-            // Publisher has closed their end of the pipe
-            fprintf(stderr, "Publisher has closed their end of the pipe. Exiting session.\n");
+    session_t local_session;
+    session_t *session = &local_session;
+    if (num_io_threads > 0) {
+        session = malloc(sizeof(session_t));
+        if (session == NULL) {
+            close(publisher_pipe);
+            box_put(box);
             return -1;
+        }
+    }
+    session_init(session, publisher_pipe, box, pipe_name);
+    session->publisher = true;
+    session->in = malloc(PUBLISHER_FRAME_MAX);
+    if (session->in == NULL) {
+        goto reject;
+    }
+
+    // Check if the box already has a publisher
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (box->removed || box->publisher != NULL) {
+        pthread_mutex_unlock(&box->subscribers_lock);
+        if (box->removed) {
+            WARN("Error: message box %s was removed\n", box_name);
         } else {
-            WARN("Error: Failed to open publisher pipe %s: %s\n", pipe_name, strerror(errno));
-            return -1;
+            WARN("Error: Message box %s already has a publisher \n", box_name);
+        }
+        goto reject;
+    }
+    // As for subscribers, the I/O thread cannot end the session before it
+    // is in the box
+    if (num_io_threads > 0 && io_add_session(session) == -1) {
+        pthread_mutex_unlock(&box->subscribers_lock);
+        WARN("Error: failed to add publisher pipe %s to the event loop: %s\n", pipe_name, strerror(errno));
+        goto reject;
+    }
+    box->publisher = session;
+    pthread_mutex_unlock(&box->subscribers_lock);
+    WARN("Successfully added publisher pipe %s to message box %s\n", pipe_name, box_name);
+    if (num_io_threads > 0) {
+        return 0;
+    }
+
+    ssize_t ret;
+    while ((ret = read_any_frame(publisher_pipe, session->in, PUBLISHER_FRAME_MAX)) > 0) {
+        if (publish_frame(box, session->in, (size_t)ret) == -1) {
+            WARN("Error: failed to publish frame (code %d) from publisher %s\n", session->in[0], pipe_name);
+            break;
+        }
+        if (box->policy == POLICY_BLOCK) {
+            // hold the publisher back until every subscriber has room
+            pthread_mutex_lock(&box->subscribers_lock);
+            while (!box->removed && box_backlogged(box)) {
+                pthread_cond_wait(&box->queue_room, &box->subscribers_lock);
+            }
+            pthread_mutex_unlock(&box->subscribers_lock);
         }
     }
+    detach_publisher(session);
+    close(publisher_pipe);
+    session_destroy(session);
+    return 0;
 
-    // Check if the pipe already has a publisher
-    if (boxes[box_index]->num_publishers == 1) {
-        WARN("Error: Message box %s already has a publisher \n", box_name);
+reject:
+    close(publisher_pipe);
+    if (session != &local_session) {
+        session_free(session);
+    } else {
+        session_destroy(session);
+    }
+    return -1;
+}
+
+// Appends as many of the messages as the file system has room for to the box
+// log, and delivers those to each subscriber with a single write
+// Returns how many bytes were published (0 with errno ENOSPC if the file
+// system is full), -1 if the messages cannot be published
+static ssize_t publish_some(message_box_t *box, const char *messages, size_t len) {
+    const char *box_name = box->name + 1;
+    pthread_mutex_lock(&box->subscribers_lock);
+    if (box->removed) {
+        pthread_mutex_unlock(&box->subscribers_lock);
+        WARN("Error: message box %s was removed\n", box_name);
         return -1;
     }
+    // Append the messages, with their terminating '\0', to the box log
+    size_t written = box_append(box, messages, len);
+    if (written == 0) {
+        pthread_mutex_unlock(&box->subscribers_lock);
+        return errno == ENOSPC ? 0 : -1;
+    }
+    // Keep the ring in step with the log
+    ring_append(box, messages, written);
 
-    // Add the publisher pipe to the message box
-    if (strcpy(boxes[box_index]->publisher_pipe, pipe_name) == NULL) {
-        WARN("Error: strcpy failed when adding publisher pipe %s to message box %s\n", pipe_name, box_name);
+    // Encode the messages that made it into the box once for every subscriber
+    size_t count = 0;
+    for (size_t offset = 0; offset < written; offset++) {
+        count += messages[offset] == '\0';
+    }
+    message_t one_frame;
+    message_t *frames = count > 1 ? malloc(count * sizeof(message_t)) : &one_frame;
+    if (frames == NULL) {
+        pthread_mutex_unlock(&box->subscribers_lock);
+        WARN("Error: out of memory delivering to message box %s\n", box_name);
         return -1;
     }
+    size_t offset = 0;
+    for (size_t m = 0; m < count; m++) {
+        encode_message(&frames[m], OP_DELIVER, messages + offset);
+        offset += strlen(messages + offset) + 1;
+    }
+    box->num_messages += (int)count;
 
-    boxes[box_index]->num_publishers = 1;
+    //iterate over the subscribers, writing to the pipe of each session
+    for (int i = 0; count > 0 && i < box->num_subscribers; i++) {
+        //if the pipe cant be written, the subscriber is gone
+        if (deliver(box->subscribers[i], frames, count * MESSAGE_FRAME_SIZE) == -1) {
+            WARN("Error: failed to deliver to subscriber pipe %s: %s\n", box->subscribers[i]->pipe, strerror(errno));
+            drop_subscriber(box, i);
+            i--;
+        }
+    }
+    pthread_mutex_unlock(&box->subscribers_lock);
+    if (frames != &one_frame) {
+        free(frames);
+    }
+    return (ssize_t)written;
+}
 
-    WARN("Successfully added publisher pipe %s to message box %s\n", pipe_name, box_name);
+// The publisher sends messages to the message box
+// messages holds one or more messages, each terminated by '\0', which are
+// appended to the box log with a single write and delivered to each
+// subscriber with a single write; if the file system fills up, the rest go
+// once retention has made room for them
+int publish_messages(message_box_t *box, const char *messages, size_t len) {
+    while (len > 0) {
+        ssize_t published = publish_some(box, messages, len);
+        if (published == -1) {
+            WARN("Error: failed to write message to message box %s\n", box->name + 1);
+            return -1;
+        }
+        if (published == 0) {
+            pthread_rwlock_rdlock(&registry_lock);
+            int result = reclaim_segment();
+            pthread_rwlock_unlock(&registry_lock);
+            if (result == -1) {
+                WARN("Error: message box %s is full\n", box->name + 1);
+                return -1;
+            }
+        }
+        messages += published;
+        len -= (size_t)published;
+    }
     return 0;
 }
 
 // The publisher sends a message to the message box
-int publish_message(const char *box_name, const char *message) {
-    char full_box_name[32];
-    snprintf(full_box_name, 32, "/%s", box_name); 
-    // find the index of the message box in the array of boxes
-    int box_index = find_box(full_box_name);
-    if (box_index == -1) {
-        WARN("Error: message box %s not found\n", box_name);
+int publish_message(message_box_t *box, const char *message) {
+    return publish_messages(box, message, strlen(message) + 1);
+}
+
+// Publishes a frame received from a publisher: a single message, or a batch
+// unpacked into '\0'-terminated messages and published in one go
+static int publish_frame(message_box_t *box, uint8_t *frame, size_t len) {
+    if (frame[0] == OP_PUBLISH) {
+        message_t *message = decode_message(frame, len, OP_PUBLISH);
+        return message == NULL ? -1 : publish_message(box, message->message);
+    }
+    batch_t *batch = decode_batch(frame, len);
+    if (batch == NULL) {
         return -1;
     }
-    // checks if the box has no subscribers
-    if (boxes[box_index]->num_subscribers == 0) {
-        WARN("Error: no subscribers to message box %s\n", box_name);
+    if (batch->count == 0) {
+        return 0;
+    }
+    // the length prefixes make room for the terminators
+    char *messages = malloc(batch->length);
+    if (messages == NULL) {
         return -1;
     }
+    size_t messages_len = 0;
+    size_t offset = 0;
+    size_t message_len;
+    const char *message;
+    while ((message = batch_next(batch, &offset, &message_len)) != NULL) {
+        // a '\0' inside a message ends it, as it would in a code 9 frame,
+        // and it is cut to the size of one
+        message_len = strnlen(message, message_len < MESSAGE_SIZE - 1 ? message_len : MESSAGE_SIZE - 1);
+        memcpy(messages + messages_len, message, message_len);
+        messages_len += message_len;
+        messages[messages_len++] = '\0';
+    }
+    int result = messages_len == 0 ? 0 : publish_messages(box, messages, messages_len);
+    free(messages);
+    return result;
+}
 
-    int fd = tfs_open(full_box_name, TFS_O_APPEND);
-    if (fd == -1) {
-        WARN("Error: failed to open message box %s: %s\n", full_box_name, strerror(errno));
-        return -1;
+// Event loop
+
+// Asks the I/O thread of a session to close it; only the one that removed the
+// session from its box (or that never added it) does so
+static void io_close_later(session_t *session) {
+    io_thread_t *io = session->io;
+    pthread_mutex_lock(&io->closing_lock);
+    session->next_closing = io->closing;
+    io->closing = session;
+    pthread_mutex_unlock(&io->closing_lock);
+    uint64_t one = 1;
+    if (write(io->wake_fd, &one, sizeof(one)) == -1) {
+        WARN("Error: failed to wake up I/O thread: %s\n", strerror(errno));
     }
-    // Write the message to the message box file
-    if (tfs_write(fd, message, strlen(message)) == -1) {
-        WARN("Error: failed to write message to message box %s: %s\n", box_name, strerror(errno));
-        tfs_close(fd);
-        return -1;
+}
+
+static void io_close_session(session_t *session) {
+    epoll_ctl(session->io->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+    close(session->fd);
+    session_free(session);
+}
+
+// Reads whatever a publisher sent and publishes every complete frame; the
+// start of a frame stays in the session until the rest arrives
+// Returns -1 once the session is over
+static int io_read_publisher(session_t *session) {
+    while (1) {
+        ssize_t ret = read(session->fd, session->in + session->in_len, PUBLISHER_FRAME_MAX - session->in_len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (ret == 0) {
+            return -1; // the publisher closed its pipe
+        }
+        session->in_len += (size_t)ret;
+
+        size_t offset = 0;
+        while (offset < session->in_len) {
+            uint8_t *frame = session->in + offset;
+            size_t available = session->in_len - offset;
+            size_t needed = frame_needed(frame, available);
+            if (needed == 0) {
+                WARN("Error: unexpected code %d from publisher %s\n", frame[0], session->pipe);
+                return -1;
+            }
+            if (available < needed) {
+                break;
+            }
+            if (publish_frame(session->box, frame, needed) == -1) {
+                WARN("Error: failed to publish frame (code %d) from publisher %s\n", frame[0], session->pipe);
+                return -1;
+            }
+            offset += needed;
+        }
+        memmove(session->in, session->in + offset, session->in_len - offset);
+        session->in_len -= offset;
+
+        // With the block policy, stop reading until every subscriber has
+        // room; queue_room_locked resumes the session
+        message_box_t *box = session->box;
+        if (box->policy == POLICY_BLOCK) {
+            pthread_mutex_lock(&box->subscribers_lock);
+            bool pause = box->publisher == session && box_backlogged(box);
+            if (pause) {
+                session->paused = true;
+                epoll_ctl(session->io->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+            }
+            pthread_mutex_unlock(&box->subscribers_lock);
+            if (pause) {
+                return 0;
+            }
+        }
     }
+}
 
-    pthread_mutex_lock(&boxes[box_index]->subscribers_lock);
-    //iterate over the subscribers
-    for (int i = 0; i < boxes[box_index]->num_subscribers; i++) {
-        //open subscriber pipe
-        int subscriber_fd = open(boxes[box_index]->subscriber_pipes[i], O_WRONLY);
-        //if pipe cant be opened throw error
-        if (subscriber_fd == -1) {
-            WARN("Error: failed to open subscriber pipe %s: %s\n", boxes[box_index]->subscriber_pipes[i], strerror(errno));
-            pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
-            close(fd);
+// I/O thread: serves the sessions registered with its epoll instance
+static void *io_thread(void *arg) {
+    io_thread_t *io = arg;
+    struct epoll_event events[IO_EVENTS];
+    while (1) {
+        int n = epoll_wait(io->epoll_fd, events, IO_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error waiting for session events: %s\n", strerror(errno));
+            return NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            session_t *session = events[i].data.ptr;
+            if (session == NULL) {
+                // woken up to close sessions
+                uint64_t count;
+                if (read(io->wake_fd, &count, sizeof(count)) == -1) {
+                    WARN("Error: failed to read wake-up counter: %s\n", strerror(errno));
+                }
+                continue;
+            }
+            if (session->publisher) {
+                // if the box was removed, it is already being closed
+                if (io_read_publisher(session) == -1 && detach_publisher(session)) {
+                    io_close_session(session);
+                }
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                end_subscriber(session); // closed at the end of this round
+                continue;
+            }
+            pthread_mutex_lock(&session->out_lock);
+            bool was_full = session_full(session);
+            int result = session_flush(session);
+            bool room = was_full && !session_full(session);
+            bool catch_up = result == 0 && session->lagging && session->out_len == 0;
+            pthread_mutex_unlock(&session->out_lock);
+            if (catch_up) {
+                result = session_catch_up(session);
+            }
+            if (room) {
+                queue_room(session->box);
+            }
+            if (result == -1) {
+                end_subscriber(session);
+            }
+        }
+
+        // Close the sessions dropped by other threads, now that no event of
+        // this round refers to them
+        pthread_mutex_lock(&io->closing_lock);
+        session_t *closing = io->closing;
+        io->closing = NULL;
+        pthread_mutex_unlock(&io->closing_lock);
+        while (closing != NULL) {
+            session_t *next = closing->next_closing;
+            io_close_session(closing);
+            closing = next;
+        }
+    }
+}
+
+// Starts the I/O threads of the event loop
+static int io_start(size_t count) {
+    io_threads = calloc(count, sizeof(io_thread_t));
+    if (io_threads == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        io_thread_t *io = &io_threads[i];
+        io->epoll_fd = epoll_create1(0);
+        io->wake_fd = eventfd(0, EFD_NONBLOCK);
+        if (io->epoll_fd == -1 || io->wake_fd == -1) {
             return -1;
         }
-        //if pipe cant write throw error
-        if (write(subscriber_fd, message, strlen(message)) == -1) {
-            WARN("Error: failed to write to subscriber pipe %s: %s\n", boxes[box_index]->subscriber_pipes[i], strerror(errno));
-            close(subscriber_fd);
-            pthread_mutex_unlock(&boxes[box_index]->subscribers_lock);
-            close(fd);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        if (epoll_ctl(io->epoll_fd, EPOLL_CTL_ADD, io->wake_fd, &event) == -1) {
             return -1;
         }
-        close(subscriber_fd);
+        pthread_mutex_init(&io->closing_lock, NULL);
+        if (pthread_create(&io->tid, NULL, io_thread, io) != 0) {
+            return -1;
+        }
+    }
+    num_io_threads = count;
+    return 0;
+}
+
+// Sends the response to a box creation or removal request
+static void send_box_response(const char *client_pipe, op_code_t response_code, int32_t return_code, const char *error_message) {
+    int manager_pipe = open(client_pipe, O_WRONLY);
+    if (manager_pipe < 0) {
+        fprintf(stderr, "Error opening manager pipe %s: %s\n", client_pipe, strerror(errno));
+        return;
+    }
+    box_response_t frame;
+    size_t len = encode_box_response(&frame, response_code, return_code, error_message);
+    if (write_frame(manager_pipe, &frame, len) == -1) {
+        fprintf(stderr, "Error writing to manager pipe %s: %s\n", client_pipe, strerror(errno));
+    }
+    close(manager_pipe);
+}
+
+// Handles one complete request, as framed by the dispatcher
+static void handle_request(uint8_t *frame, size_t len) {
+    if (frame[0] == OP_LIST_BOXES) {
+        list_request_t *list = decode_list_request(frame, len);
+        // open the manager's named pipe for writing
+        int list_pipe = open(list->client_pipe, O_WRONLY);
+        if (list_pipe == -1) {
+            fprintf(stderr, "Error opening manager's named pipe %s\n", list->client_pipe);
+            return;
+        }
+        // snapshot the registry, then write the listing without holding it
+        pthread_rwlock_rdlock(&registry_lock);
+        size_t capacity = num_boxes > 0 ? (size_t)num_boxes : 1;
+        box_entry_t *entries = malloc(capacity * sizeof(box_entry_t));
+        size_t *lens = malloc(capacity * sizeof(size_t));
+        if (entries == NULL || lens == NULL) {
+            pthread_rwlock_unlock(&registry_lock);
+            fprintf(stderr, "Error listing boxes: out of memory\n");
+            free(entries);
+            free(lens);
+            close(list_pipe);
+            return;
+        }
+        size_t count = 0;
+        for (size_t bucket = 0; bucket < REGISTRY_BUCKETS; bucket++) {
+            for (message_box_t *box = registry[bucket]; box != NULL; box = box->next) {
+                pthread_mutex_lock(&box->subscribers_lock);
+                lens[count] = encode_box_entry(&entries[count], false, box->name + 1, box->size - box->start,
+                                               box->publisher != NULL ? 1 : 0, (uint64_t)box->num_subscribers);
+                pthread_mutex_unlock(&box->subscribers_lock);
+                count++;
+            }
+        }
+        pthread_rwlock_unlock(&registry_lock);
+        if (count == 0) {
+            // no boxes: a single entry, with an empty name, ends the listing
+            lens[count++] = encode_box_entry(&entries[0], true, "", 0, 0, 0);
+        }
+        entries[count - 1].last = 1;
+        for (size_t i = 0; i < count; i++) {
+            if (write_frame(list_pipe, &entries[i], lens[i]) == -1) {
+                fprintf(stderr, "Error writing box listing: %s\n", strerror(errno));
+                break;
+            }
+        }
+        free(entries);
+        free(lens);
+        close(list_pipe);
+        return;
+    }
+
+    if (frame[0] == OP_CREATE_POLICY_BOX) {
+        policy_request_t *request = decode_policy_request(frame, len);
+        if (request == NULL) {
+            fprintf(stderr, "Error: invalid box policy\n");
+        } else if (create_message_box(request->box_name, (overflow_policy_t)request->policy, request->queue_length) == -1) {
+            send_box_response(request->client_pipe, OP_CREATE_BOX_RESPONSE, -1, "Failed to create box");
+        } else {
+            send_box_response(request->client_pipe, OP_CREATE_BOX_RESPONSE, 0, "");
+        }
+        return;
+    }
+
+    request_t *request = decode_request(frame, len);
+    if (request == NULL) {
+        fprintf(stderr, "Error: invalid code %d\n", frame[0]);
+        return;
+    }
+    const char *client_pipe = request->client_pipe;
+    const char *box_name = request->box_name;
+    switch ((op_code_t)request->code) {
+        case OP_REGISTER_PUBLISHER: {
+            int result = add_publisher(box_name, client_pipe);
+            if (result == -1) {
+                fprintf(stderr, "Error: Failed to register publisher for message box %s with pipe %s\n", box_name, client_pipe);
+            } else {
+                fprintf(stderr, "Success: Registered publisher for message box %s with pipe %s\n", box_name, client_pipe);
+            }
+            break;
+        }
+        case OP_REGISTER_SUBSCRIBER: {
+            int result = add_subscriber(box_name, client_pipe);
+            if (result == -1) {
+                fprintf(stderr, "Error: Failed to register subscriber for message box %s with pipe %s\n", box_name, client_pipe);
+            } else {
+                fprintf(stderr, "Success: Registered subscriber for message box %s with pipe %s\n", box_name, client_pipe);
+            }
+            break;
+        }
+        case OP_CREATE_BOX:
+            if (create_message_box(box_name, POLICY_DROP_OLDEST, 0) == -1) {
+                send_box_response(client_pipe, OP_CREATE_BOX_RESPONSE, -1, "Failed to create box");
+            } else {
+                send_box_response(client_pipe, OP_CREATE_BOX_RESPONSE, 0, "");
+            }
+            break;
+        case OP_REMOVE_BOX:
+            if (remove_message_box(box_name) == -1) {
+                send_box_response(client_pipe, OP_REMOVE_BOX_RESPONSE, -1, "Failed to remove box");
+            } else {
+                send_box_response(client_pipe, OP_REMOVE_BOX_RESPONSE, 0, "");
+            }
+            break;
+        case OP_CREATE_BOX_RESPONSE:
+        case OP_REMOVE_BOX_RESPONSE:
+        case OP_LIST_BOXES:
+        case OP_LIST_BOXES_RESPONSE:
+        case OP_PUBLISH:
+        case OP_DELIVER:
+        case OP_PUBLISH_BATCH:
+        case OP_CREATE_POLICY_BOX:
+        default:
+            // decode_request only accepts the codes above
+            break;
     }
 }
 
 //Threads
+// Workers take complete requests from the queue; a NULL request stops them
 void* worker_thread(void* arg) {
-    int register_pipe = *(int *)arg;
-    char buffer[1024];
+    (void)arg;
+    uint8_t *request;
+    while ((request = pcq_dequeue(&requests)) != NULL) {
+        handle_request(request, frame_size(request[0]));
+        free(request);
+    }
+    pthread_exit(NULL);
+}
+
+// Reads the register pipe in large chunks and splits it into requests.
+// A single read may return several requests, or end in the middle of one,
+// so whatever is left of a request is kept for the next read. Only the
+// dispatcher reads the pipe, so requests are never interleaved.
+// Returns when the register pipe can no longer be read.
+static void dispatch_requests(int register_pipe) {
+    uint8_t buffer[DISPATCH_BUFFER_SIZE];
+    size_t pending = 0;
     while (1) {
-        // read from the register pipe
-        int bytes_read = read(register_pipe, buffer, 1024);
+        ssize_t bytes_read = read(register_pipe, buffer + pending, sizeof(buffer) - pending);
         if (bytes_read < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
             fprintf(stderr, "Error reading from register pipe: %s\n", strerror(errno));
-            pthread_exit(NULL);
-        }
-
-        uint8_t code = buffer[0];
-        char client_pipe[256];
-        char box_name[32];
-        char error_message[1024];
-        char* box_name = buffer + 1;
-        int32_t return_code;
-        switch (code) {
-            case 1:
-                // code for publisher registration
-                memcpy(client_pipe, buffer + 1, sizeof(client_pipe));
-                memcpy(box_name, buffer + 1 + sizeof(client_pipe), sizeof(box_name));
-                int result = add_publisher(box_name, client_pipe);
-                if (result == -1) {
-                    fprintf(stderr, "Error: Failed to register publisher for message box %s with pipe %s\n", box_name, client_pipe);
-                } else {
-                    fprintf(stderr, "Success: Registered publisher for message box %s with pipe %s\n", box_name, client_pipe);
-                }
-                break;
-            case 2: 
-                // code for subscriber registration
-                memcpy(client_pipe, buffer + 1, sizeof(client_pipe));
-                memcpy(box_name, buffer + 1 + sizeof(client_pipe), sizeof(box_name));
-                int result_add_sub = add_subscriber(box_name, client_pipe);
-                if (result_add_sub == -1) {
-                    fprintf(stderr, "Error: Failed to register subscriber for message box %s with pipe %s\n", box_name, client_pipe);
-                } else {
-                    fprintf(stderr, "Success: Registered subscriber for message box %s with pipe %s\n", box_name, client_pipe);
-                }
-                break;
-            case 3:
-                // code for box creation;
-                memcpy(client_pipe, buffer + 1, sizeof(client_pipe));
-                memcpy(box_name, buffer + 1 + sizeof(client_pipe), sizeof(box_name));
-                int result_create_box = create_message_box(box_name);
-                if (result_create_box == -1) {
-                    return_code = -1;
-                } else {
-                    return_code = 0;
-                }
-                int manager_pipe = open(client_pipe, O_WRONLY);
-                if (manager_pipe < 0) {
-                    fprintf(stderr, "Error opening manager pipe %s: %s\n", client_pipe, strerror(errno));
-                    return_code = -1;
-                    snprintf(error_message, 1024, "Error opening manager pipe %s: %s", client_pipe, strerror(errno));
-                } else {
-                    // send response to the manager
-                    uint8_t response_code = 4;
-                    char message[1040];
-                    memcpy(message, &response_code, sizeof(response_code));
-                    memcpy(message + sizeof(response_code), &return_code, sizeof(return_code));
-                    memcpy(message + sizeof(response_code) + sizeof(return_code), error_message, sizeof(error_message));
-                    send_msg(manager_pipe, message);
-                    close(manager_pipe);
-                }
-                break;
-            case 5:
-                // code for box removal
-                memcpy(client_pipe, buffer + 1, sizeof(client_pipe));
-                memcpy(box_name, buffer + 1 + sizeof(client_pipe), sizeof(box_name));
-                int result = remove_message_box(box_name);
-                if (result == -1) {
-                    return_code = -1;
-                } else {
-                    return_code = 0;
-                }
-
-                // send response to manager
-                uint8_t response_code = 6;
-                char message[1040];
-                memcpy(message, &response_code, sizeof(response_code));
-                memcpy(message + sizeof(response_code), &return_code, sizeof(return_code));
-                memcpy(message + sizeof(response_code) + sizeof(return_code), error_message, sizeof(error_message));
-                send_msg(manager_pipe, message);
-                close(manager_pipe);
-                break;
-            case 7: 
-                // code for box listing
-                // open the manager's named pipe for writing
-                int manager_pipe = open(client_pipe, O_WRONLY);
-                if (manager_pipe == -1) {
-                    fprintf(stderr, "Error opening manager's named pipe %s\n", client_pipe);
-                    return -1;
-                }
-                // iterate through all message boxes
-                int last = 1;
-                for (int i = 0; i < num_boxes; i++) {
-                    if (boxes[i] != NULL) {
-                        if (i == num_boxes - 1) {
-                            last = 1;
-                        } else {
-                            last = 0;
-                        }
-                        // send response to the manager
-                        uint8_t response_code = 8;
-                        char message[1084];
-                        memcpy(message, &response_code, sizeof(response_code));
-                        memcpy(message + sizeof(response_code), &last, sizeof(last));
-                        memcpy(message + sizeof(response_code) + sizeof(last), boxes[i]->name, sizeof(boxes[i]->name));
-                        uint64_t box_size = 1024;
-                        memcpy(message + sizeof(response_code) + sizeof(last) + sizeof(boxes[i]->name), &box_size, sizeof(box_size));
-                        memcpy(message + sizeof(response_code) + sizeof(last) + sizeof(boxes[i]->name) + sizeof(box_size), &boxes[i]->num_publishers, sizeof(boxes[i]->num_publishers));
-                        memcpy(message + sizeof(response_code) + sizeof(last) + sizeof(boxes[i]->name) + sizeof(box_size) + sizeof(boxes[i]->num_publishers), &boxes[i]->num_subscribers, sizeof(boxes[i]->num_subscribers));
-                        send_msg(manager_pipe, message);
-                    }
+            return;
+        }
+        if (bytes_read == 0) {
+            // the broker keeps the pipe open for writing, so this is not expected
+            return;
+        }
+        pending += (size_t)bytes_read;
 
-                }
-                close(manager_pipe);
-                break;
-            default:
+        size_t offset = 0;
+        while (offset < pending) {
+            uint8_t code = buffer[offset];
+            size_t size = frame_size(code);
+            if (code != OP_REGISTER_PUBLISHER && code != OP_REGISTER_SUBSCRIBER &&
+                code != OP_CREATE_BOX && code != OP_CREATE_POLICY_BOX && code != OP_REMOVE_BOX &&
+                code != OP_LIST_BOXES) {
+                // not the start of a request: skip the byte to resynchronize
                 fprintf(stderr, "Error: invalid code %d\n", code);
-                break;
+                offset++;
+                continue;
+            }
+            if (pending - offset < size) {
+                break; // the rest of the request has not arrived yet
+            }
+            uint8_t *request = malloc(size);
+            if (request == NULL) {
+                fprintf(stderr, "Error: out of memory, dropping request\n");
+            } else {
+                memcpy(request, buffer + offset, size);
+                pcq_enqueue(&requests, request);
+            }
+            offset += size;
         }
+        memmove(buffer, buffer + offset, pending - offset);
+        pending -= offset;
     }
-    pthread_exit(NULL);
 }
 
 int main(int argc, char **argv) {
-    if (argc != 2) {
-        fprintf(stderr, "usage: mbroker <pipename>\n");
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: mbroker <pipename> <max_sessions> [io_threads]\n");
         return -1;
     }
     char* register_pipe_name = argv[1];
     // Converts a string to an int
-    int MAX_SESSIONS = atoi(argv[2]);
-    pthread_t worker_threads[MAX_SESSIONS];
+    int max_sessions = atoi(argv[2]);
+    if (max_sessions <= 0) {
+        fprintf(stderr, "Error: max_sessions must be positive\n");
+        return -1;
+    }
+    pthread_t worker_threads[max_sessions];
+    // With io_threads, sessions run on an event loop served by that many
+    // threads, and workers only handle requests
+    int io_thread_count = argc == 4 ? atoi(argv[3]) : 0;
+    if (io_thread_count < 0) {
+        fprintf(stderr, "Error: io_threads must not be negative\n");
+        return -1;
+    }
 
     // Initialize the tfs
+    // A segment takes a whole TFS file
     tfs_params params = tfs_default_params();
+    params.block_size = BOX_SEGMENT_SIZE;
+    params.max_inode_count = MAX_FILES;
+    params.max_block_count = MAX_BLOCKS;
 
     if (tfs_init(&params) != 0) {
         fprintf(stderr, "Error initializing file system\n");
@@ -453,24 +1845,59 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error opening register pipe: %s\n", strerror(errno));
         return -1;
     }
+    // Sessions see closed client pipes as failed writes (EPIPE)
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        fprintf(stderr, "Error ignoring SIGPIPE: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Keep a writer open, so reads block instead of returning EOF whenever
+    // no client has the pipe open
+    int register_pipe_writer = open(register_pipe_name, O_WRONLY);
+    if (register_pipe_writer < 0) {
+        fprintf(stderr, "Error opening register pipe: %s\n", strerror(errno));
+        return -1;
+    }
+
+    // Queue of requests, one slot per session
+    if (pcq_create(&requests, (size_t)max_sessions) != 0) {
+        fprintf(stderr, "Error creating request queue\n");
+        return -1;
+    }
+
+    // Start the event loop
+    if (io_thread_count > 0 && io_start((size_t)io_thread_count) != 0) {
+        fprintf(stderr, "Error starting the I/O threads: %s\n", strerror(errno));
+        return -1;
+    }
 
     // Create worker threads
-    for (int i = 0; i < MAX_SESSIONS; i++) {
-        if (pthread_create(&worker_threads[i], NULL, worker_thread, (void*) &register_pipe) != 0) {
+    for (int i = 0; i < max_sessions; i++) {
+        if (pthread_create(&worker_threads[i], NULL, worker_thread, NULL) != 0) {
         fprintf(stderr, "Error creating worker thread: %s\n", strerror(errno));
         return -1;
         }
     }
 
+    // The main thread is the dispatcher
+    dispatch_requests(register_pipe);
+
+    // Stop the workers once they are done with the queued requests
+    for (int i = 0; i < max_sessions; i++) {
+        pcq_enqueue(&requests, NULL);
+    }
+
     // Join worker threads
-    for (int i = 0; i < MAX_SESSIONS; i++) {
+    for (int i = 0; i < max_sessions; i++) {
         if (pthread_join(worker_threads[i], NULL) != 0) {
         fprintf(stderr, "Error joining worker thread: %s\n", strerror(errno));
         return -1;
         }
     }
+    pcq_destroy(&requests);
 
     // Close the register pipe
+    close(register_pipe_writer);
     close(register_pipe);
 
     // Unlink the register pipe
@@ -0,0 +1,139 @@
+#include "producer-consumer.h"
+
+#include <stdlib.h>
+
+/*
+ * Bounded queue with one lock per end: producers serialize on pcq_tail_lock
+ * and consumers on pcq_head_lock, so an enqueue and a dequeue only meet on the
+ * short pcq_current_size_lock section. A producer writes its slot before the
+ * size counts it, and a consumer reads its slot before the size releases it,
+ * so the two ends never touch the same slot.
+ *
+ * Full and empty queues put threads to sleep on the condvars. A thread only
+ * waits while holding its end's lock, so at most one producer and one consumer
+ * are ever asleep, and only the transitions that can have left one waiting
+ * (full -> not full, empty -> not empty) need to signal.
+ */
+
+static size_t queue_size(pc_queue_t *queue) {
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    size_t size = queue->pcq_current_size;
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
+    return size;
+}
+
+// Adds `delta` (+1 or -1) to the size; returns the size before the change
+static size_t queue_resize(pc_queue_t *queue, int delta) {
+    pthread_mutex_lock(&queue->pcq_current_size_lock);
+    size_t before = queue->pcq_current_size;
+    if (delta > 0) {
+        queue->pcq_current_size++;
+    } else {
+        queue->pcq_current_size--;
+    }
+    pthread_mutex_unlock(&queue->pcq_current_size_lock);
+    return before;
+}
+
+static void wake(pthread_mutex_t *lock, pthread_cond_t *condvar) {
+    pthread_mutex_lock(lock);
+    pthread_cond_signal(condvar);
+    pthread_mutex_unlock(lock);
+}
+
+int pcq_create(pc_queue_t *queue, size_t capacity) {
+    if (queue == NULL || capacity == 0) {
+        return -1;
+    }
+
+    queue->pcq_buffer = malloc(capacity * sizeof(void *));
+    if (queue->pcq_buffer == NULL) {
+        return -1;
+    }
+    queue->pcq_capacity = capacity;
+    queue->pcq_current_size = 0;
+    queue->pcq_head = 0;
+    queue->pcq_tail = 0;
+
+    pthread_mutex_init(&queue->pcq_current_size_lock, NULL);
+    pthread_mutex_init(&queue->pcq_head_lock, NULL);
+    pthread_mutex_init(&queue->pcq_tail_lock, NULL);
+    pthread_mutex_init(&queue->pcq_pusher_condvar_lock, NULL);
+    pthread_cond_init(&queue->pcq_pusher_condvar, NULL);
+    pthread_mutex_init(&queue->pcq_popper_condvar_lock, NULL);
+    pthread_cond_init(&queue->pcq_popper_condvar, NULL);
+    return 0;
+}
+
+int pcq_destroy(pc_queue_t *queue) {
+    if (queue == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_destroy(&queue->pcq_current_size_lock);
+    pthread_mutex_destroy(&queue->pcq_head_lock);
+    pthread_mutex_destroy(&queue->pcq_tail_lock);
+    pthread_mutex_destroy(&queue->pcq_pusher_condvar_lock);
+    pthread_cond_destroy(&queue->pcq_pusher_condvar);
+    pthread_mutex_destroy(&queue->pcq_popper_condvar_lock);
+    pthread_cond_destroy(&queue->pcq_popper_condvar);
+
+    free(queue->pcq_buffer);
+    queue->pcq_buffer = NULL;
+    return 0;
+}
+
+int pcq_enqueue(pc_queue_t *queue, void *elem) {
+    if (queue == NULL) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&queue->pcq_tail_lock);
+
+    // Sleep until there is room (consumers signal when it stops being full)
+    pthread_mutex_lock(&queue->pcq_pusher_condvar_lock);
+    while (queue_size(queue) == queue->pcq_capacity) {
+        pthread_cond_wait(&queue->pcq_pusher_condvar,
+                          &queue->pcq_pusher_condvar_lock);
+    }
+    pthread_mutex_unlock(&queue->pcq_pusher_condvar_lock);
+
+    queue->pcq_buffer[queue->pcq_tail] = elem;
+    queue->pcq_tail = (queue->pcq_tail + 1) % queue->pcq_capacity;
+    size_t before = queue_resize(queue, +1);
+
+    pthread_mutex_unlock(&queue->pcq_tail_lock);
+
+    if (before == 0) {
+        wake(&queue->pcq_popper_condvar_lock, &queue->pcq_popper_condvar);
+    }
+    return 0;
+}
+
+void *pcq_dequeue(pc_queue_t *queue) {
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue->pcq_head_lock);
+
+    // Sleep until there is an element (producers signal when it stops being
+    // empty)
+    pthread_mutex_lock(&queue->pcq_popper_condvar_lock);
+    while (queue_size(queue) == 0) {
+        pthread_cond_wait(&queue->pcq_popper_condvar,
+                          &queue->pcq_popper_condvar_lock);
+    }
+    pthread_mutex_unlock(&queue->pcq_popper_condvar_lock);
+
+    void *elem = queue->pcq_buffer[queue->pcq_head];
+    queue->pcq_head = (queue->pcq_head + 1) % queue->pcq_capacity;
+    size_t before = queue_resize(queue, -1);
+
+    pthread_mutex_unlock(&queue->pcq_head_lock);
+
+    if (before == queue->pcq_capacity) {
+        wake(&queue->pcq_pusher_condvar_lock, &queue->pcq_pusher_condvar);
+    }
+    return elem;
+}
@@ -1,3 +1,4 @@
+#ifndef __PRODUCER_CONSUMER_H__
 #define __PRODUCER_CONSUMER_H__
 
 #include <pthread.h>
@@ -0,0 +1,313 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+_Static_assert(REQUEST_SIZE == 1 + 256 + 32, "request frame size");
+_Static_assert(POLICY_REQUEST_SIZE == 1 + 256 + 32 + 1 + 4, "policy request frame size");
+_Static_assert(LIST_REQUEST_SIZE == 1 + 256, "list request frame size");
+_Static_assert(BOX_RESPONSE_SIZE == 1 + 4 + 1024, "box response frame size");
+_Static_assert(BOX_ENTRY_SIZE == 1 + 1 + 32 + 3 * 8, "box entry frame size");
+_Static_assert(MESSAGE_FRAME_SIZE == 1 + 1024, "message frame size");
+
+size_t frame_size(uint8_t code) {
+    switch (code) {
+    case OP_REGISTER_PUBLISHER:
+    case OP_REGISTER_SUBSCRIBER:
+    case OP_CREATE_BOX:
+    case OP_REMOVE_BOX:
+        return REQUEST_SIZE;
+    case OP_CREATE_POLICY_BOX:
+        return POLICY_REQUEST_SIZE;
+    case OP_CREATE_BOX_RESPONSE:
+    case OP_REMOVE_BOX_RESPONSE:
+        return BOX_RESPONSE_SIZE;
+    case OP_LIST_BOXES:
+        return LIST_REQUEST_SIZE;
+    case OP_LIST_BOXES_RESPONSE:
+        return BOX_ENTRY_SIZE;
+    case OP_PUBLISH:
+    case OP_DELIVER:
+        return MESSAGE_FRAME_SIZE;
+    case OP_PUBLISH_BATCH:
+        return BATCH_HEADER_SIZE;
+    default:
+        return 0;
+    }
+}
+
+size_t frame_needed(void const *frame, size_t len) {
+    size_t size = frame_size(*(uint8_t const *)frame);
+    if (*(uint8_t const *)frame != OP_PUBLISH_BATCH || len < size) {
+        return size;
+    }
+    batch_t const *batch = frame;
+    if (batch->length > BATCH_MAX_LENGTH) {
+        return 0;
+    }
+    return size + batch->length;
+}
+
+// Copies a string into a fixed-size field, truncating it and zeroing the rest
+static void put_string(char *field, size_t size, char const *str) {
+    size_t len = str == NULL ? 0 : strnlen(str, size - 1);
+    memcpy(field, str, len);
+    memset(field + len, 0, size - len);
+}
+
+size_t encode_request(void *frame, op_code_t code, char const *client_pipe,
+                      char const *box_name) {
+    request_t *request = frame;
+    request->code = (uint8_t)code;
+    put_string(request->client_pipe, sizeof(request->client_pipe),
+               client_pipe);
+    put_string(request->box_name, sizeof(request->box_name), box_name);
+    return REQUEST_SIZE;
+}
+
+size_t encode_policy_request(void *frame, char const *client_pipe,
+                             char const *box_name, overflow_policy_t policy,
+                             uint32_t queue_length) {
+    policy_request_t *request = frame;
+    request->code = OP_CREATE_POLICY_BOX;
+    put_string(request->client_pipe, sizeof(request->client_pipe),
+               client_pipe);
+    put_string(request->box_name, sizeof(request->box_name), box_name);
+    request->policy = (uint8_t)policy;
+    request->queue_length = queue_length;
+    return POLICY_REQUEST_SIZE;
+}
+
+size_t encode_list_request(void *frame, char const *client_pipe) {
+    list_request_t *request = frame;
+    request->code = OP_LIST_BOXES;
+    put_string(request->client_pipe, sizeof(request->client_pipe),
+               client_pipe);
+    return LIST_REQUEST_SIZE;
+}
+
+size_t encode_box_response(void *frame, op_code_t code, int32_t return_code,
+                           char const *error_message) {
+    box_response_t *response = frame;
+    response->code = (uint8_t)code;
+    response->return_code = return_code;
+    put_string(response->error_message, sizeof(response->error_message),
+               error_message);
+    return BOX_RESPONSE_SIZE;
+}
+
+size_t encode_box_entry(void *frame, bool last, char const *box_name,
+                        uint64_t box_size, uint64_t n_publishers,
+                        uint64_t n_subscribers) {
+    box_entry_t *entry = frame;
+    entry->code = OP_LIST_BOXES_RESPONSE;
+    entry->last = last ? 1 : 0;
+    put_string(entry->box_name, sizeof(entry->box_name), box_name);
+    entry->box_size = box_size;
+    entry->n_publishers = n_publishers;
+    entry->n_subscribers = n_subscribers;
+    return BOX_ENTRY_SIZE;
+}
+
+size_t encode_message(void *frame, op_code_t code, char const *message) {
+    message_t *msg = frame;
+    msg->code = (uint8_t)code;
+    put_string(msg->message, sizeof(msg->message), message);
+    return MESSAGE_FRAME_SIZE;
+}
+
+size_t batch_init(void *frame) {
+    batch_t *batch = frame;
+    batch->code = OP_PUBLISH_BATCH;
+    batch->count = 0;
+    batch->length = 0;
+    return BATCH_HEADER_SIZE;
+}
+
+bool batch_add(void *frame, char const *message) {
+    batch_t *batch = frame;
+    uint16_t len = (uint16_t)strnlen(message, MESSAGE_SIZE - 1);
+    if (batch->count == BATCH_MAX_MESSAGES ||
+        batch->length + sizeof(len) + len > BATCH_MAX_LENGTH) {
+        return false;
+    }
+    memcpy(batch->messages + batch->length, &len, sizeof(len));
+    memcpy(batch->messages + batch->length + sizeof(len), message, len);
+    batch->length += (uint32_t)(sizeof(len) + len);
+    batch->count++;
+    return true;
+}
+
+size_t batch_size(void const *frame) {
+    batch_t const *batch = frame;
+    return BATCH_HEADER_SIZE + batch->length;
+}
+
+char const *batch_next(batch_t const *batch, size_t *offset,
+                       size_t *message_len) {
+    uint16_t len;
+    if (*offset + sizeof(len) > batch->length) {
+        return NULL;
+    }
+    memcpy(&len, batch->messages + *offset, sizeof(len));
+    char const *message = batch->messages + *offset + sizeof(len);
+    *offset += sizeof(len) + len;
+    *message_len = len;
+    return message;
+}
+
+// Checks the size and code of a received frame
+static bool frame_is(void const *frame, size_t len, op_code_t code) {
+    return len >= frame_size((uint8_t)code) &&
+           *(uint8_t const *)frame == (uint8_t)code;
+}
+
+request_t *decode_request(void *frame, size_t len) {
+    request_t *request = frame;
+    if (len < REQUEST_SIZE) {
+        return NULL;
+    }
+    switch (request->code) {
+    case OP_REGISTER_PUBLISHER:
+    case OP_REGISTER_SUBSCRIBER:
+    case OP_CREATE_BOX:
+    case OP_REMOVE_BOX:
+        break;
+    default:
+        return NULL;
+    }
+    request->client_pipe[sizeof(request->client_pipe) - 1] = '\0';
+    request->box_name[sizeof(request->box_name) - 1] = '\0';
+    return request;
+}
+
+policy_request_t *decode_policy_request(void *frame, size_t len) {
+    if (!frame_is(frame, len, OP_CREATE_POLICY_BOX)) {
+        return NULL;
+    }
+    policy_request_t *request = frame;
+    if (request->policy > POLICY_DISCONNECT) {
+        return NULL;
+    }
+    request->client_pipe[sizeof(request->client_pipe) - 1] = '\0';
+    request->box_name[sizeof(request->box_name) - 1] = '\0';
+    return request;
+}
+
+list_request_t *decode_list_request(void *frame, size_t len) {
+    if (!frame_is(frame, len, OP_LIST_BOXES)) {
+        return NULL;
+    }
+    list_request_t *request = frame;
+    request->client_pipe[sizeof(request->client_pipe) - 1] = '\0';
+    return request;
+}
+
+box_response_t *decode_box_response(void *frame, size_t len) {
+    if (!frame_is(frame, len, OP_CREATE_BOX_RESPONSE) &&
+        !frame_is(frame, len, OP_REMOVE_BOX_RESPONSE)) {
+        return NULL;
+    }
+    box_response_t *response = frame;
+    response->error_message[sizeof(response->error_message) - 1] = '\0';
+    return response;
+}
+
+box_entry_t *decode_box_entry(void *frame, size_t len) {
+    if (!frame_is(frame, len, OP_LIST_BOXES_RESPONSE)) {
+        return NULL;
+    }
+    box_entry_t *entry = frame;
+    entry->box_name[sizeof(entry->box_name) - 1] = '\0';
+    return entry;
+}
+
+message_t *decode_message(void *frame, size_t len, op_code_t code) {
+    if ((code != OP_PUBLISH && code != OP_DELIVER) ||
+        !frame_is(frame, len, code)) {
+        return NULL;
+    }
+    message_t *msg = frame;
+    msg->message[sizeof(msg->message) - 1] = '\0';
+    return msg;
+}
+
+batch_t *decode_batch(void *frame, size_t len) {
+    if (!frame_is(frame, len, OP_PUBLISH_BATCH)) {
+        return NULL;
+    }
+    batch_t *batch = frame;
+    if (batch->length > BATCH_MAX_LENGTH || batch->count > BATCH_MAX_MESSAGES ||
+        len < BATCH_HEADER_SIZE + batch->length) {
+        return NULL;
+    }
+    // the messages must fill the frame exactly
+    size_t offset = 0;
+    size_t message_len;
+    uint16_t count = 0;
+    while (offset + sizeof(uint16_t) <= batch->length) {
+        batch_next(batch, &offset, &message_len);
+        if (offset > batch->length || message_len >= MESSAGE_SIZE) {
+            return NULL;
+        }
+        count++;
+    }
+    if (offset != batch->length || count != batch->count) {
+        return NULL;
+    }
+    return batch;
+}
+
+int write_frame(int fd, void const *frame, size_t size) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t ret = write(fd, (char const *)frame + written, size - written);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        written += (size_t)ret;
+    }
+    return 0;
+}
+
+ssize_t read_frame(int fd, void *frame, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t ret = read(fd, (char *)frame + done, size - done);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (ret == 0) {
+            return done == 0 ? 0 : -1;
+        }
+        done += (size_t)ret;
+    }
+    return (ssize_t)size;
+}
+
+ssize_t read_any_frame(int fd, void *frame, size_t capacity) {
+    size_t done = 0;
+    size_t needed = 1;
+    while (done < needed) {
+        if (needed > capacity) {
+            return -1;
+        }
+        ssize_t ret = read_frame(fd, (char *)frame + done, needed - done);
+        if (ret <= 0) {
+            return done == 0 ? ret : -1;
+        }
+        done = needed;
+        needed = frame_needed(frame, done);
+        if (needed == 0) {
+            return -1;
+        }
+    }
+    return (ssize_t)done;
+}
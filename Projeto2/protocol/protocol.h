@@ -0,0 +1,213 @@
+#ifndef __PROTOCOL_PROTOCOL_H__
+#define __PROTOCOL_PROTOCOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Client-server wire protocol (see exercise2.md, section 2)
+//
+// Every message is a fixed-size frame that starts with its operation code.
+// Frames are packed structs: fields are laid out back to back, with integers
+// in host byte order (clients and server run on the same machine). Encoding
+// and decoding happen in place, on a buffer owned by the caller, so nothing
+// on the message path is formatted or parsed as text.
+//
+// String fields are NUL-terminated: encoding truncates strings to the field
+// size minus one, and decoding terminates the last byte of each field.
+
+// Operation codes
+typedef enum {
+    OP_REGISTER_PUBLISHER = 1,
+    OP_REGISTER_SUBSCRIBER = 2,
+    OP_CREATE_BOX = 3,
+    OP_CREATE_BOX_RESPONSE = 4,
+    OP_REMOVE_BOX = 5,
+    OP_REMOVE_BOX_RESPONSE = 6,
+    OP_LIST_BOXES = 7,
+    OP_LIST_BOXES_RESPONSE = 8,
+    OP_PUBLISH = 9,
+    OP_DELIVER = 10,
+    OP_PUBLISH_BATCH = 11,
+    OP_CREATE_POLICY_BOX = 12,
+} op_code_t;
+
+// What the broker does when a subscriber falls too far behind a box
+typedef enum {
+    POLICY_DROP_OLDEST = 0, // drop its queued messages; it catches up from the box file
+    POLICY_BLOCK = 1,       // stop taking messages from the publisher until it catches up
+    POLICY_DISCONNECT = 2,  // end its session
+} overflow_policy_t;
+
+// Size of the fields
+#define CLIENT_PIPE_PATH_SIZE (256)
+#define BOX_NAME_SIZE (32)
+#define ERROR_MESSAGE_SIZE (1024)
+#define MESSAGE_SIZE (1024)
+
+// Session and box requests (codes 1, 2, 3 and 5)
+// [ code (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ]
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    char client_pipe[CLIENT_PIPE_PATH_SIZE];
+    char box_name[BOX_NAME_SIZE];
+} request_t;
+
+// Box creation with a slow subscriber policy (code 12), answered like code 3
+// [ code = 12 (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ] | [ policy (uint8_t) ] | [ queue_length (uint32_t) ]
+// queue_length is the number of messages queued for each subscriber before
+// the policy applies (0 for the broker's default)
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    char client_pipe[CLIENT_PIPE_PATH_SIZE];
+    char box_name[BOX_NAME_SIZE];
+    uint8_t policy;
+    uint32_t queue_length;
+} policy_request_t;
+
+// Box listing request (code 7)
+// [ code = 7 (uint8_t) ] | [ client_named_pipe_path (char[256]) ]
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    char client_pipe[CLIENT_PIPE_PATH_SIZE];
+} list_request_t;
+
+// Response to a box creation or removal (codes 4 and 6)
+// [ code (uint8_t) ] | [ return_code (int32_t) ] | [ error_message (char[1024]) ]
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    int32_t return_code;
+    char error_message[ERROR_MESSAGE_SIZE];
+} box_response_t;
+
+// One entry of a box listing (code 8)
+// [ code = 8 (uint8_t) ] | [ last (uint8_t) ] | [ box_name (char[32]) ] | [ box_size (uint64_t) ] | [ n_publishers (uint64_t) ] | [ n_subscribers (uint64_t) ]
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    uint8_t last;
+    char box_name[BOX_NAME_SIZE];
+    uint64_t box_size;
+    uint64_t n_publishers;
+    uint64_t n_subscribers;
+} box_entry_t;
+
+// A message sent by a publisher or delivered to a subscriber (codes 9 and 10)
+// [ code (uint8_t) ] | [ message (char[1024]) ]
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    char message[MESSAGE_SIZE];
+} message_t;
+
+// Several messages sent by a publisher at once (code 11)
+// [ code = 11 (uint8_t) ] | [ count (uint16_t) ] | [ length (uint32_t) ] | count x ([ message_length (uint16_t) ] | [ message (char[message_length]) ])
+// length is the number of bytes after the header; messages are not
+// NUL-terminated in the frame. Unlike the other frames, its size varies.
+typedef struct __attribute__((packed)) {
+    uint8_t code;
+    uint16_t count;
+    uint32_t length;
+    char messages[];
+} batch_t;
+
+// Limits of a batch
+#define BATCH_MAX_MESSAGES (64)
+#define BATCH_MAX_LENGTH (16384)
+
+// Size of the frames
+#define REQUEST_SIZE (sizeof(request_t))
+#define POLICY_REQUEST_SIZE (sizeof(policy_request_t))
+#define LIST_REQUEST_SIZE (sizeof(list_request_t))
+#define BOX_RESPONSE_SIZE (sizeof(box_response_t))
+#define BOX_ENTRY_SIZE (sizeof(box_entry_t))
+#define MESSAGE_FRAME_SIZE (sizeof(message_t))
+#define BATCH_HEADER_SIZE (sizeof(batch_t))
+#define MAX_BATCH_SIZE (BATCH_HEADER_SIZE + BATCH_MAX_LENGTH)
+
+// Size of the largest fixed-size frame
+#define MAX_FRAME_SIZE (sizeof(box_response_t))
+
+// frame_size: size of the frame of an operation (the header, for a batch)
+//
+// Returns 0 if code is not an operation code
+size_t frame_size(uint8_t code);
+
+// frame_needed: size of the frame that starts with the len (> 0) bytes given
+//
+// For a batch this is only known once its header is in; until then it is the
+// size of the header. The frame is complete once len reaches the result.
+//
+// Returns 0 if the frame is not valid
+size_t frame_needed(void const *frame, size_t len);
+
+// encode_*: write a frame into a caller buffer of (at least) its size
+//
+// Returns the size of the frame
+size_t encode_request(void *frame, op_code_t code, char const *client_pipe,
+                      char const *box_name);
+size_t encode_policy_request(void *frame, char const *client_pipe,
+                             char const *box_name, overflow_policy_t policy,
+                             uint32_t queue_length);
+size_t encode_list_request(void *frame, char const *client_pipe);
+size_t encode_box_response(void *frame, op_code_t code, int32_t return_code,
+                           char const *error_message);
+size_t encode_box_entry(void *frame, bool last, char const *box_name,
+                        uint64_t box_size, uint64_t n_publishers,
+                        uint64_t n_subscribers);
+size_t encode_message(void *frame, op_code_t code, char const *message);
+
+// batch_init: start an empty batch in a caller buffer of MAX_BATCH_SIZE bytes
+//
+// Returns the size of the frame
+size_t batch_init(void *frame);
+
+// batch_add: append a message (truncated to MESSAGE_SIZE - 1) to a batch
+//
+// Returns false, leaving the batch as it was, if the message does not fit
+bool batch_add(void *frame, char const *message);
+
+// batch_size: current size of a batch frame
+size_t batch_size(void const *frame);
+
+// batch_next: iterate over the messages of a decoded batch
+//
+// Memory: offset must start at 0; the message is not NUL-terminated
+//
+// Returns the next message, and its length in message_len, or NULL after
+// the last one
+char const *batch_next(batch_t const *batch, size_t *offset,
+                       size_t *message_len);
+
+// decode_*: check a received frame and view it as its struct
+//
+// The frame is decoded in place: its string fields are terminated inside the
+// caller buffer, which the returned pointer points into
+//
+// Returns NULL if the frame is shorter than its struct or has another code
+request_t *decode_request(void *frame, size_t len);
+policy_request_t *decode_policy_request(void *frame, size_t len);
+list_request_t *decode_list_request(void *frame, size_t len);
+box_response_t *decode_box_response(void *frame, size_t len);
+box_entry_t *decode_box_entry(void *frame, size_t len);
+message_t *decode_message(void *frame, size_t len, op_code_t code);
+batch_t *decode_batch(void *frame, size_t len);
+
+// write_frame: write a whole frame to a pipe, retrying partial writes
+//
+// Returns 0 if successful, -1 otherwise (with errno set)
+int write_frame(int fd, void const *frame, size_t size);
+
+// read_frame: read a whole frame of the given size from a pipe
+//
+// Returns the size if successful, 0 if the pipe was closed before the frame
+// started, and -1 on error or if it was closed in the middle of the frame
+ssize_t read_frame(int fd, void *frame, size_t size);
+
+// read_any_frame: read a whole frame of any kind (fixed-size or batch) from a
+// pipe into a buffer of the given capacity
+//
+// Returns the size of the frame, 0 if the pipe was closed before the frame
+// started, and -1 on error or if the frame is not valid or does not fit
+ssize_t read_any_frame(int fd, void *frame, size_t capacity);
+
+#endif // __PROTOCOL_PROTOCOL_H__
@@ -11,30 +11,88 @@
 #include <sys/wait.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include "logging.h"
-#include "send_msg.h"
+#include "protocol.h"
 
-#define REGISTER_PIPE_NAME "mbroker_register.pipe"
-#define CLIENT_PIPE_NAME_SIZE (256)
-#define MESSAGE_SIZE (1024)
-#define SUBSCRIBER_MESSAGE_SIZE (1024)
+// How long a message may wait for others to join its batch
+#define BATCH_LINGER_MS 5
+// Bytes of stdin read at a time
+#define INPUT_BUFFER_SIZE 4096
+
+// Batch being filled, and when it must be sent at the latest
+static uint8_t batch[MAX_BATCH_SIZE];
+static struct timespec batch_deadline;
+
+// Milliseconds until the batch must be sent
+static int ms_until_deadline(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (batch_deadline.tv_sec - now.tv_sec) * 1000 + (batch_deadline.tv_nsec - now.tv_nsec) / 1000000;
+    return ms < 0 ? 0 : (int)ms;
+}
+
+// Sends the batch, if it has any message, and starts a new one
+static int flush_batch(int tx) {
+    int result = 0;
+    if (((batch_t *)batch)->count > 0) {
+        result = write_frame(tx, batch, batch_size(batch));
+    }
+    batch_init(batch);
+    return result;
+}
+
+// Adds a message to the batch, sending the batch first if the message does
+// not fit and right after if it is now full
+static int add_message(int tx, const char *message) {
+    batch_t *current = (batch_t *)batch;
+    if (current->count == 0) {
+        clock_gettime(CLOCK_MONOTONIC, &batch_deadline);
+        batch_deadline.tv_nsec += BATCH_LINGER_MS * 1000000L;
+        if (batch_deadline.tv_nsec >= 1000000000L) {
+            batch_deadline.tv_sec++;
+            batch_deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    if (!batch_add(batch, message)) {
+        if (flush_batch(tx) == -1) {
+            return -1;
+        }
+        return add_message(tx, message);
+    }
+    if (current->count == BATCH_MAX_MESSAGES) {
+        return flush_batch(tx);
+    }
+    return 0;
+}
 
 
 int main(int argc, char **argv) {
-    if (argc < 3) {
-        fprintf(stderr, "usage: pub <register_pipe_name> <box_name>\n");
+    if (argc < 4) {
+        fprintf(stderr, "usage: pub <register_pipe_name> <pipe_name> <box_name>\n");
         return 0;
     }
 
     // Register to the mbroker
     char *register_pipe_name = argv[1];
+    // Pipe for the session
+    char *client_pipe_name = argv[2];
     // Box_name to publish 
-    char *box_name = argv[2];
+    char *box_name = argv[3];
+
+    // The broker closes the session pipe to reject or end the session;
+    // writes then fail with EPIPE instead of killing the publisher
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+        exit(EXIT_FAILURE);
+    }
 
-    // Open the client pipe for writing
-    char client_pipe_name[CLIENT_PIPE_NAME_SIZE];
-    int client_pipe = mkfifo(client_pipe_name, 0640);
-    if (client_pipe == -1) {
+    // Create the client pipe, removing a stale one
+    if (unlink(client_pipe_name) != 0 && errno != ENOENT) {
+        fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", client_pipe_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (mkfifo(client_pipe_name, 0640) == -1) {
         fprintf(stderr, "[ERR]: mkfifo failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
@@ -43,55 +101,76 @@ int main(int argc, char **argv) {
     int register_pipe = open(register_pipe_name, O_WRONLY);
     if (register_pipe == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
         exit(EXIT_FAILURE);
     }
 
-    // Publisher code
-    uint8_t code = 1;
-    char message[MESSAGE_SIZE];
     // [ code = 1 (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ]
-    snprintf(message, MESSAGE_SIZE, "%d %s %s", code, client_pipe_name, box_name);
-    send_msg(register_pipe, message);
+    request_t request;
+    size_t len = encode_request(&request, OP_REGISTER_PUBLISHER, client_pipe_name, box_name);
+    if (write_frame(register_pipe, &request, len) == -1) {
+        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
+        exit(EXIT_FAILURE);
+    }
     close(register_pipe);
+
     // Open the pipe for writing
     int tx = open(client_pipe_name, O_WRONLY);
     if (tx == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
         exit(EXIT_FAILURE);
     }
-   
-    // Read response from server
-    uint8_t response_code;
-    int32_t return_code;
-    char error_message[1024];
-
-//Read the first byte of the response from the mbroker, which contains the response code
-read(tx, &response_code, sizeof(response_code));
 
-//Check if the response code is 2, which means the request was processed by the mbroker
-if (response_code == 2) {
-    //Read the next 4 bytes of the response, which contains the return code of the request
-    read(tx, &return_code, sizeof(return_code));
-
-    //Check if the return code is -1, which means an error occurred
-    if (return_code == -1) {
-        //Read the rest of the response, which contains the error message
-        read(tx, error_message, sizeof(error_message));
-        //Print the error message to the stderr
-        fprintf(stderr, "[ERR]: %s\n", error_message);
+    // Send messages from stdin, one per line, without the trailing '\n'.
+    // Lines are batched: a batch is sent once it is full, or once its first
+    // message has waited BATCH_LINGER_MS for more input.
+    char input[INPUT_BUFFER_SIZE];
+    char line[MESSAGE_SIZE];
+    size_t line_len = 0;
+    int result = 0;
+    batch_init(batch);
+    while (result == 0) {
+        struct pollfd in = {.fd = STDIN_FILENO, .events = POLLIN};
+        int timeout = ((batch_t *)batch)->count > 0 ? ms_until_deadline() : -1;
+        int ready = poll(&in, 1, timeout);
+        if (ready < 0 && errno != EINTR) {
+            fprintf(stderr, "[ERR]: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (ready <= 0) {
+            result = flush_batch(tx); // the linger time is over
+            continue;
+        }
+        ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+        if (n <= 0) {
+            break; // end of input
+        }
+        for (ssize_t i = 0; i < n && result == 0; i++) {
+            if (input[i] == '\n') {
+                line[line_len] = '\0';
+                result = add_message(tx, line);
+                line_len = 0;
+            } else if (line_len < MESSAGE_SIZE - 1) {
+                line[line_len++] = input[i]; // longer lines are truncated
+            }
+        }
     }
-}
-
-    // Send messages from stdin
-    char buffer[MESSAGE_SIZE];
-    while (fgets(buffer, MESSAGE_SIZE, stdin) != NULL) {
-        code = 9;
-        snprintf(message, MESSAGE_SIZE, "%d %s", code, buffer);
-        send_msg(tx, message);
+    // A last line without a '\n' is a message too
+    if (result == 0 && line_len > 0) {
+        line[line_len] = '\0';
+        result = add_message(tx, line);
+    }
+    if (result == 0) {
+        result = flush_batch(tx);
+    }
+    if (result == -1) {
+        fprintf(stderr, "[ERR]: session closed by mbroker: %s\n", strerror(errno));
     }
 
     // Close the session
     close(tx);
     unlink(client_pipe_name);
     return 0;   
-}
\ No newline at end of file
+}
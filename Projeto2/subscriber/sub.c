@@ -12,14 +12,11 @@
 #include <unistd.h>
 #include <signal.h>
 #include "logging.h"
-#include "send_msg.h"
-
-#define REGISTER_PIPE_NAME "mbroker_register.pipe"
-#define CLIENT_PIPE_NAME_SIZE (256)
-#define MESSAGE_SIZE (1+256+32)
+#include "protocol.h"
 
 
 int message_count = 0;
+char *client_pipe_name;
 
 static void sig_handler(int sig) {
     if (sig == SIGINT) {
@@ -30,15 +27,16 @@ static void sig_handler(int sig) {
     // Prints number of messages received before exiting
     fprintf(stderr, "Number of messages received before exiting - %d\n", message_count);
     // Leave session
+    unlink(client_pipe_name);
     exit(EXIT_SUCCESS);
 }
 
 
 int main(int argc, char **argv) {
     
-    //check if the number of arguments passed is less than 3
-    if (argc < 3) {
-        fprintf(stderr, "usage: sub <register_pipe_name> <box_name>\n");
+    //check if the number of arguments passed is less than 4
+    if (argc < 4) {
+        fprintf(stderr, "usage: sub <register_pipe_name> <pipe_name> <box_name>\n");
         return 0;
     }
     
@@ -49,13 +47,17 @@ int main(int argc, char **argv) {
 
     // Register to the mbroker
     char *register_pipe_name = argv[1];
+    // Pipe for the session
+    client_pipe_name = argv[2];
     // Box_name to subscribe 
-    char *box_name = argv[2];
+    char *box_name = argv[3];
 
-    // Open the client pipe for reading
-    char client_pipe_name[CLIENT_PIPE_NAME_SIZE];
-    int client_pipe = mkfifo(client_pipe_name, 0640);
-    if (client_pipe == -1) {
+    // Create the client pipe, removing a stale one
+    if (unlink(client_pipe_name) != 0 && errno != ENOENT) {
+        fprintf(stderr, "[ERR]: unlink(%s) failed: %s\n", client_pipe_name, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (mkfifo(client_pipe_name, 0640) == -1) {
         fprintf(stderr, "[ERR]: mkfifo failed: %s\n", strerror(errno));
         exit(EXIT_FAILURE);
     }
@@ -64,60 +66,58 @@ int main(int argc, char **argv) {
     int register_pipe = open(register_pipe_name, O_WRONLY);
     if (register_pipe == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
         exit(EXIT_FAILURE);
     }
     
-    // Subscribing code
-    uint8_t code = 2; 
-    char message[MESSAGE_SIZE];
     // [ code = 2 (uint8_t) ] | [ client_named_pipe_path (char[256]) ] | [ box_name (char[32]) ]
-    snprintf(message, MESSAGE_SIZE, "%d %s %s", code, client_pipe_name, box_name);
-    send_msg(register_pipe, message);
+    request_t request;
+    size_t len = encode_request(&request, OP_REGISTER_SUBSCRIBER, client_pipe_name, box_name);
+    if (write_frame(register_pipe, &request, len) == -1) {
+        fprintf(stderr, "[ERR]: write failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
+        exit(EXIT_FAILURE);
+    }
+    // Close the register pipe
+    close(register_pipe);
 
     // Open the pipe for reading
     int rx = open(client_pipe_name, O_RDONLY);
     if (rx == -1) {
         fprintf(stderr, "[ERR]: open failed: %s\n", strerror(errno));
+        unlink(client_pipe_name);
         exit(EXIT_FAILURE);
     }
     
-    // Print out any existing messages
-    char buffer[MESSAGE_SIZE];
-    ssize_t ret;
+    // Print out the existing messages, then the new ones as they arrive,
+    // until the broker ends the session
+    message_t frame;
     while (true) {
-        // read from the pipe into buffer
-        ret = read(rx, buffer, MESSAGE_SIZE - 1);
+        ssize_t ret = read_frame(rx, &frame, MESSAGE_FRAME_SIZE);
         // Check for read error
         if (ret < 0) {
             fprintf(stderr, "[ERR]: read failed: %s\n", strerror(errno));
-            exit(EXIT_FAILURE);
+            break;
         } 
         // check for end of file reached
         else if (ret == 0) {
             break;
         }
-        // Check if the message is sent by the server with code 10
-        uint8_t message_code = buffer[0];
-        if (message_code == 10) {
-            // Extract the message from the buffer
-            char *message = buffer + sizeof(uint8_t);
-            message_count++;
-            fprintf(stdout, "%s\n", message);
-        }
-        // Check if the message is the end of subscription message
-        if (strcmp(buffer, "/0") == 0) {
-            break;
+        message_t *message = decode_message(&frame, (size_t)ret, OP_DELIVER);
+        if (message == NULL) {
+            fprintf(stderr, "[ERR]: unexpected message code %d\n", frame.code);
+            continue;
         }
+        message_count++;
+        fprintf(stdout, "%s\n", message->message);
     }
 
     // Close the pipe for reading
     close(rx);
-    // Close the register pipe
-    close(register_pipe);
     // Unlink the client pipe
     unlink(client_pipe_name);
     // Print out the number of messages received
     fprintf(stderr, "Number of messages received before exiting - %d\n", message_count);
     // Exit the program
     return 0;
-}
\ No newline at end of file
+}
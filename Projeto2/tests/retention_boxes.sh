@@ -0,0 +1,41 @@
+#!/bin/bash
+# Retention must not let one busy box take the whole file system: after a
+# flood of messages to box1, box2 still grows past one segment, and a third
+# box can still be created
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d)
+trap 'kill $broker 2>/dev/null; rm -rf "$dir"' EXIT
+
+mbroker/mbroker "$dir/reg" 2 2>/dev/null &
+broker=$!
+sleep 0.3
+manager="timeout 5 manager/manager $dir/reg $dir/mgr"
+$manager create box1 >/dev/null || exit 1
+$manager create box2 >/dev/null || exit 1
+
+message=$(head -c 1023 /dev/zero | tr '\0' 'm')
+yes "$message" | head -n 9000 > "$dir/flood"
+head -n 100 "$dir/flood" > "$dir/some"
+timeout 60 publisher/pub "$dir/reg" "$dir/p1" box1 < "$dir/flood" || { echo "FAIL: box1 publisher"; exit 1; }
+timeout 10 publisher/pub "$dir/reg" "$dir/p2" box2 < "$dir/some" || { echo "FAIL: box2 publisher"; exit 1; }
+$manager create box3 >/dev/null || { echo "FAIL: could not create box3"; exit 1; }
+
+# list shows the bytes each box still holds: box1 gave up its oldest segments
+# to box2 and box3
+listing=$($manager list) || { echo "FAIL: manager list"; exit 1; }
+box1=$(awk '$1 == "box1" { print $2 }' <<< "$listing")
+box2=$(awk '$1 == "box2" { print $2 }' <<< "$listing")
+if [ -z "$box1" ] || [ "$box1" -ge 9216000 ] || [ "$box2" != 102400 ] ||
+   ! grep -q "^box3 0 " <<< "$listing"; then
+    echo "FAIL: unexpected listing"
+    echo "$listing"
+    exit 1
+fi
+
+# box2 kept all of its messages
+timeout -s INT 2 subscriber/sub "$dir/reg" "$dir/s2" box2 > "$dir/received" 2>/dev/null
+if ! diff -q "$dir/received" "$dir/some" >/dev/null; then
+    echo "FAIL: box2 lost messages ($(wc -l < "$dir/received") of 100 received)"
+    exit 1
+fi
+echo "OK"
@@ -0,0 +1,29 @@
+#!/bin/bash
+# Subscribers served by workers that go away while the box is idle must free
+# their workers: with as many sessions as workers, the manager is only served
+# once both are back
+cd "$(dirname "$0")/.." || exit 1
+dir=$(mktemp -d)
+trap 'kill $broker 2>/dev/null; rm -rf "$dir"' EXIT
+
+mbroker/mbroker "$dir/reg" 2 2>/dev/null &
+broker=$!
+sleep 0.3
+manager="timeout 5 manager/manager $dir/reg $dir/mgr"
+$manager create box >/dev/null || exit 1
+
+subscriber/sub "$dir/reg" "$dir/s1" box >/dev/null 2>&1 &
+s1=$!
+subscriber/sub "$dir/reg" "$dir/s2" box >/dev/null 2>&1 &
+s2=$!
+sleep 0.3
+kill -INT $s1 $s2
+wait $s1 $s2
+sleep 0.3
+
+listing=$($manager list) || { echo "FAIL: manager list did not return"; exit 1; }
+if [ "$listing" != "box 0 0 0" ]; then
+    echo "FAIL: expected \"box 0 0 0\", listed \"$listing\""
+    exit 1
+fi
+echo "OK"
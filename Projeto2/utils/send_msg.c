@@ -26,6 +26,6 @@ void send_msg(int tx, char const *str) {
             exit(EXIT_FAILURE);
         }
 
-        written += ret;
+        written += (size_t)ret;
     }
 }